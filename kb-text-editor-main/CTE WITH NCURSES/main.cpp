@@ -1,10 +1,21 @@
 #include <ncurses.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <cerrno>
+#include <chrono>
+#include <clocale>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <map>
 #include <vector>
 #include <fstream>
 #include <functional>
 #include <string>
 
-#define CTRL_KEY(k) ((k) & 0x1f)
+#include "../utils.c"
 
 std::vector<std::string> editorContent;
 std::vector<int> trailSpaces;
@@ -12,13 +23,46 @@ std::string filename = "";
 
 int cursorX, cursorY;
 
+// inode, size and mtime of the file when it was last read or written, to notice other writers
+struct DiskState {
+    ino_t ino = 0;
+    off_t size = 0;
+    long long mtime = 0;
+    bool operator==(const DiskState &other) const {
+        return ino == other.ino && size == other.size && mtime == other.mtime;
+    }
+};
+DiskState disk;
+bool diskConflict = false;
+std::string statusMessage;
+int inotifyFd = -1;
+
 // these two variables are used to keep track of the topmost visible line and the leftmost visible character in the editor
 int extremeX, extremeY;
 
+// every file given on the command line gets a Buffer; the active one is swapped into the globals above
+struct Buffer {
+    std::vector<std::string> content;
+    std::vector<int> trailSpaces;
+    std::string filename;
+    int cursorX, cursorY;
+    int extremeX, extremeY;
+    DiskState disk;
+    bool diskConflict;
+};
+
+std::vector<Buffer> buffers;
+int currentBuffer = 0;
+
 const int TAB_SIZE = 4;
 const int QUIT_TIMES = 2;
 const int INDENT_WITH_TABS = 1;
 
+const int AUTOSAVE_DELAY_MS = 500;
+const int RELOAD_DELAY_MS = 100;
+const int MAX_FPS = 60;
+const int ESCAPE_TIMEOUT_MS = 100;
+
 const int LEFT_SPACING = 10;
 const int RIGHT_SPACING = 1;
 const int TOP_SPACING = 3;
@@ -32,12 +76,55 @@ struct Dim {
     int height, width;
 } Window;
 
+// what has to be redrawn on each screen row before the next frame
+enum Damage { DAMAGE_NONE, DAMAGE_GUTTER, DAMAGE_LINE };
+std::vector<char> damage;
+
+// work deferred until the editor is idle, keyed by name so rescheduling replaces the pending run
+struct Deferred {
+    std::chrono::steady_clock::time_point due;
+    std::function<void()> fn;
+};
+std::map<std::string, Deferred> deferredWork;
+
+void schedule(const std::string &name, int delayMs, std::function<void()> fn) {
+    deferredWork[name] = {std::chrono::steady_clock::now() + std::chrono::milliseconds(delayMs), fn};
+}
+
+int msUntilDeferred() {
+    if (deferredWork.empty()) return -1;
+    auto now = std::chrono::steady_clock::now();
+    auto due = deferredWork.begin()->second.due;
+    for (auto &work : deferredWork) due = std::min(due, work.second.due);
+    if (due <= now) return 0;
+    return (int)std::chrono::duration_cast<std::chrono::milliseconds>(due - now).count() + 1;
+}
+
+// returns whether anything ran, so the caller knows the screen may need a frame
+bool runDeferred(bool all = false) {
+    auto now = std::chrono::steady_clock::now();
+    bool ran = false;
+    for (auto it = deferredWork.begin(); it != deferredWork.end();) {
+        if (all || it->second.due <= now) {
+            std::function<void()> fn = it->second.fn;
+            it = deferredWork.erase(it);
+            fn();
+            ran = true;
+        }
+        else {
+            ++it;
+        }
+    }
+    return ran;
+}
+
 void setDimensions() {
     getmaxyx(stdscr, Window.height, Window.width);
     editorBoundary.top = TOP_SPACING;
     editorBoundary.bottom = Window.height - BOTTOM_SPACING - 1;
     editorBoundary.left = LEFT_SPACING;
     editorBoundary.right = Window.width - RIGHT_SPACING - 1;
+    damage.assign(Window.height, DAMAGE_NONE);
 }
 
 void drawEditorBox() {
@@ -48,54 +135,167 @@ void drawEditorBox() {
     mvvline(editorBoundary.top, editorBoundary.left - 1, ACS_VLINE, editorBoundary.bottom - editorBoundary.top + 1);
 }
 
-void refreshEditor(const std::pair<int, int> &lineOffset) {
-    for (int i = lineOffset.first; i <= lineOffset.second; i++) {
-        move(i, 1);
-        clrtoeol();
-        
-        int currentLineIdx = i + extremeY - editorBoundary.top;
-        if (currentLineIdx < editorContent.size()) {
-            std::string num_idx = std::to_string(currentLineIdx + 1);
-            move(i, LEFT_SPACING - 2 - num_idx.size());
-            for (char ch : num_idx) addch(ch);
-
-            move(i, editorBoundary.left - 1);
-            addch(ACS_VLINE);
-            if (extremeY + i < (int)editorContent.size() + editorBoundary.top) {
-                for (int j = 0; j <= editorBoundary.right - editorBoundary.left; j++) {
-                    if (j + extremeX < (int)editorContent[extremeY + i - editorBoundary.top].size()) {                    
-                        addch(editorContent[extremeY + i - editorBoundary.top][j + extremeX]);
-                    }
-                    else break;
-                }
-            }
-        } 
+// number of bytes of line, starting at byte `from`, that fit in `columns` screen columns
+int bytesForColumns(const std::string &line, int from, int columns) {
+    const char *s = line.c_str() + from;
+    int len = (int)line.size() - from;
+    int n = std::min(len, columns);
+    if (asciiSpan(s, n) == n) {
+        return n;
+    }
 
-        else {
-            
-            move(i, LEFT_SPACING - 3);
-            addch('~');
-            move(i, editorBoundary.left - 1);
-            addch(ACS_VLINE);
+    int used = 0, i = 0;
+    while (i < len) {
+        int cp;
+        int seq = utf8Decode(s + i, len - i, &cp);
+        int width = (cp == -1) ? 1 : codepointWidth(cp);
+        if (used + width > columns) break;
+        used += width;
+        i += seq;
+    }
+    return i;
+}
+
+// screen columns taken by the bytes [from, to) of line
+int columnsBetween(const std::string &line, int from, int to) {
+    const char *s = line.c_str() + from;
+    int len = to - from;
+    if (asciiSpan(s, len) == len) {
+        return len;
+    }
+
+    int used = 0, i = 0;
+    while (i < len) {
+        int cp;
+        i += utf8Decode(s + i, len - i, &cp);
+        used += (cp == -1) ? 1 : codepointWidth(cp);
+    }
+    return used;
+}
+
+// first byte of a line that is drawn when the view is scrolled to extremeX
+int firstVisibleByte(const std::string &line) {
+    int start = extremeX;
+    while (start < (int)line.size() && utf8IsContinuation(line[start])) start++;
+    return start;
+}
+
+void placeCursor() {
+    int x = cursorX;
+    int lineIdx = extremeY + cursorY - editorBoundary.top;
+    if (lineIdx < (int)editorContent.size()) {
+        const std::string &line = editorContent[lineIdx];
+        int start = firstVisibleByte(line);
+        int idx = std::min(extremeX + cursorX - editorBoundary.left, (int)line.size());
+        x = editorBoundary.left + (idx > start ? columnsBetween(line, start, idx) : 0);
+    }
+    move(cursorY, x);
+}
+
+bool cursorInsideSequence() {
+    const std::string &line = editorContent[extremeY + cursorY - editorBoundary.top];
+    int idx = extremeX + cursorX - editorBoundary.left;
+    return idx > 0 && idx < (int)line.size() && utf8IsContinuation(line[idx]);
+}
+
+// line number (or '~' past the end of the file) right-aligned in columns 1 .. LEFT_SPACING - 2
+std::string gutterText(int row) {
+    std::string text(LEFT_SPACING - 2, ' ');
+    int currentLineIdx = row + extremeY - editorBoundary.top;
+    std::string mark = currentLineIdx < (int)editorContent.size() ? std::to_string(currentLineIdx + 1) : "~";
+    int len = std::min((int)mark.size(), (int)text.size() - 1);
+    text.replace(text.size() - 1 - len, len, mark, mark.size() - len, len);
+    return text;
+}
+
+void drawLine(int row) {
+    mvaddch(row, 0, ACS_VLINE);
+    clrtoeol();
+    std::string gutter = gutterText(row);
+    mvaddnstr(row, 1, gutter.c_str(), gutter.size());
+    mvaddch(row, editorBoundary.left - 1, ACS_VLINE);
+
+    int currentLineIdx = row + extremeY - editorBoundary.top;
+    if (currentLineIdx < (int)editorContent.size()) {
+        const std::string &line = editorContent[currentLineIdx];
+        int start = firstVisibleByte(line);
+        if (start < (int)line.size()) {
+            addnstr(line.c_str() + start, bytesForColumns(line, start, editorBoundary.right - editorBoundary.left + 1));
         }
+    }
+    mvaddch(row, editorBoundary.right + 1, ACS_VLINE);
+}
+
+// handlers only record which rows changed; the damaged rows of every key handled since the last
+// frame are redrawn together by repaintDamage()
+void damageLines(const std::pair<int, int> &lineOffset) {
+    for (int i = std::max(lineOffset.first, 0); i <= lineOffset.second && i < (int)damage.size(); i++) {
+        damage[i] = DAMAGE_LINE;
+    }
+}
 
-        mvvline(i, editorBoundary.right + 1, ACS_VLINE, 1);
+// rows whose text stayed put on screen but now belong to a different line number
+void damageGutter(const std::pair<int, int> &lineOffset) {
+    for (int i = std::max(lineOffset.first, 0); i <= lineOffset.second && i < (int)damage.size(); i++) {
+        damage[i] = std::max(damage[i], (char)DAMAGE_GUTTER);
+    }
+}
+
+// move screen rows from .. to up by n (down if n < 0) with the terminal scroll region, so only the
+// rows scrolled into view have to be drawn
+void shiftLines(int from, int to, int n) {
+    if (n == 0 || from > to) return;
+    if (std::abs(n) > to - from) {
+        damageLines({from, to});
+        return;
+    }
+
+    setscrreg(from, to);
+    scrollok(stdscr, TRUE);
+    scrl(n);
+    scrollok(stdscr, FALSE);
+    setscrreg(0, Window.height - 1);
+
+    if (n > 0) {
+        std::copy(damage.begin() + from + n, damage.begin() + to + 1, damage.begin() + from);
+        damageLines({to - n + 1, to});
+    }
+    else {
+        std::copy_backward(damage.begin() + from, damage.begin() + to + 1 + n, damage.begin() + to + 1);
+        damageLines({from, from - n - 1});
+    }
+}
+
+void repaintDamage() {
+    for (int i = 0; i < (int)damage.size(); i++) {
+        if (damage[i] == DAMAGE_LINE) {
+            drawLine(i);
+        }
+        else if (damage[i] == DAMAGE_GUTTER) {
+            std::string gutter = gutterText(i);
+            mvaddnstr(i, 1, gutter.c_str(), gutter.size());
+        }
+        damage[i] = DAMAGE_NONE;
     }
-    refresh();
-    move(cursorY, cursorX);
 }
 
 void refreshStatus() {
     move(editorBoundary.bottom + 2, 1);
     clrtoeol();
     std::string coordinateStatus = std::string("Spaces: ") + std::to_string(TAB_SIZE) + std::string(" | Ln: ") + std::to_string(cursorY + extremeY - editorBoundary.top + 1) + ", Col: " + std::to_string(cursorX + extremeX - editorBoundary.left + 1);
+    if (!statusMessage.empty()) {
+        mvaddnstr(editorBoundary.bottom + 2, 2, statusMessage.c_str(), std::max(0, editorBoundary.right - (int)coordinateStatus.size() - 5));
+    }
+    else if (buffers.size() > 1) {
+        mvprintw(editorBoundary.bottom + 2, 2, "[%d/%d] %s", currentBuffer + 1, (int)buffers.size(), filename.c_str());
+    }
     mvprintw(editorBoundary.bottom + 2, editorBoundary.right - coordinateStatus.size() - 2, "%s", coordinateStatus.c_str());
     mvvline(editorBoundary.bottom + 2, editorBoundary.right + 1, ACS_VLINE, 1);
-    move(cursorY, cursorX);
-    refresh();
+    placeCursor();
 }
 
 void scrollHandler(int c) {
+    int oldExtremeX = extremeX;
     if (c == KEY_UP) {
         if (cursorY > editorBoundary.top) {
             cursorY--;
@@ -105,7 +305,7 @@ void scrollHandler(int c) {
                     
                     if (extremeX != std::max(0, (int)editorContent[extremeY + cursorY - editorBoundary.top].size() - (editorBoundary.right - editorBoundary.left))) {
                         extremeX = std::max(0, (int)editorContent[extremeY + cursorY - editorBoundary.top].size() - (editorBoundary.right - editorBoundary.left));
-                        refreshEditor({editorBoundary.top, editorBoundary.bottom});
+                        damageLines({editorBoundary.top, editorBoundary.bottom});
                     }
                 }
                 else {
@@ -128,13 +328,18 @@ void scrollHandler(int c) {
                         cursorX = editorContent[extremeY + cursorY - editorBoundary.top].size() - extremeX + editorBoundary.left;
                     }
                 }
-                refreshEditor({editorBoundary.top, editorBoundary.bottom});
+                if (extremeX == oldExtremeX) {
+                    shiftLines(editorBoundary.top, editorBoundary.bottom, -1);
+                }
+                else {
+                    damageLines({editorBoundary.top, editorBoundary.bottom});
+                }
             }
             else {
                 cursorX = editorBoundary.left;
                 if (extremeX > 0) {
                     extremeX = 0;
-                    refreshEditor({editorBoundary.top, editorBoundary.bottom});
+                    damageLines({editorBoundary.top, editorBoundary.bottom});
                 }
             }
         }
@@ -150,7 +355,7 @@ void scrollHandler(int c) {
                         
                             if (extremeX != std::max(0, (int)editorContent[extremeY + cursorY - editorBoundary.top].size() - (editorBoundary.right - editorBoundary.left))) {
                                 extremeX = std::max(0, (int)editorContent[extremeY + cursorY - editorBoundary.top].size() - (editorBoundary.right - editorBoundary.left));
-                                refreshEditor({editorBoundary.top, editorBoundary.bottom});
+                                damageLines({editorBoundary.top, editorBoundary.bottom});
                             }
                         }
                         else {
@@ -170,7 +375,12 @@ void scrollHandler(int c) {
                         cursorX = editorContent[extremeY + cursorY - editorBoundary.top].size() - extremeX + editorBoundary.left;
                     }
                 }
-                refreshEditor({editorBoundary.top, editorBoundary.bottom});
+                if (extremeX == oldExtremeX) {
+                    shiftLines(editorBoundary.top, editorBoundary.bottom, 1);
+                }
+                else {
+                    damageLines({editorBoundary.top, editorBoundary.bottom});
+                }
             }
         }
         else {
@@ -178,7 +388,7 @@ void scrollHandler(int c) {
 
             if (extremeX != std::max(0, (int)editorContent.back().size() - (editorBoundary.right - editorBoundary.left))) {
                 extremeX = std::max(0, (int)editorContent.back().size() - (editorBoundary.right - editorBoundary.left));
-                refreshEditor({editorBoundary.top, editorBoundary.bottom});
+                damageLines({editorBoundary.top, editorBoundary.bottom});
             }
         }
     }
@@ -189,13 +399,13 @@ void scrollHandler(int c) {
         else {
             if (extremeX > 0) {
                 extremeX--;
-                refreshEditor({editorBoundary.top, editorBoundary.bottom});
+                damageLines({editorBoundary.top, editorBoundary.bottom});
             }
             else {
                 cursorX = std::min((int)editorContent[extremeY + cursorY - editorBoundary.top].size() + editorBoundary.left, editorBoundary.right);
                 if (extremeX != std::max(0, (int)editorContent[extremeY + cursorY - editorBoundary.top].size() - (editorBoundary.right - editorBoundary.left))) {
                     extremeX = std::max(0, (int)editorContent[extremeY + cursorY - editorBoundary.top].size() - (editorBoundary.right - editorBoundary.left));
-                    refreshEditor({editorBoundary.top, editorBoundary.bottom});
+                    damageLines({editorBoundary.top, editorBoundary.bottom});
                 }
             }
         }
@@ -207,13 +417,13 @@ void scrollHandler(int c) {
         else {
             if (extremeX + editorBoundary.right - editorBoundary.left < editorContent[extremeY + cursorY - editorBoundary.top].size()) {
                 extremeX++;
-                refreshEditor({editorBoundary.top, editorBoundary.bottom});
+                damageLines({editorBoundary.top, editorBoundary.bottom});
             }
             else {
                 cursorX = editorBoundary.left;
                 if (extremeX > 0) {
                     extremeX = 0;
-                    refreshEditor({editorBoundary.top, editorBoundary.bottom});
+                    damageLines({editorBoundary.top, editorBoundary.bottom});
                 }
             }
         }
@@ -230,7 +440,15 @@ void calcTrailingSpaces(int currLine) {
     }
 }
 
+void fileWriter();
+
+// only edits schedule an autosave, so moving around or switching buffers never touches the file
+void contentChanged() {
+    schedule("autosave", AUTOSAVE_DELAY_MS, fileWriter);
+}
+
 void deleteHandler(bool isBackspace) {
+    int oldExtremeX = extremeX;
     if (isBackspace) {
         if (cursorX + extremeX > editorBoundary.left) {
             if (trailSpaces[extremeY + cursorY - editorBoundary.top] >= extremeX + cursorX - editorBoundary.left) {
@@ -239,29 +457,31 @@ void deleteHandler(bool isBackspace) {
 
                 trailSpaces[extremeY + cursorY - editorBoundary.top] -= qty;
                 editorContent[extremeY + cursorY - editorBoundary.top].erase(extremeX + cursorX - editorBoundary.left - qty, qty);
+                contentChanged();
                 
                 cursorX -= qty;
                 if (cursorX < editorBoundary.left) {
                     extremeX -= editorBoundary.left - cursorX;
                     cursorX = editorBoundary.left;
-                    refreshEditor({editorBoundary.top, editorBoundary.bottom});
+                    damageLines({editorBoundary.top, editorBoundary.bottom});
                 }
                 else {
-                    refreshEditor({cursorY, cursorY});
+                    damageLines({cursorY, cursorY});
                 }
             }
             else {
                 editorContent[extremeY + cursorY - editorBoundary.top].erase(extremeX + cursorX - editorBoundary.left - 1, 1);
+                contentChanged();
 
                 calcTrailingSpaces(extremeY + cursorY - editorBoundary.top);
 
                 if (cursorX > editorBoundary.left) {
                     cursorX--;
-                    refreshEditor({cursorY, cursorY});
+                    damageLines({cursorY, cursorY});
                 }
                 else {
                     extremeX--;
-                    refreshEditor({editorBoundary.top, editorBoundary.bottom});
+                    damageLines({editorBoundary.top, editorBoundary.bottom});
                 }
             }
         }
@@ -277,14 +497,28 @@ void deleteHandler(bool isBackspace) {
 
             editorContent.erase(editorContent.begin() + extremeY + cursorY - editorBoundary.top);
             trailSpaces.erase(trailSpaces.begin() + extremeY + cursorY - editorBoundary.top);
+            contentChanged();
 
             if (cursorY > editorBoundary.top) {
                 cursorY--;
-                refreshEditor({cursorY, editorBoundary.bottom});
+                if (extremeX == oldExtremeX) {
+                    shiftLines(cursorY + 1, editorBoundary.bottom, 1);
+                    damageLines({cursorY, cursorY});
+                    damageGutter({cursorY + 1, editorBoundary.bottom});
+                }
+                else {
+                    damageLines({cursorY, editorBoundary.bottom});
+                }
             }
             else {
                 extremeY--;
-                refreshEditor({editorBoundary.top, editorBoundary.bottom});
+                if (extremeX == oldExtremeX) {
+                    damageLines({editorBoundary.top, editorBoundary.top});
+                    damageGutter({editorBoundary.top + 1, editorBoundary.bottom});
+                }
+                else {
+                    damageLines({editorBoundary.top, editorBoundary.bottom});
+                }
             }
         }
     }
@@ -292,21 +526,25 @@ void deleteHandler(bool isBackspace) {
     else {
         if (extremeX + cursorX - editorBoundary.left < editorContent[extremeY + cursorY - editorBoundary.top].size()) {
             editorContent[extremeY + cursorY - editorBoundary.top].erase(extremeX + cursorX - editorBoundary.left, 1);
+            contentChanged();
             if (trailSpaces[extremeY + cursorY - editorBoundary.top] > extremeX + cursorX - editorBoundary.left) {
                 trailSpaces[extremeY + cursorY - editorBoundary.top]--;
             }
             else {
                 calcTrailingSpaces(extremeY + cursorY - editorBoundary.top);
             }
-            refreshEditor({cursorY, cursorY});
+            damageLines({cursorY, cursorY});
         }
         else if (extremeY + cursorY - editorBoundary.top + 1 < editorContent.size()) {
             editorContent[extremeY + cursorY - editorBoundary.top] += editorContent[extremeY + cursorY - editorBoundary.top + 1];
             editorContent.erase(editorContent.begin() + extremeY + cursorY - editorBoundary.top + 1);
+            contentChanged();
             if (trailSpaces[extremeY + cursorY - editorBoundary.top] >= extremeX + cursorX - editorBoundary.left) {
                 trailSpaces[extremeY + cursorY - editorBoundary.top] += trailSpaces[extremeY + cursorY - editorBoundary.top + 1];
             }
-            refreshEditor({cursorY, editorBoundary.bottom});
+            shiftLines(cursorY + 1, editorBoundary.bottom, 1);
+            damageLines({cursorY, cursorY});
+            damageGutter({cursorY + 1, editorBoundary.bottom});
         }
     }
     refreshStatus();
@@ -324,22 +562,38 @@ void insertCharHandler(char c) {
         }
     }
     editorContent[extremeY + cursorY - editorBoundary.top].insert(extremeX + cursorX - editorBoundary.left, 1, c);
+    contentChanged();
     if (cursorX < editorBoundary.right) {
         cursorX++;
-        refreshEditor({cursorY, cursorY});
+        damageLines({cursorY, cursorY});
     }
     else {
         extremeX++;
-        refreshEditor({editorBoundary.top, editorBoundary.bottom});
+        damageLines({editorBoundary.top, editorBoundary.bottom});
     }
     refreshStatus();
 }
 
 void tabspaceHandler() {
-    insertCharHandler(' ');
-    while ((cursorX + extremeX - editorBoundary.left) % TAB_SIZE != 0) {
-        insertCharHandler(' ');
+    int idx = extremeX + cursorX - editorBoundary.left;
+    int qty = TAB_SIZE - idx % TAB_SIZE;
+
+    if (trailSpaces[extremeY + cursorY - editorBoundary.top] >= idx) {
+        trailSpaces[extremeY + cursorY - editorBoundary.top] += qty;
+    }
+    editorContent[extremeY + cursorY - editorBoundary.top].insert(idx, qty, ' ');
+    contentChanged();
+
+    cursorX += qty;
+    if (cursorX > editorBoundary.right) {
+        extremeX += cursorX - editorBoundary.right;
+        cursorX = editorBoundary.right;
+        damageLines({editorBoundary.top, editorBoundary.bottom});
     }
+    else {
+        damageLines({cursorY, cursorY});
+    }
+    refreshStatus();
 }
 
 void parenthesisHandler(char c, bool AutoParenthesis) {
@@ -356,11 +610,11 @@ void parenthesisHandler(char c, bool AutoParenthesis) {
             if (editorContent[extremeY + cursorY - editorBoundary.top][extremeX + cursorX - editorBoundary.left] == c) {
                 if (cursorX < editorBoundary.right) {
                     cursorX++;
-                    refreshEditor({cursorY, cursorY});
+                    damageLines({cursorY, cursorY});
                 }
                 else {
                     extremeX++;
-                    refreshEditor({editorBoundary.top, editorBoundary.bottom});
+                    damageLines({editorBoundary.top, editorBoundary.bottom});
                 }
             }
             else {
@@ -379,6 +633,8 @@ void parenthesisHandler(char c, bool AutoParenthesis) {
 }
 
 void newlineHandler(bool AutoIndent) {
+    int oldExtremeX = extremeX, oldExtremeY = extremeY, oldCursorY = cursorY;
+    int oldSize = editorContent.size();
     int newLineTrailingSpaceQty = 0;
     if (cursorX + extremeX == editorContent[extremeY + cursorY - editorBoundary.top].size() + editorBoundary.left) {
         if (AutoIndent && !editorContent[extremeY + cursorY - editorBoundary.top].empty()) {
@@ -406,7 +662,6 @@ void newlineHandler(bool AutoIndent) {
         else {
             extremeY++;
         }
-        refreshEditor({editorBoundary.top, editorBoundary.bottom});
     }
 
     else {
@@ -459,7 +714,6 @@ void newlineHandler(bool AutoIndent) {
                 else {
                     extremeY++;
                 }
-                refreshEditor({editorBoundary.top, editorBoundary.bottom});
             }
             else {
                 editorContent.emplace(editorContent.begin() + extremeY + cursorY - editorBoundary.top + 1, std::string(newLineTrailingSpaceQty, ' ') + nextLine);
@@ -481,7 +735,6 @@ void newlineHandler(bool AutoIndent) {
                 else {
                     extremeY++;
                 }
-                refreshEditor({editorBoundary.top, editorBoundary.bottom});
             }
         }
         else {
@@ -499,88 +752,226 @@ void newlineHandler(bool AutoIndent) {
             else {
                 extremeY++;
             }
-            refreshEditor({editorBoundary.top, editorBoundary.bottom});
         }
     }
+
+    contentChanged();
+
+    int inserted = editorContent.size() - oldSize;
+    if (extremeX != oldExtremeX) {
+        damageLines({editorBoundary.top, editorBoundary.bottom});
+    }
+    else if (extremeY != oldExtremeY) {
+        shiftLines(editorBoundary.top, editorBoundary.bottom, extremeY - oldExtremeY);
+        damageLines({oldCursorY - (extremeY - oldExtremeY), editorBoundary.bottom});
+    }
+    else {
+        shiftLines(oldCursorY + 1, editorBoundary.bottom, -inserted);
+        damageLines({oldCursorY, std::min(oldCursorY + inserted, editorBoundary.bottom)});
+        damageGutter({oldCursorY + inserted + 1, editorBoundary.bottom});
+    }
     refreshStatus();
 }
 
-void processKeypress() {
+void storeBuffer(Buffer &buffer) {
+    buffer.content.swap(editorContent);
+    buffer.trailSpaces.swap(trailSpaces);
+    buffer.filename.swap(filename);
+    buffer.cursorX = cursorX;
+    buffer.cursorY = cursorY;
+    buffer.extremeX = extremeX;
+    buffer.extremeY = extremeY;
+    buffer.disk = disk;
+    buffer.diskConflict = diskConflict;
+}
+
+void loadBuffer(Buffer &buffer) {
+    editorContent.swap(buffer.content);
+    trailSpaces.swap(buffer.trailSpaces);
+    filename.swap(buffer.filename);
+    cursorX = buffer.cursorX;
+    cursorY = buffer.cursorY;
+    extremeX = buffer.extremeX;
+    extremeY = buffer.extremeY;
+    disk = buffer.disk;
+    diskConflict = buffer.diskConflict;
+}
+
+void reloadFile();
+void overwriteFile();
+
+void switchBuffer(int idx) {
+    if (buffers.size() < 2) return;
+    // the pending autosave belongs to the buffer being left
+    runDeferred(true);
+    storeBuffer(buffers[currentBuffer]);
+    currentBuffer = (idx + buffers.size()) % buffers.size();
+    loadBuffer(buffers[currentBuffer]);
+    damageLines({editorBoundary.top, editorBoundary.bottom});
+    refreshStatus();
+}
+
+// what a key can be bound to; the names are the ones kb uses for the same commands
+enum Command {
+    CMD_UP, CMD_DOWN, CMD_LEFT, CMD_RIGHT, CMD_DELETE, CMD_BACKSPACE, CMD_NEWLINE, CMD_TAB,
+    CMD_QUIT, CMD_NEXT_BUFFER, CMD_PREV_BUFFER, CMD_RELOAD, CMD_SAVE, CMD_COUNT
+};
+
+const char *const commandNames[CMD_COUNT] = {
+    "up", "down", "left", "right", "delete", "backspace", "newline", "tab",
+    "quit", "next-buffer", "prev-buffer", "reload", "save"
+};
+
+// keys are decoded and looked up the same way as in kb, from the same keymap file
+struct keymap keymap;
+
+void initKeymap() {
+    const struct {
+        int key, command;
+    } defaults[] = {
+        {ARROW_UP, CMD_UP}, {ARROW_DOWN, CMD_DOWN}, {ARROW_LEFT, CMD_LEFT}, {ARROW_RIGHT, CMD_RIGHT},
+        {DEL_KEY, CMD_DELETE}, {BACKSPACE, CMD_BACKSPACE}, {'\n', CMD_NEWLINE}, {'\r', CMD_NEWLINE},
+        {'\t', CMD_TAB}, {META_KEY('q'), CMD_QUIT}, {META_KEY('n'), CMD_NEXT_BUFFER},
+        {META_KEY('p'), CMD_PREV_BUFFER}, {META_KEY('r'), CMD_RELOAD}, {META_KEY('w'), CMD_SAVE},
+    };
+    keymapInit(&keymap);
+    for (auto &binding : defaults) keymapBind(&keymap, &binding.key, 1, binding.command);
+
+    std::string path;
+    if (getenv("KB_KEYMAP")) path = getenv("KB_KEYMAP");
+    else if (getenv("HOME")) path = std::string(getenv("HOME")) + "/.kb/keymap";
+    int bad = path.empty() ? 0 : keymapLoad(&keymap, path.c_str(), commandNames, CMD_COUNT);
+    if (bad > 0) statusMessage = path + ":" + std::to_string(bad) + ": bad or clashing binding";
+}
 
+// one key as a code of utils.c; the bytes of an escape sequence arrive within ESCAPE_TIMEOUT_MS
+// of each other, and any read past the key are pushed back for the next call
+int readKey() {
     int c = getch();
+    if (c == ERR || c > 0xff) return c;
+
+    char seq[32];
+    int len = 0, used, key;
+    seq[len++] = c;
+    while ((key = keyDecode(seq, len, &used)) == KEY_INCOMPLETE) {
+        c = len < (int)sizeof(seq) ? getch() : ERR;
+        if (c == ERR || c > 0xff) {
+            if (c != ERR) ungetch(c);
+            key = '\x1b';
+            used = 1;
+            break;
+        }
+        seq[len++] = c;
+    }
+    for (int i = len - 1; i >= used; i--) ungetch((unsigned char)seq[i]);
+    return key;
+}
+
+void processKeypress() {
+
+    int c = readKey();
+
+    if (c == ERR) return;
+
+    if (!statusMessage.empty()) {
+        statusMessage.clear();
+        refreshStatus();
+    }
 
     if (c == KEY_RESIZE) {
         setDimensions();
         clear();
         drawEditorBox();
-        refreshEditor({editorBoundary.top, editorBoundary.bottom});
+        damageLines({editorBoundary.top, editorBoundary.bottom});
         refreshStatus();
         return;
     }
-    if (c == 27) {
-        c = getch();
-        if (c == 91) {
-            c = getch();
-            switch (c) {
-                case 65:
-                    scrollHandler(KEY_UP);
-                    break;
-            
-                case 66:
-                    scrollHandler(KEY_DOWN);
-                    break;
-            
-                case 67:
-                    scrollHandler(KEY_RIGHT);
-                    break;
-            
-                case 68:
-                    scrollHandler(KEY_LEFT);
-                    break;
-
-                case 51:
-                    c = getch();
-                    if (c == 126) {
-                        deleteHandler(false);
-                    }
-                    break;
-            
-                default:
-                    break;
-            }
-        }
-        else if (c == 113) {
-            exit(0);
+
+    bool chord = keymap.state >= 0;
+    int command = keymapStep(&keymap, c);
+    if (command == KEYMAP_PREFIX || (chord && command == KEYMAP_UNBOUND)) return;
+
+    switch (command) {
+        case CMD_UP:
+            scrollHandler(KEY_UP);
+            while (cursorInsideSequence()) scrollHandler(KEY_LEFT);
+            break;
+
+        case CMD_DOWN:
+            scrollHandler(KEY_DOWN);
+            while (cursorInsideSequence()) scrollHandler(KEY_LEFT);
+            break;
+
+        case CMD_RIGHT:
+            scrollHandler(KEY_RIGHT);
+            while (cursorInsideSequence()) scrollHandler(KEY_RIGHT);
+            break;
+
+        case CMD_LEFT:
+            scrollHandler(KEY_LEFT);
+            while (cursorInsideSequence()) scrollHandler(KEY_LEFT);
+            break;
+
+        case CMD_DELETE: {
+            const std::string &line = editorContent[extremeY + cursorY - editorBoundary.top];
+            int idx = extremeX + cursorX - editorBoundary.left;
+            do {
+                deleteHandler(false);
+            } while (idx < (int)line.size() && utf8IsContinuation(line[idx]));
+            break;
         }
-    }
-    else {
-        switch (c) {
-            case 127:
+
+        case CMD_BACKSPACE: {
+            bool continuation;
+            do {
+                const std::string &line = editorContent[extremeY + cursorY - editorBoundary.top];
+                int idx = extremeX + cursorX - editorBoundary.left;
+                continuation = idx > 0 && idx <= (int)line.size() && utf8IsContinuation(line[idx - 1]);
                 deleteHandler(true);
-                break;
-            
-            case 10:  
-            case KEY_ENTER:
-                newlineHandler(true);
-                break;
-            
-            case 9:
-                tabspaceHandler();
-                break;
-
-            case '{':
-            case '[':
-            case '(':
-            case ')':
-            case ']':
-            case '}':
+            } while (continuation);
+            break;
+        }
+
+        case CMD_NEWLINE:
+            newlineHandler(true);
+            break;
+
+        case CMD_TAB:
+            tabspaceHandler();
+            break;
+
+        case CMD_QUIT:
+            runDeferred(true);
+            exit(0);
+
+        case CMD_NEXT_BUFFER:
+            switchBuffer(currentBuffer + 1);
+            break;
+
+        case CMD_PREV_BUFFER:
+            switchBuffer(currentBuffer - 1);
+            break;
+
+        case CMD_RELOAD:
+            deferredWork.erase("autosave");
+            reloadFile();
+            break;
+
+        case CMD_SAVE:
+            deferredWork.erase("autosave");
+            overwriteFile();
+            break;
+
+        default:
+            // keys bound to nothing are typed, unless they have no character
+            if (c >= ARROW_LEFT || c == '\x1b') break;
+            if (validOpeningBracket(c) || validClosingBracket(c)) {
                 parenthesisHandler(c, true);
-                break;
-            
-            default:
+            }
+            else {
                 insertCharHandler(c);
-                break;
-        }
+            }
+            break;
     }
 
 }
@@ -613,7 +1004,7 @@ void processKeypress() {
 //             setDimensions();
 //             clear();
 //             drawEditorBox();
-//             refreshEditor({editorBoundary.top, editorBoundary.bottom});
+//             damageLines({editorBoundary.top, editorBoundary.bottom});
 //             refreshStatus();
 //             break;
         
@@ -639,6 +1030,28 @@ void processKeypress() {
 //     }
 // }
 
+DiskState diskStateOf(const std::string &name) {
+    DiskState state;
+    struct stat st;
+    if (stat(name.c_str(), &st) == 0) {
+        state.ino = st.st_ino;
+        state.size = st.st_size;
+        state.mtime = (long long)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    }
+    return state;
+}
+
+// watch the file's directory, so replacing the file by rename is noticed too
+void watchFile(const std::string &name) {
+    if (inotifyFd == -1) {
+        inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (inotifyFd == -1) return;
+    }
+    size_t slash = name.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : name.substr(0, slash);
+    inotify_add_watch(inotifyFd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_MODIFY);
+}
+
 void fileReader() {
     refreshStatus();
     if (filename.empty()) {
@@ -654,24 +1067,136 @@ void fileReader() {
         calcTrailingSpaces(editorContent.size() - 1);
     }
     file.close();
+    disk = diskStateOf(filename);
+    watchFile(filename);
 }
 
 void fileWriter() {
     if (filename.empty()) return;
+    // an autosave must not clobber what another program wrote since we last read or wrote the file
+    if (diskConflict || !(diskStateOf(filename) == disk)) {
+        diskConflict = true;
+        statusMessage = "Changed on disk: ESC r reload, ESC w overwrite";
+        refreshStatus();
+        return;
+    }
     std::fstream file(filename, std::ios::out | std::ios::trunc);
     for (std::string &line : editorContent) {
         file << line << '\n';
     }
     file.close();
+    disk = diskStateOf(filename);
+}
+
+void overwriteFile() {
+    disk = diskStateOf(filename);
+    diskConflict = false;
+    fileWriter();
+}
+
+// moves a line number kept across replacing lines [lo, hi) by n new ones
+void shiftLine(int &line, int lo, int hi, int n) {
+    if (line >= hi) line += n - (hi - lo);
+    else if (line >= lo) line = lo;
+}
+
+// re-reads the active buffer's file; lineDiff matches line hashes so only the lines that changed
+// are replaced and the cursor stays on the same text
+void reloadFile() {
+    if (filename.empty()) return;
+    std::vector<std::string> lines;
+    std::fstream file(filename, std::ios::in);
+    std::string line;
+    while (std::getline(file, line)) {
+        lines.push_back(line);
+    }
+    file.close();
+    disk = diskStateOf(filename);
+    diskConflict = false;
+
+    int m = editorContent.size(), n = lines.size();
+    std::vector<uint64_t> oldHashes(m + 1), newHashes(n + 1);
+    for (int i = 0; i < m; i++) oldHashes[i] = hashBytes(editorContent[i].data(), editorContent[i].size());
+    for (int i = 0; i < n; i++) newHashes[i] = hashBytes(lines[i].data(), lines[i].size());
+    std::vector<int> runs(3 * (std::min(m, n) + 2));
+    int nruns = lineDiff(oldHashes.data(), m, newHashes.data(), n, runs.data());
+
+    int cursorLine = extremeY + cursorY - editorBoundary.top;
+    int col = extremeX + cursorX - editorBoundary.left;
+    int replaced = 0;
+    for (int r = nruns; r >= 0; r--) {
+        int alo = r > 0 ? runs[3 * (r - 1)] + runs[3 * (r - 1) + 2] : 0;
+        int blo = r > 0 ? runs[3 * (r - 1) + 1] + runs[3 * (r - 1) + 2] : 0;
+        int ahi = r < nruns ? runs[3 * r] : m;
+        int bhi = r < nruns ? runs[3 * r + 1] : n;
+        if (alo == ahi && blo == bhi) continue;
+
+        editorContent.erase(editorContent.begin() + alo, editorContent.begin() + ahi);
+        editorContent.insert(editorContent.begin() + alo, lines.begin() + blo, lines.begin() + bhi);
+        trailSpaces.erase(trailSpaces.begin() + alo, trailSpaces.begin() + ahi);
+        trailSpaces.insert(trailSpaces.begin() + alo, bhi - blo, 0);
+        for (int i = alo; i < alo + bhi - blo; i++) calcTrailingSpaces(i);
+        replaced += bhi - blo;
+        shiftLine(cursorLine, alo, ahi, bhi - blo);
+        shiftLine(extremeY, alo, ahi, bhi - blo);
+    }
+    if (editorContent.empty()) {
+        editorContent.push_back("");
+        trailSpaces.push_back(0);
+    }
+
+    // put the cursor back on its line, inside the pane and off continuation bytes
+    int rows = editorBoundary.bottom - editorBoundary.top + 1;
+    int cols = editorBoundary.right - editorBoundary.left + 1;
+    cursorLine = std::min(cursorLine, (int)editorContent.size() - 1);
+    extremeY = std::min(std::max(extremeY, cursorLine - rows + 1), cursorLine);
+    cursorY = editorBoundary.top + cursorLine - extremeY;
+    const std::string &current = editorContent[cursorLine];
+    col = std::min(col, (int)current.size());
+    while (col > 0 && col < (int)current.size() && utf8IsContinuation(current[col])) col--;
+    if (col < extremeX || col >= extremeX + cols) extremeX = std::max(0, col - cols + 1);
+    cursorX = editorBoundary.left + col - extremeX;
+
+    damageLines({editorBoundary.top, editorBoundary.bottom});
+    statusMessage = "Reloaded, " + std::to_string(replaced) + " lines changed";
+    refreshStatus();
+}
+
+// compares every open file with what was last read or written; unmodified buffers are reloaded,
+// the active one only while no autosave is pending
+void checkDisk() {
+    for (int i = 0; i < (int)buffers.size(); i++) {
+        if (i != currentBuffer) {
+            storeBuffer(buffers[currentBuffer]);
+            loadBuffer(buffers[i]);
+        }
+        if (!filename.empty() && !diskConflict && !(diskStateOf(filename) == disk)) {
+            if (i == currentBuffer && deferredWork.count("autosave")) {
+                diskConflict = true;
+                statusMessage = "Changed on disk: ESC r reload, ESC w overwrite";
+                refreshStatus();
+            }
+            else {
+                reloadFile();
+            }
+        }
+        if (i != currentBuffer) {
+            storeBuffer(buffers[i]);
+            loadBuffer(buffers[currentBuffer]);
+        }
+    }
 }
 
 void Endwin() { endwin(); }
 
 void init() {
     atexit(Endwin);
+    setlocale(LC_ALL, "");
     initscr();
     noecho();
     cbreak();
+    idlok(stdscr, TRUE);
+    timeout(ESCAPE_TIMEOUT_MS);
     setDimensions();
     cursorX = editorBoundary.left;
     cursorY = editorBoundary.top;
@@ -684,18 +1209,63 @@ void init() {
 int main(int argc, char *argv[]) {
 
     init();
+    initKeymap();
 
-    if (argc > 1) filename = argv[1];
+    buffers.resize(std::max(1, argc - 1));
+    for (int i = 0; i < (int)buffers.size(); i++) {
+        if (i + 1 < argc) filename = argv[i + 1];
+        fileReader();
+        storeBuffer(buffers[i]);
+    }
+    loadBuffer(buffers[0]);
+    refreshStatus();
 
-    fileReader();
+    damageLines({editorBoundary.top, editorBoundary.bottom});
 
-    refreshEditor({editorBoundary.top, editorBoundary.bottom});
+    // sleep in poll() until a key arrives or deferred work is due; SIGWINCH interrupts the poll
+    // and getch() then reports KEY_RESIZE. The terminal is only updated once all queued input
+    // has been handled, and at most MAX_FPS times a second.
+    const auto frameInterval = std::chrono::milliseconds(1000 / MAX_FPS);
+    auto lastFrame = std::chrono::steady_clock::now() - frameInterval;
+    bool frameDirty = true;
 
     while (1) {
-        move(cursorY, cursorX);
-        processKeypress();
-        refresh();
-        fileWriter();
+        struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+        struct pollfd fds[2] = {pfd, {inotifyFd, POLLIN, 0}};
+        int timeoutMs = msUntilDeferred();
+
+        if (frameDirty && poll(&pfd, 1, 0) == 0) {
+            auto now = std::chrono::steady_clock::now();
+            if (now - lastFrame >= frameInterval) {
+                repaintDamage();
+                placeCursor();
+                refresh();
+                lastFrame = now;
+                frameDirty = false;
+                continue;
+            }
+            int untilFrame = (int)std::chrono::duration_cast<std::chrono::milliseconds>(lastFrame + frameInterval - now).count() + 1;
+            if (timeoutMs == -1 || untilFrame < timeoutMs) timeoutMs = untilFrame;
+        }
+
+        int ready = poll(fds, 2, timeoutMs);
+        if (ready > 0 && (fds[1].revents & POLLIN)) {
+            // another program wrote one of the files; compare once it has settled
+            char events[4096];
+            while (read(inotifyFd, events, sizeof(events)) > 0);
+            schedule("reload", RELOAD_DELAY_MS, [] { checkDisk(); });
+            frameDirty = true;
+            if (!(fds[0].revents & POLLIN)) continue;
+        }
+        if (ready > 0) {
+            processKeypress();
+            frameDirty = true;
+        }
+        else if (ready == -1 && errno == EINTR) {
+            processKeypress();
+            frameDirty = true;
+        }
+        if (runDeferred()) frameDirty = true;
     }
 
 
@@ -4,18 +4,29 @@
 #define _BSD_SOURCE
 #define _GNU_SOURCE
 
+#include <poll.h>
 #include <time.h>
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <termios.h>
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <dirent.h>
+#include <pthread.h>
 
 #include "utils.c"
 
@@ -24,23 +35,76 @@
 #define KB_VERSION "0.0.1"
 #define KB_TAB_SIZE 4
 #define KB_QUIT_TIMES 3
-
-#define LEFT_MARGIN 6
+#define KB_STATUS_TIMEOUT_MS 5000
+#define KB_ESC_TIMEOUT_MS 100
+#define KB_MAX_TIMERS 16
+#define KB_MAX_FPS 60
+#define KB_MEMORY_LIMIT_MB 512
+#define KB_VIEW_PAGE (1 << 16)
+#define KB_VIEW_CHUNK (1 << 20)
+#define KB_VIEW_CACHE_MB 64
+#define KB_VIEW_MAX_MARKS (1 << 16)
+#define KB_VIEW_INDEX_SLICE_MS 8
+#define KB_RELOAD_DELAY_MS 100
+#define KB_JOURNAL_FLUSH_MS 1000
+#define KB_JOURNAL_COMPACT_MB 4
+#define KB_JOURNAL_MAGIC "KBSWAP1\n"
+#define KB_HL_PARALLEL_ROWS 4096
+#define KB_HL_MAX_THREADS 16
+#define KB_COMPLETE_SLICE_MS 8
+#define KB_COMPLETE_MAX 16
+#define KB_KILL_RING 16
+
+#define GUTTER_MIN_DIGITS 4
 #define AUTO_INDENTATION 1
 #define AUTO_BRACKETS 1
-#define CTRL_KEY(k) ((k) & 0x1f)
-
-enum editorKey {
-	BACKSPACE = 127,
-	ARROW_LEFT = 1000,
-	ARROW_RIGHT,
-	ARROW_UP,
-	ARROW_DOWN,
-	DEL_KEY,
-	HOME_KEY,
-	END_KEY,
-	PAGE_UP,
-	PAGE_DOWN
+
+/* what a key can be bound to; the names are in editorCommands */
+enum editorCommand {
+	CMD_NEWLINE,
+	CMD_BACKSPACE,
+	CMD_DELETE,
+	CMD_UP,
+	CMD_DOWN,
+	CMD_LEFT,
+	CMD_RIGHT,
+	CMD_LINE_START,
+	CMD_LINE_END,
+	CMD_PAGE_UP,
+	CMD_PAGE_DOWN,
+	CMD_SELECT_UP,
+	CMD_SELECT_DOWN,
+	CMD_SELECT_LEFT,
+	CMD_SELECT_RIGHT,
+	CMD_SELECT_LINE_START,
+	CMD_SELECT_LINE_END,
+	CMD_CANCEL,
+	CMD_SAVE,
+	CMD_QUIT,
+	CMD_FIND,
+	CMD_COPY,
+	CMD_CUT,
+	CMD_PASTE,
+	CMD_YANK_POP,
+	CMD_CURSOR_NEXT_MATCH,
+	CMD_CURSOR_ALL_MATCHES,
+	CMD_CURSOR_COLUMN,
+	CMD_MACRO_RECORD,
+	CMD_MACRO_REPLAY,
+	CMD_TOGGLE_WRAP,
+	CMD_OPEN,
+	CMD_NEXT_BUFFER,
+	CMD_PREV_BUFFER,
+	CMD_SPLIT_HORIZONTAL,
+	CMD_SPLIT_VERTICAL,
+	CMD_NEXT_VIEW,
+	CMD_CLOSE_VIEW,
+	CMD_FOLLOW,
+	CMD_MATCH_BRACKET,
+	CMD_FOLD,
+	CMD_FOLD_ALL,
+	CMD_COMPLETE,
+	CMD_COUNT
 };
 
 enum editorHighlight {
@@ -54,11 +118,65 @@ enum editorHighlight {
 	HL_MATCH
 };
 
+/* opcodes of the swap journal records */
+enum journalOp {
+	JOURNAL_BASE = 'B',
+	JOURNAL_INSERT = 'I',
+	JOURNAL_DELETE = 'D',
+	JOURNAL_SPLICE = 'S',
+	JOURNAL_CLEAR = 'C'
+};
+
 #define HL_HIGHLIGHT_NUMBERS (1 << 0)
 #define HL_HIGHLIGHT_STRINGS (1 << 1)
+#define HL_COMMENT_SEPARATED (1 << 2)
+
+#define HL_DEFAULT_SEPARATORS ",.()+-/*=~%<>[];"
+
+/* flags of a DFA state */
+#define DFA_ACCEPT (1 << 0)
+#define DFA_STOP (1 << 1)
+#define DFA_EOL (1 << 2)
+#define DFA_OPEN (1 << 3)
+#define DFA_SKIP (1 << 4)
+#define DFA_MAX_STATES 65535
+#define DFA_SKIP_NONE -1
+#define DFA_SKIP_ALL -2
+#define DFA_SKIP_MIN_LOOP 128
 
 /*** data ***/
 
+/*
+ * A highlighter compiled from a syntax definition. Bytes are mapped to
+ * classes and next[state * nclasses + class] is the transition; state 0
+ * is dead. accept is the highlight of a token ending in a state with
+ * DFA_ACCEPT, eol the highlight of the rest of a row ending in a string or
+ * comment (DFA_EOL); DFA_OPEN marks a multi-line comment still open.
+ *
+ * The rest lets the lexer skip bytes without stepping the DFA: from the
+ * start state, everything before the first byte in `tokens` that does not
+ * continue a run of `words` lexes as plain text. For a state with DFA_SKIP,
+ * skip[state] is DFA_SKIP_ALL if it loops on every byte, or else the index
+ * in stops of the bytes that leave it; it loops on most of the others, or
+ * it is the identifier state, which loops on the word bytes.
+ */
+struct syntaxDfa {
+	unsigned char cls[256];
+	int nclasses;
+	int nstates;
+	uint16_t *next;
+	unsigned char *accept;
+	unsigned char *eol;
+	unsigned char *flags;
+	int start;
+	int comment;
+	struct byteSetTable tokens;
+	struct byteSetTable words;
+	short *skip;
+	struct byteSetTable *stops;
+	int nstops;
+};
+
 struct editorSyntax {
 	char *filetype;
 	char **filematch;
@@ -67,8 +185,42 @@ struct editorSyntax {
 	char *multiline_comment_start;
 	char *multiline_comment_end;
 	int flags;
+	char *quotes;
+	int escape;
+	char *separators;
+	struct syntaxDfa *dfa;
+	int words_indexed;
 };
 
+/* the NFA a syntax definition is first translated into */
+struct nfaEdge {
+	uint64_t set[4];
+	int to;
+};
+
+struct nfaState {
+	int accept;
+	int prio;
+	int flags;
+	int eol;
+	struct nfaEdge *edges;
+	int nedges;
+};
+
+struct nfa {
+	struct nfaState *states;
+	int n;
+};
+
+typedef struct ecol {
+	int cx;
+	int rx;
+	int bx;
+	int next_cx;
+	int next_rx;
+	int next_bx;
+} ecol;
+
 typedef struct erow {
 	int idx;
 	int size;
@@ -76,25 +228,277 @@ typedef struct erow {
 	char *chars;
 	char *render;
 	unsigned char *hl;
+	ecol *cols;
+	int ncols;
+	int rwidth;
+	int wide;
+	int wrap_lines;
+	int wrap_cols;
 	int initial_tab_count;
 	int hl_open_comment;
+	int bracket_sum;
+	int bracket_lo;
+	int folded;
+	int *words;
+	int nwords;
 } erow;
 
+struct fold {
+	int start;
+	int end;
+};
+
+/* len bytes at off in a shared, immutable block of row chars */
+struct killSpan {
+	char *block;
+	int off;
+	int len;
+};
+
+struct cursor {
+	int cx, cy;
+};
+
+/* killed or copied text, one span per line */
+struct killEntry {
+	struct killSpan *spans;
+	int nspans;
+};
+
+struct inputBuffer {
+	char buf[4096];
+	int len;
+	int pos;
+};
+
+struct editorTimer {
+	void (*fn)(void);
+	long long due;
+};
+
+struct editorBuffer {
+	int cx, cy;
+	int rowoff;
+	int rowseg;
+	int coloff;
+	int numrows;
+	erow *row;
+	int *wrapindex;
+	int wrapindex_valid;
+	struct depthNode *bracketindex;
+	int bracketsize;
+	int bracketindex_valid;
+	struct fold *folds;
+	int nfolds;
+	int *foldindex;
+	int foldindex_valid;
+	int complete_scan;
+	int sel_active;
+	int sel_cx, sel_cy;
+	struct cursor *cursors;
+	int ncursors;
+	int dirty;
+	char *filename;
+	struct editorSyntax *syntax;
+	int editlo, edithi;
+	int cached;
+	long long last_used;
+	off_t filesize;
+	int follow;
+	int follow_fd;
+	int follow_wd;
+	int follow_pending;
+	int follow_partial;
+	off_t follow_off;
+	int watch_wd;
+	int reload_pending;
+	ino_t disk_ino;
+	off_t disk_size;
+	struct timespec disk_mtime;
+	int disk_changed;
+	int overwrite;
+	int journal_open;
+	int journal_fd;
+	char *journal_path;
+	char *journal_buf;
+	int journal_len;
+	int journal_cap;
+	off_t journal_size;
+	off_t journal_base_size;
+	struct timespec journal_base_mtime;
+	int journal_rebase;
+	int journal_broken;
+};
+
+enum splitKind {
+	SPLIT_FREE = 0,
+	SPLIT_VIEW,
+	SPLIT_HORIZONTAL,
+	SPLIT_VERTICAL
+};
+
+/* a node of the layout tree; leaves hold a view, inner nodes two children */
+struct editorSplit {
+	int kind;
+	int view;
+	int a, b;
+	int top, left, rows, cols;
+};
+
+/* everything the rendered rows of a view depend on besides the rows themselves */
+struct viewKey {
+	int buf;
+	int rowoff, rowseg, coloff;
+	int rows, cols;
+	int gutter;
+	int wrap;
+};
+
+struct editorView {
+	int buf;
+	int cx, cy;
+	int rowoff, rowseg, coloff;
+	int top, left, rows, cols;
+	struct abuf *lines;
+	int nlines;
+	struct viewKey key;
+	int lastrow;
+};
+
+struct viewPage {
+	off_t page;
+	char *data;
+	int len;
+	long long last_used;
+};
+
+/*
+ * state of kb --view; marks[k] is the offset of line (k + 1) * stride.
+ * goto_line is a line jumped to before the index reached it, or -1.
+ */
+struct streamView {
+	int fd;
+	char *filename;
+	off_t size;
+	struct viewPage *pages;
+	int npages;
+	long long clock;
+	char *chunk;
+	off_t *marks;
+	int nmarks;
+	int stride;
+	off_t indexed;
+	long long lines;
+	int indexed_all;
+	off_t top;
+	long long topline;
+	long long goto_line;
+	int coloff;
+	off_t match;
+	int matchlen;
+	char *line;
+	int linecap;
+};
+
 struct editorConfig {
 	int cx, cy;
 	int rx;
 	int rowoff;
+	int rowseg;
 	int coloff;
 	int screenrows;
 	int screencols;
+	int viewcols;
+	int winrows;
+	int wincols;
+	int gutter;
+	char *gutterbuf;
+	int gutterfirst;
+	int gutterrows;
+	int gutternumrows;
 	int numrows;
 	erow *row;
+	int wrap;
+	int wrapcols;
+	int *wrapindex;
+	int wrapindex_valid;
+	struct depthNode *bracketindex;
+	int bracketsize;
+	int bracketindex_valid;
+	struct byteSetTable brackets;
+	int bracket_buf;
+	int bracket_row[2];
+	int bracket_bx[2];
+	struct fold *folds;
+	int nfolds;
+	int *foldindex;
+	int foldindex_valid;
+	struct tst words;
+	int complete_scan;
+	int complete_defer;
+	int complete_scheduled;
+	int sel_active;
+	int sel_cx, sel_cy;
+	int sel_buf;
+	int sel_shown[4];
+	struct cursor *cursors;
+	int ncursors;
+	int cursors_buf;
+	struct cursor *cursors_shown;
+	int ncursors_shown;
+	struct killEntry kill[KB_KILL_RING];
+	int nkill;
+	int yank_active;
+	int yank_cx, yank_cy;
+	int yank_index;
+	int hl_defer;
+	int hl_lo, hl_tail;
+	int *macro;
+	int nmacro;
+	int *record;
+	int nrecord, recordcap;
+	int record_start;
+	int recording;
+	int macro_pos;
 	int dirty;
 	char *filename;
 	char statusmsg[80];
 	time_t statusmsg_time;
 	struct editorSyntax *syntax;
 	struct termios orig_termios;
+	struct inputBuffer input;
+	int epfd;
+	int timerfd;
+	int sigfd;
+	struct editorTimer timers[KB_MAX_TIMERS];
+	int ntimers;
+	int redraw;
+	long long last_frame;
+	int frame_pending;
+	uint64_t *shadow;
+	int shadowrows;
+	int shadowtop;
+	struct editorBuffer *buffers;
+	int nbuffers;
+	int curbuf;
+	size_t memlimit;
+	int editlo, edithi;
+	struct editorView *views;
+	int nviews;
+	int curview;
+	struct editorSplit *splits;
+	int nsplits;
+	int root;
+	struct streamView *stream;
+	int inotifyfd;
+	int follow_scheduled;
+	int journal_suspend;
+	int journal_scheduled;
+	struct editorSyntax *syntaxdb;
+	int nsyntaxdb;
+	int syntaxdb_loaded;
+	struct keymap keymap;
+	int command_key[CMD_COUNT];
 };
 
 struct editorConfig E;
@@ -116,17 +520,150 @@ struct editorSyntax HLDB[] = {
 		C_HL_extensions,
 		C_HL_keywords,
 		"//", "/*", "*/",
-		HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+		HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+		"\"'", '\\', NULL, NULL, 0
 	},
 };
 
 #define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
 
+/*** keybindings ***/
+
+const char *const editorCommands[CMD_COUNT] = {
+	[CMD_NEWLINE] = "newline",
+	[CMD_BACKSPACE] = "backspace",
+	[CMD_DELETE] = "delete",
+	[CMD_UP] = "up",
+	[CMD_DOWN] = "down",
+	[CMD_LEFT] = "left",
+	[CMD_RIGHT] = "right",
+	[CMD_LINE_START] = "line-start",
+	[CMD_LINE_END] = "line-end",
+	[CMD_PAGE_UP] = "page-up",
+	[CMD_PAGE_DOWN] = "page-down",
+	[CMD_SELECT_UP] = "select-up",
+	[CMD_SELECT_DOWN] = "select-down",
+	[CMD_SELECT_LEFT] = "select-left",
+	[CMD_SELECT_RIGHT] = "select-right",
+	[CMD_SELECT_LINE_START] = "select-line-start",
+	[CMD_SELECT_LINE_END] = "select-line-end",
+	[CMD_CANCEL] = "cancel",
+	[CMD_SAVE] = "save",
+	[CMD_QUIT] = "quit",
+	[CMD_FIND] = "find",
+	[CMD_COPY] = "copy",
+	[CMD_CUT] = "cut",
+	[CMD_PASTE] = "paste",
+	[CMD_YANK_POP] = "yank-pop",
+	[CMD_CURSOR_NEXT_MATCH] = "cursor-next-match",
+	[CMD_CURSOR_ALL_MATCHES] = "cursor-all-matches",
+	[CMD_CURSOR_COLUMN] = "cursor-column",
+	[CMD_MACRO_RECORD] = "macro-record",
+	[CMD_MACRO_REPLAY] = "macro-replay",
+	[CMD_TOGGLE_WRAP] = "toggle-wrap",
+	[CMD_OPEN] = "open",
+	[CMD_NEXT_BUFFER] = "next-buffer",
+	[CMD_PREV_BUFFER] = "prev-buffer",
+	[CMD_SPLIT_HORIZONTAL] = "split-horizontal",
+	[CMD_SPLIT_VERTICAL] = "split-vertical",
+	[CMD_NEXT_VIEW] = "next-view",
+	[CMD_CLOSE_VIEW] = "close-view",
+	[CMD_FOLLOW] = "follow",
+	[CMD_MATCH_BRACKET] = "match-bracket",
+	[CMD_FOLD] = "fold",
+	[CMD_FOLD_ALL] = "fold-all",
+	[CMD_COMPLETE] = "complete",
+};
+
+/* the bindings kb starts with, before the keymap file */
+struct editorBinding {
+	int key;
+	int command;
+} editorDefaultBindings[] = {
+	{ '\r', CMD_NEWLINE },
+	{ BACKSPACE, CMD_BACKSPACE },
+	{ DEL_KEY, CMD_DELETE },
+	{ ARROW_UP, CMD_UP },
+	{ ARROW_DOWN, CMD_DOWN },
+	{ ARROW_LEFT, CMD_LEFT },
+	{ ARROW_RIGHT, CMD_RIGHT },
+	{ HOME_KEY, CMD_LINE_START },
+	{ END_KEY, CMD_LINE_END },
+	{ PAGE_UP, CMD_PAGE_UP },
+	{ PAGE_DOWN, CMD_PAGE_DOWN },
+	{ SHIFT_ARROW_UP, CMD_SELECT_UP },
+	{ SHIFT_ARROW_DOWN, CMD_SELECT_DOWN },
+	{ SHIFT_ARROW_LEFT, CMD_SELECT_LEFT },
+	{ SHIFT_ARROW_RIGHT, CMD_SELECT_RIGHT },
+	{ SHIFT_HOME_KEY, CMD_SELECT_LINE_START },
+	{ SHIFT_END_KEY, CMD_SELECT_LINE_END },
+	{ '\x1b', CMD_CANCEL },
+	{ CTRL_KEY('s'), CMD_SAVE },
+	{ CTRL_KEY('w'), CMD_QUIT },
+	{ CTRL_KEY('f'), CMD_FIND },
+	{ CTRL_KEY('c'), CMD_COPY },
+	{ CTRL_KEY('x'), CMD_CUT },
+	{ CTRL_KEY('v'), CMD_PASTE },
+	{ META_KEY('y'), CMD_YANK_POP },
+	{ CTRL_KEY('d'), CMD_CURSOR_NEXT_MATCH },
+	{ META_KEY('a'), CMD_CURSOR_ALL_MATCHES },
+	{ META_KEY('c'), CMD_CURSOR_COLUMN },
+	{ META_KEY('r'), CMD_MACRO_RECORD },
+	{ META_KEY('e'), CMD_MACRO_REPLAY },
+	{ CTRL_KEY('t'), CMD_TOGGLE_WRAP },
+	{ CTRL_KEY('o'), CMD_OPEN },
+	{ CTRL_KEY('n'), CMD_NEXT_BUFFER },
+	{ CTRL_KEY('p'), CMD_PREV_BUFFER },
+	{ CTRL_KEY('e'), CMD_SPLIT_HORIZONTAL },
+	{ CTRL_KEY('r'), CMD_SPLIT_VERTICAL },
+	{ CTRL_KEY('g'), CMD_NEXT_VIEW },
+	{ CTRL_KEY('y'), CMD_CLOSE_VIEW },
+	{ CTRL_KEY('l'), CMD_FOLLOW },
+	{ CTRL_KEY(']'), CMD_MATCH_BRACKET },
+	{ CTRL_KEY('b'), CMD_FOLD },
+	{ CTRL_KEY('u'), CMD_FOLD_ALL },
+	{ '\0', CMD_COMPLETE },
+};
+
+#define DEFAULT_BINDINGS (sizeof(editorDefaultBindings) / sizeof(editorDefaultBindings[0]))
+
 /*** prototypes ***/
 
 void editorSetStatusMessage(const char *fmt, ...);
+void editorWrapUpdateRow(erow *row);
+void editorRowBrackets(erow *row);
+void editorBracketUpdateRow(erow *row);
+void editorFoldInsert(int at, int n);
+void editorFoldDelete(int at, int n);
+void editorFoldReveal(int filerow);
+void editorCompleteUpdateRow(erow *row);
+void editorCompleteUnindexRow(erow *row);
+void editorCompleteKeywords(struct editorSyntax *s);
+void editorCompleteSchedule();
+void editorInvalidateScreen();
+void editorUpdateGutter();
+void editorLayout();
+void editorSnapCursor();
+void editorMoveCursor(int key);
+void editorWaitForInput();
 void editorRefreshScreen();
+void editorRenderFrame();
+void viewerRefreshScreen();
+void editorWatchEvents();
+int editorWatchInit();
+void editorWatchFile(int i);
+char *editorBufferFilename(int i);
+void editorDiskRecord(struct editorBuffer *b, int fd);
+int editorDiskChanged(struct editorBuffer *b, const char *filename);
+void editorRequestFrame();
+void editorJournalInsert(int at, char **lines, int *lens, int n);
+void editorJournalDelete(int at, int n);
+void editorJournalSplice(int at, int col, int del, char *s, int len);
+void editorJournalReset(struct editorBuffer *b);
+int editorJournalRecover();
 char *editorPrompt(char *prompt, void (*callback)(char *, int));
+void editorMacroRecord(int c);
+void editorProcessKeypress();
 
 /*** terminal ***/
 
@@ -139,6 +676,7 @@ void die(const char *s) {
 }
 
 void disableRawMode() {
+	write(STDOUT_FILENO, "\x1b[?2004l", 8);
 	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1) {
 		die("tcsetattr");
 	}
@@ -156,68 +694,94 @@ void enableRawMode() {
 	raw.c_cflag |= (CS8);
 	raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
 	raw.c_cc[VMIN] = 0;
-	raw.c_cc[VTIME] = 1;
+	raw.c_cc[VTIME] = 0;
 
 	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) {
 		die("tcsetattr");
 	}
+	write(STDOUT_FILENO, "\x1b[?2004h", 8);
 }
 
-int editorReadKey() {
-	int nread;
-	char c;
-	while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-		if (nread == -1 && errno != EAGAIN) {
-			die("read");
-		}
+/*
+ * Input is read in one read() per wakeup into E.input and decoded from
+ * there, so a burst of keys or a paste costs one syscall instead of one
+ * per byte. Reads never block; waiting is done by the event loop.
+ */
+int editorInputFill() {
+	struct inputBuffer *in = &E.input;
+	if (in->pos == in->len) {
+		in->pos = in->len = 0;
+	}
+	else if (in->pos > 0) {
+		memmove(in->buf, &in->buf[in->pos], in->len - in->pos);
+		in->len -= in->pos;
+		in->pos = 0;
+	}
+	if (in->len == (int) sizeof(in->buf)) {
+		return 0;
 	}
 
-	if (c == '\x1b') {
-		char seq[3];
+	int nread = read(STDIN_FILENO, &in->buf[in->len], sizeof(in->buf) - in->len);
+	if (nread == -1 && errno != EAGAIN) {
+		die("read");
+	}
+	if (nread <= 0) {
+		return 0;
+	}
+	in->len += nread;
+	return nread;
+}
 
-		if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-		if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
+int editorInputPending() {
+	return E.input.len - E.input.pos;
+}
 
-		if (seq[0] == '[') {
-			if (seq[1] >= '0' && seq[1] <= '9') {
-				if (read(STDIN_FILENO, &seq[2], 1) != 1) {
-					return '\x1b';
-				}
-				if (seq[2] == '~') {
-					switch (seq[1]) {
-						case '1': return HOME_KEY;
-						case '3': return DEL_KEY;
-						case '4': return END_KEY;
-						case '5': return PAGE_UP;
-						case '6': return PAGE_DOWN;
-						case '7': return HOME_KEY;
-						case '8': return END_KEY;
-					}
-				}
-			}
-			else {
-				switch (seq[1]) {
-					case 'A': return ARROW_UP;
-					case 'B': return ARROW_DOWN;
-					case 'C': return ARROW_RIGHT;
-					case 'D': return ARROW_LEFT;
-					case 'H': return HOME_KEY;
-					case 'F': return END_KEY;
-				}
-			}
+int editorInputWait(int timeout_ms) {
+	struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+	return poll(&pfd, 1, timeout_ms) > 0;
+}
+
+int editorInputNeed(int n) {
+	while (editorInputPending() < n) {
+		if (!editorInputWait(KB_ESC_TIMEOUT_MS) || !editorInputFill()) {
+			return 0;
 		}
-		else if (seq[0] == 'O') {
-			switch (seq[1]) {
-				case 'H': return HOME_KEY;
-				case 'F': return END_KEY;
-			}
+	}
+	return 1;
+}
+
+/* decodes the next key with keyDecode, waiting a moment for the rest of a sequence */
+int editorReadTerminalKey() {
+	while (editorInputPending() == 0) {
+		editorWaitForInput();
+		editorInputFill();
+	}
+
+	int c, used;
+	while ((c = keyDecode(&E.input.buf[E.input.pos], editorInputPending(), &used)) == KEY_INCOMPLETE) {
+		if (!editorInputNeed(editorInputPending() + 1)) {
+			c = '\x1b';
+			used = 1;
+			break;
 		}
+	}
+	E.input.pos += used;
+	return c;
+}
 
-		return '\x1b';
+/* the next key of the macro being replayed, or else from the terminal */
+int editorReadKey() {
+	if (E.macro_pos >= 0) {
+		return E.macro_pos < E.nmacro ? E.macro[E.macro_pos++] : '\x1b';
 	}
-	else {
-		return c;
+	int c = editorReadTerminalKey();
+	if (E.recording) {
+		if (E.keymap.state < 0) {
+			E.record_start = E.nrecord;
+		}
+		editorMacroRecord(c);
 	}
+	return c;
 }
 
 int getCursorPosition(int *rows, int *cols) {
@@ -229,6 +793,7 @@ int getCursorPosition(int *rows, int *cols) {
 	}
 
 	while (i < sizeof(buf) - 1) {
+		if (!editorInputWait(KB_ESC_TIMEOUT_MS)) break;
 		if (read(STDIN_FILENO, &buf[i], 1) != 1) break;
 		if (buf[i] == 'R') break;
 		i++;
@@ -261,719 +826,6063 @@ int getWindowSize(int *rows, int *cols) {
 	}
 }
 
-/*** syntax highlighting ***/
-
-int is_separator(int c) {
-	return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+/*** event loop ***/
+
+/*
+ * The editor sleeps in epoll_wait on three sources: stdin, a timerfd armed
+ * for the earliest deferred task and a signalfd for SIGWINCH. Nothing runs
+ * while idle; deferred work is queued with editorSchedule.
+ */
+long long editorNow() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
-void editorUpdateSyntax(erow *row) {
-	row->hl = realloc(row->hl, row->rsize);
-	memset(row->hl, HL_NORMAL, row->rsize);
+void editorArmTimer() {
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+	if (E.ntimers > 0) {
+		long long due = E.timers[0].due;
+		for (int i = 1; i < E.ntimers; i++) {
+			if (E.timers[i].due < due) {
+				due = E.timers[i].due;
+			}
+		}
+		its.it_value.tv_sec = due / 1000;
+		its.it_value.tv_nsec = (due % 1000) * 1000000 + 1;
+	}
+	timerfd_settime(E.timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
 
-	if (E.syntax == NULL) return;
+/* Runs fn once delay_ms from now, replacing an earlier request for fn. */
+void editorSchedule(void (*fn)(void), int delay_ms) {
+	int i;
+	for (i = 0; i < E.ntimers; i++) {
+		if (E.timers[i].fn == fn) break;
+	}
+	if (i == E.ntimers) {
+		if (E.ntimers == KB_MAX_TIMERS) return;
+		E.ntimers++;
+	}
+	E.timers[i].fn = fn;
+	E.timers[i].due = editorNow() + delay_ms;
+	editorArmTimer();
+}
 
-	char **keywords = E.syntax->keywords;
+void editorCancel(void (*fn)(void)) {
+	for (int i = 0; i < E.ntimers; i++) {
+		if (E.timers[i].fn == fn) {
+			E.timers[i] = E.timers[--E.ntimers];
+			break;
+		}
+	}
+	editorArmTimer();
+}
 
-	char *scs = E.syntax->singleline_comment_start;
-	char *mcs = E.syntax->multiline_comment_start;
-	char *mce = E.syntax->multiline_comment_end;
+void editorRunTimers() {
+	uint64_t expirations;
+	read(E.timerfd, &expirations, sizeof(expirations));
 
-	int scs_len = scs ? strlen(scs) : 0;
-	int mcs_len = mcs ? strlen(mcs) : 0;
-	int mce_len = mce ? strlen(mce) : 0;
+	long long now = editorNow();
+	int i = 0;
+	while (i < E.ntimers) {
+		if (E.timers[i].due <= now) {
+			void (*fn)(void) = E.timers[i].fn;
+			E.timers[i] = E.timers[--E.ntimers];
+			fn();
+		}
+		else {
+			i++;
+		}
+	}
+	editorArmTimer();
+}
 
-	int prev_sep = 1;
-	int in_string = 0;
-	int in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment);
+void editorHandleResize() {
+	struct signalfd_siginfo info;
+	while (read(E.sigfd, &info, sizeof(info)) == sizeof(info));
 
-	int i = 0;
-	while (i < row->rsize) {
-		char c = row->render[i];
-		unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+	struct winsize ws;
+	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col != 0) {
+		E.winrows = ws.ws_row - 2;
+		E.wincols = ws.ws_col;
+		if (E.winrows < 1) E.winrows = 1;
+		editorLayout();
+	}
+	editorInvalidateScreen();
+	E.redraw = 1;
+}
 
-		if (scs_len && !in_string && !in_comment) {
-			if (!strncmp(&row->render[i], scs, scs_len)) {
-				memset(&row->hl[i], HL_COMMENT, row->rsize - i);
-				break;
-			}
+void editorWaitForInput() {
+	while (1) {
+		struct epoll_event events[4];
+		int n = epoll_wait(E.epfd, events, 4, -1);
+		if (n == -1) {
+			if (errno == EINTR) continue;
+			die("epoll_wait");
 		}
 
-		if (mcs_len && mce_len && !in_string) {
-			if (in_comment) {
-				row->hl[i] = HL_MLCOMMENT;
-				if (!strncmp(&row->render[i], mce, mce_len)) {
-					memset(&row->hl[i], HL_MLCOMMENT, mce_len);
-					i += mce_len;
-					in_comment = 0;
-					prev_sep = 1;
-				}
-				else {
-					i++;
-				}
-				continue;
+		int input = 0;
+		for (int i = 0; i < n; i++) {
+			int fd = events[i].data.fd;
+			if (fd == STDIN_FILENO) {
+				input = 1;
 			}
-			else if (!strncmp(&row->render[i], mcs, mcs_len)) {
-				memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
-				i += mcs_len;
-				in_comment = 1;
-				continue;
+			else if (fd == E.timerfd) {
+				editorRunTimers();
 			}
-		}
-
-		if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
-			if (in_string) {
-				row->hl[i] = HL_STRING;
-				if (c == '\\' && i + 1 < row->rsize) {
-					row->hl[i + 1] = HL_STRING;
-					i += 2;
-					continue;
-				}
-				if (c == in_string) {
-					in_string = 0;
-				}
-				i++;
-				prev_sep = 1;
-				continue;
+			else if (fd == E.sigfd) {
+				editorHandleResize();
 			}
-			else {
-				if (c == '"' || c == '\'') {
-					in_string = c;
-					row->hl[i] = HL_STRING;
-					i++;
-					continue;
-				}
+			else if (fd == E.inotifyfd) {
+				editorWatchEvents();
 			}
 		}
-
-		if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
-			if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) || (c == '.' && prev_hl == HL_NUMBER)) {
-				row->hl[i] = HL_NUMBER;
-				i++;
-				prev_sep = 0;
-				continue;
-			}
+		if (input) {
+			return;
 		}
-
-		if (prev_sep) {
-			int j;
-			for (j = 0; keywords[j]; j++) {
-				int klen = strlen(keywords[j]);
-				int kw2 = keywords[j][klen - 1] == '|';
-				if (kw2) klen--;
-
-				if (!strncmp(&row->render[i], keywords[j], klen) && is_separator(row->render[i + klen])) {
-					memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-					i += klen;
-					break;
-				}
-			}
-			if (keywords[j] != NULL) {
-				prev_sep = 0;
-				continue;
-			}
+		if (E.redraw) {
+			editorRefreshScreen();
 		}
-
-		prev_sep = is_separator(c);
-		i++;
 	}
+}
 
-	int changed = (row->hl_open_comment != in_comment);
-	row->hl_open_comment = in_comment;
-	if (changed && row->idx + 1 < E.numrows) {
-		editorUpdateSyntax(&E.row[row->idx + 1]);
+void editorEventAdd(int fd) {
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	if (epoll_ctl(E.epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+		die("epoll_ctl");
 	}
 }
 
-int editorSyntaxToColor(int hl) {
-	switch (hl) {
-		case HL_COMMENT:
-		case HL_MLCOMMENT: return 36;
-		case HL_KEYWORD1: return 33;
-		case HL_KEYWORD2: return 32;
-		case HL_STRING: return 35;
-		case HL_NUMBER: return 31;
-		case HL_MATCH: return 34;
-		default: return 37;
+void initEventLoop() {
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGWINCH);
+	if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1) {
+		die("sigprocmask");
+	}
+
+	E.epfd = epoll_create1(EPOLL_CLOEXEC);
+	E.timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	E.sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (E.epfd == -1 || E.timerfd == -1 || E.sigfd == -1) {
+		die("initEventLoop");
 	}
+	editorEventAdd(STDIN_FILENO);
+	editorEventAdd(E.timerfd);
+	editorEventAdd(E.sigfd);
 }
 
-void editorSelectSyntaxHighlight() {
-	E.syntax = NULL;
-	if (E.filename == NULL) return;
+/*** syntax compiler ***/
+
+/*
+ * A syntax definition is compiled into a DFA the first time a file of its
+ * type is opened. Every kind of token is a path through an NFA from the
+ * start state: keywords are chains of bytes, identifiers and numbers loop
+ * over byte sets, strings and comments run to their closing delimiter.
+ * Subset construction merges the paths into one DFA, with transitions
+ * indexed by byte class; bytes that no pattern tells apart share a class.
+ * When a DFA state holds several accepting NFA states the one with the
+ * lowest prio wins, so "if" is a keyword rather than an identifier.
+ */
+void byteSetAdd(uint64_t *set, int c) {
+	set[c >> 6] |= 1ULL << (c & 63);
+}
 
-	for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
-		struct editorSyntax *s = &HLDB[j];
-		unsigned int i = 0;
-		while (s->filematch[i]) {
-			char *p = strstr(E.filename, s->filematch[i]);
-			if (p != NULL) {
-				int patlen = strlen(s->filematch[i]);
-				if (s->filematch[i][0] != '.' || p[patlen] == '\0') {
-					E.syntax = s;
-
-					for (int filerow = 0; filerow < E.numrows; filerow++) {
-						editorUpdateSyntax(&E.row[filerow]);
-					}
+void byteSetDel(uint64_t *set, int c) {
+	set[c >> 6] &= ~(1ULL << (c & 63));
+}
 
-					return;
-				}
-			}
-			i++;
+int byteSetHas(const uint64_t *set, int c) {
+	return (set[c >> 6] >> (c & 63)) & 1;
+}
+
+int nfaAdd(struct nfa *a, int accept, int prio, int flags, int eol) {
+	a->states = realloc(a->states, sizeof(struct nfaState) * (a->n + 1));
+	struct nfaState *st = &a->states[a->n];
+	st->accept = accept;
+	st->prio = prio;
+	st->flags = flags;
+	st->eol = eol;
+	st->edges = NULL;
+	st->nedges = 0;
+	return a->n++;
+}
+
+void nfaEdge(struct nfa *a, int from, const uint64_t *set, int to) {
+	struct nfaState *st = &a->states[from];
+	st->edges = realloc(st->edges, sizeof(struct nfaEdge) * (st->nedges + 1));
+	memcpy(st->edges[st->nedges].set, set, sizeof(st->edges[0].set));
+	st->edges[st->nedges].to = to;
+	st->nedges++;
+}
+
+void nfaByteEdge(struct nfa *a, int from, int c, int to) {
+	uint64_t set[4] = { 0, 0, 0, 0 };
+	byteSetAdd(set, c);
+	nfaEdge(a, from, set, to);
+}
+
+/* the bytes of s lead from state from to state to, through new states with flags and eol */
+void nfaChain(struct nfa *a, int from, const char *s, int len, int to, int flags, int eol) {
+	for (int i = 0; i < len; i++) {
+		int next = (i == len - 1) ? to : nfaAdd(a, 0, 0, flags, eol);
+		nfaByteEdge(a, from, (unsigned char) s[i], next);
+		from = next;
+	}
+}
+
+/* index of the DFA state for the NFA state set, which is added if it is new */
+int dfaIntern(uint64_t **sets, int *nsets, int words, int **table, int *tablesize, uint64_t *set) {
+	if (*nsets * 2 >= *tablesize) {
+		int size = *tablesize ? *tablesize * 2 : 256;
+		int *grown = malloc(sizeof(int) * size);
+		for (int i = 0; i < size; i++) grown[i] = -1;
+		for (int d = 0; d < *nsets; d++) {
+			int h = hashBytes((char *) &(*sets)[d * words], words * 8) & (size - 1);
+			while (grown[h] != -1) h = (h + 1) & (size - 1);
+			grown[h] = d;
+		}
+		free(*table);
+		*table = grown;
+		*tablesize = size;
+	}
+	int h = hashBytes((char *) set, words * 8) & (*tablesize - 1);
+	while ((*table)[h] != -1) {
+		if (memcmp(&(*sets)[(*table)[h] * words], set, words * 8) == 0) {
+			return (*table)[h];
 		}
+		h = (h + 1) & (*tablesize - 1);
 	}
+	*sets = realloc(*sets, sizeof(uint64_t) * words * (*nsets + 1));
+	memcpy(&(*sets)[*nsets * words], set, words * 8);
+	(*table)[h] = *nsets;
+	return (*nsets)++;
 }
 
-/*** row operations ***/
+#define DFA_NEXT(dfa, d, c) ((dfa)->next[(d) * (dfa)->nclasses + (dfa)->cls[c]])
 
-int editorRowCxToRx(erow *row, int cx) {
-	int rx = 0;
-	for (int j = 0; j < cx; j++) {
-		if (row->chars[j] == '\t') {
-			rx += (KB_TAB_SIZE - 1) - (rx % KB_TAB_SIZE);
+/*
+ * whether x is a plain accepting state that moves to ident on the bytes
+ * ident loops on and dies on all others; ident itself is one if it is plain
+ */
+int dfaPlainState(struct syntaxDfa *dfa, int x, int ident) {
+	if (x == 0 || (dfa->flags[x] & (DFA_ACCEPT | DFA_STOP)) != DFA_ACCEPT || dfa->accept[x] != HL_NORMAL) {
+		return 0;
+	}
+	for (int c = 0; c < 256; c++) {
+		int loop = DFA_NEXT(dfa, ident, c) == ident;
+		if (DFA_NEXT(dfa, x, c) != (loop ? ident : 0)) {
+			return 0;
 		}
-		rx++;
 	}
-	return rx + LEFT_MARGIN;
+	return 1;
 }
 
-int editorRowRxToCx(erow *row, int rx) {
-	int cur_rx = 0;
-	int cx;
-	for (cx = 0; cx < row->size; cx++) {
-		if (row->chars[cx] == '\t') {
-			cur_rx += (KB_TAB_SIZE - 1) - (cur_rx % KB_TAB_SIZE);
+/* works out the skips described at struct syntaxDfa */
+void dfaSkipInit(struct syntaxDfa *dfa) {
+	unsigned char member[256];
+
+	dfa->skip = malloc(sizeof(short) * dfa->nstates);
+	for (int d = 0; d < dfa->nstates; d++) {
+		int loops = 0;
+		for (int c = 0; c < 256; c++) {
+			member[c] = (DFA_NEXT(dfa, d, c) != d);
+			loops += !member[c];
 		}
-		cur_rx++;
+		dfa->skip[d] = DFA_SKIP_NONE;
+		if (d == 0 || loops < DFA_SKIP_MIN_LOOP || (dfa->flags[d] & DFA_STOP)) continue;
+		dfa->flags[d] |= DFA_SKIP;
+		if (loops == 256) {
+			dfa->skip[d] = DFA_SKIP_ALL;
+			continue;
+		}
+		dfa->stops = realloc(dfa->stops, sizeof(struct byteSetTable) * (dfa->nstops + 1));
+		byteSetTableInit(&dfa->stops[dfa->nstops], member);
+		dfa->skip[d] = dfa->nstops++;
+	}
 
-		if (cur_rx > rx) {
-			return cx;
+	/*
+	 * The identifier state is the plain accepting state that only loops or
+	 * dies and that most bytes lead to from the start, directly or through
+	 * a state of its own for the first byte; a word that starts with one of
+	 * those bytes cannot be a keyword or number.
+	 */
+	int ident = 0, best = 0;
+	unsigned char *seen = calloc(dfa->nstates, 1);
+	for (int c = 0; c < 256; c++) {
+		int x = DFA_NEXT(dfa, dfa->start, c);
+		for (int k = -1; k < dfa->nclasses; k++) {
+			int y = k < 0 ? x : dfa->next[x * dfa->nclasses + k], count = 0;
+			if (y == 0 || seen[y] || !dfaPlainState(dfa, y, y)) continue;
+			seen[y] = 1;
+			for (int b = 0; b < 256; b++) {
+				count += dfaPlainState(dfa, DFA_NEXT(dfa, dfa->start, b), y);
+			}
+			if (count > best) {
+				ident = y;
+				best = count;
+			}
 		}
 	}
-	return cx;
+	free(seen);
+
+	unsigned char word[256];
+	for (int c = 0; c < 256; c++) {
+		word[c] = ident != 0 && DFA_NEXT(dfa, ident, c) == ident;
+	}
+
+	/* words that leave the keyword states, and those are most of them in code, run to their end in one go */
+	if (ident != 0 && !(dfa->flags[ident] & (DFA_SKIP | DFA_STOP))) {
+		for (int c = 0; c < 256; c++) {
+			member[c] = !word[c];
+		}
+		dfa->flags[ident] |= DFA_SKIP;
+		dfa->stops = realloc(dfa->stops, sizeof(struct byteSetTable) * (dfa->nstops + 1));
+		byteSetTableInit(&dfa->stops[dfa->nstops], member);
+		dfa->skip[ident] = dfa->nstops++;
+	}
+	for (int c = 0; c < 256; c++) {
+		int x = DFA_NEXT(dfa, dfa->start, c), plain = 0;
+		if (ident != 0 && word[c] && dfaPlainState(dfa, x, ident)) {
+			plain = 1;
+		} else if (x != 0 && !word[c] && (dfa->flags[x] & DFA_ACCEPT) && dfa->accept[x] == HL_NORMAL) {
+			int k;
+			for (k = 0; k < dfa->nclasses && dfa->next[x * dfa->nclasses + k] == 0; k++);
+			plain = (k == dfa->nclasses);
+		}
+		member[c] = !plain;
+	}
+	byteSetTableInit(&dfa->tokens, member);
+	byteSetTableInit(&dfa->words, word);
 }
 
-void editorUpdateRow(erow *row) {
-	int tabs = 0;
-	for (int j = 0; j < row->size; j++) {
-		if (row->chars[j] == '\t') {
-			tabs++;
+struct syntaxDfa *dfaBuild(struct nfa *a, int start, int comment) {
+	struct syntaxDfa *dfa = calloc(1, sizeof(struct syntaxDfa));
+
+	/* bytes that every edge treats alike share a class */
+	int nedges = 0;
+	for (int s = 0; s < a->n; s++) {
+		nedges += a->states[s].nedges;
+	}
+	int sigwords = nedges / 64 + 1;
+	uint64_t *sig = calloc(256 * sigwords, sizeof(uint64_t));
+	for (int c = 0; c < 256; c++) {
+		int e = 0;
+		for (int s = 0; s < a->n; s++) {
+			for (int k = 0; k < a->states[s].nedges; k++, e++) {
+				if (byteSetHas(a->states[s].edges[k].set, c)) {
+					sig[c * sigwords + e / 64] |= 1ULL << (e % 64);
+				}
+			}
+		}
+	}
+	int rep[256];
+	for (int c = 0; c < 256; c++) {
+		int k;
+		for (k = 0; k < dfa->nclasses; k++) {
+			if (memcmp(&sig[c * sigwords], &sig[rep[k] * sigwords], sigwords * 8) == 0) break;
+		}
+		if (k == dfa->nclasses) {
+			rep[dfa->nclasses++] = c;
 		}
+		dfa->cls[c] = k;
+	}
+	free(sig);
+
+	int words = a->n / 64 + 1;
+	uint64_t *sets = NULL, *set = malloc(words * 8);
+	int nsets = 0, *table = NULL, tablesize = 0, cap = 0;
+
+	memset(set, 0, words * 8);
+	dfaIntern(&sets, &nsets, words, &table, &tablesize, set);
+	set[start / 64] |= 1ULL << (start % 64);
+	dfa->start = dfaIntern(&sets, &nsets, words, &table, &tablesize, set);
+	if (comment >= 0) {
+		memset(set, 0, words * 8);
+		set[comment / 64] |= 1ULL << (comment % 64);
+		dfa->comment = dfaIntern(&sets, &nsets, words, &table, &tablesize, set);
 	}
 
-	free(row->render);
-	row->render = malloc(row->size + tabs * (KB_TAB_SIZE - 1) + 1);
+	for (int d = 0; d < nsets; d++) {
+		if (nsets > DFA_MAX_STATES) {
+			break;
+		}
+		if (d >= cap) {
+			cap = nsets * 2;
+			dfa->next = realloc(dfa->next, sizeof(uint16_t) * cap * dfa->nclasses);
+			dfa->accept = realloc(dfa->accept, cap);
+			dfa->eol = realloc(dfa->eol, cap);
+			dfa->flags = realloc(dfa->flags, cap);
+		}
 
-	int idx = 0, ok = 1;
-	row->initial_tab_count = 0;
-	for (int j = 0; j < row->size; j++) {
-		if (row->chars[j] == '\t') {
-			row->render[idx++] = ' ';
-			while (idx % KB_TAB_SIZE != 0) {
-				row->render[idx++] = ' ';
+		int prio = INT_MAX;
+		dfa->accept[d] = HL_NORMAL;
+		dfa->eol[d] = HL_NORMAL;
+		dfa->flags[d] = 0;
+		for (int s = 0; s < a->n; s++) {
+			struct nfaState *st = &a->states[s];
+			if (!((sets[d * words + s / 64] >> (s % 64)) & 1)) continue;
+			if ((st->flags & DFA_ACCEPT) && st->prio < prio) {
+				prio = st->prio;
+				dfa->accept[d] = st->accept;
+				dfa->flags[d] = (dfa->flags[d] & ~DFA_STOP) | (st->flags & (DFA_ACCEPT | DFA_STOP));
+			}
+			if (st->flags & DFA_EOL) {
+				dfa->eol[d] = st->eol;
+				dfa->flags[d] |= st->flags & (DFA_EOL | DFA_OPEN);
 			}
-			if (ok) row->initial_tab_count++;
 		}
-		else {
-			ok = 0;
-			row->render[idx++] = row->chars[j];
+
+		for (int k = 0; k < dfa->nclasses; k++) {
+			memset(set, 0, words * 8);
+			for (int s = 0; s < a->n; s++) {
+				struct nfaState *st = &a->states[s];
+				if (!((sets[d * words + s / 64] >> (s % 64)) & 1)) continue;
+				for (int e = 0; e < st->nedges; e++) {
+					if (byteSetHas(st->edges[e].set, rep[k])) {
+						set[st->edges[e].to / 64] |= 1ULL << (st->edges[e].to % 64);
+					}
+				}
+			}
+			/* sets is reallocated by dfaIntern, so it is indexed afresh each time */
+			dfa->next[d * dfa->nclasses + k] = dfaIntern(&sets, &nsets, words, &table, &tablesize, set);
 		}
 	}
-	row->render[idx] = '\0';
-	row->rsize = idx;
 
-	editorUpdateSyntax(row);
+	free(set);
+	free(sets);
+	free(table);
+	if (nsets > DFA_MAX_STATES) {
+		free(dfa->next);
+		free(dfa->accept);
+		free(dfa->eol);
+		free(dfa->flags);
+		free(dfa);
+		return NULL;
+	}
+	dfa->nstates = nsets;
+	dfaSkipInit(dfa);
+	return dfa;
 }
 
-void editorInsertRow(int at, int tab_count, char *s, size_t len) {
-	if (at < 0 || at > E.numrows) {
-		return;
+struct syntaxDfa *editorSyntaxCompile(struct editorSyntax *syn) {
+	struct nfa a = { NULL, 0 };
+	uint64_t all[4], word[4], set[4];
+	memset(all, 0xff, sizeof(all));
+
+	char *seps = syn->separators ? syn->separators : HL_DEFAULT_SEPARATORS;
+	char *quotes = (syn->flags & HL_HIGHLIGHT_STRINGS) ? (syn->quotes ? syn->quotes : "\"'") : "";
+	char *scs = syn->singleline_comment_start;
+	char *mcs = syn->multiline_comment_start;
+	char *mce = syn->multiline_comment_end;
+	int ml = mcs && mce && mcs[0] && mce[0];
+
+	/* words end at separators, quotes and comment delimiters */
+	memset(word, 0, sizeof(word));
+	for (int c = 1; c < 256; c++) {
+		if (!isspace(c) && !strchr(seps, c) && !strchr(quotes, c)) {
+			byteSetAdd(word, c);
+		}
 	}
-	if (tab_count < 0) {
-		tab_count = 0;
+	if (scs && scs[0] && !isalnum((unsigned char) scs[0]) && !(syn->flags & HL_COMMENT_SEPARATED)) {
+		byteSetDel(word, (unsigned char) scs[0]);
+	}
+	if (ml && !isalnum((unsigned char) mcs[0])) byteSetDel(word, (unsigned char) mcs[0]);
+
+	int start = nfaAdd(&a, 0, 0, 0, 0);
+	nfaEdge(&a, start, all, nfaAdd(&a, HL_NORMAL, 9, DFA_ACCEPT, 0));
+
+	int ident = nfaAdd(&a, HL_NORMAL, 8, DFA_ACCEPT, 0);
+	memcpy(set, word, sizeof(set));
+	for (int c = '0'; c <= '9'; c++) byteSetDel(set, c);
+	nfaEdge(&a, start, set, ident);
+	nfaEdge(&a, ident, word, ident);
+
+	if (syn->flags & HL_HIGHLIGHT_NUMBERS) {
+		int num = nfaAdd(&a, HL_NUMBER, 5, DFA_ACCEPT, 0);
+		memset(set, 0, sizeof(set));
+		for (int c = '0'; c <= '9'; c++) byteSetAdd(set, c);
+		nfaEdge(&a, start, set, num);
+		for (int c = 0; c < 256; c++) {
+			if (isalnum(c) || c == '_' || c == '.') byteSetAdd(set, c);
+		}
+		nfaEdge(&a, num, set, num);
 	}
 
-	E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-	memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
-	for (int j = at + 1; j <= E.numrows; j++) {
-		E.row[j].idx++;
+	for (int j = 0; syn->keywords && syn->keywords[j]; j++) {
+		int klen = strlen(syn->keywords[j]);
+		int kw2 = klen > 0 && syn->keywords[j][klen - 1] == '|';
+		if (kw2) klen--;
+		if (klen > 0) {
+			int end = nfaAdd(&a, kw2 ? HL_KEYWORD2 : HL_KEYWORD1, 1, DFA_ACCEPT, 0);
+			nfaChain(&a, start, syn->keywords[j], klen, end, 0, 0);
+		}
 	}
 
-	E.row[at].idx = at;
-	E.row[at].size = len + tab_count;
-	E.row[at].chars = malloc(sizeof(char) * (E.row[at].size + 1));
-	memcpy(&E.row[at].chars[tab_count], s, len);
-	for (int i = 0; i < tab_count; i++) {
-		E.row[at].chars[i] = '\t';
+	for (int j = 0; quotes[j]; j++) {
+		int q = (unsigned char) quotes[j];
+		int str = nfaAdd(&a, 0, 0, DFA_EOL, HL_STRING);
+		int end = nfaAdd(&a, HL_STRING, 2, DFA_ACCEPT | DFA_STOP, 0);
+		nfaByteEdge(&a, start, q, str);
+		memcpy(set, all, sizeof(set));
+		byteSetDel(set, q);
+		if (syn->escape && syn->escape != q) {
+			int esc = nfaAdd(&a, 0, 0, DFA_EOL, HL_STRING);
+			byteSetDel(set, syn->escape);
+			nfaByteEdge(&a, str, syn->escape, esc);
+			nfaEdge(&a, esc, all, str);
+		}
+		nfaEdge(&a, str, set, str);
+		nfaByteEdge(&a, str, q, end);
 	}
-	E.row[at].chars[E.row[at].size] = '\0';
 
-	E.row[at].rsize = 0;
-	E.row[at].hl = NULL;
-	E.row[at].render = NULL;
-	E.row[at].hl_open_comment = 0;
-	E.row[at].initial_tab_count = 0;
-	editorUpdateRow(&E.row[at]);
+	if (scs && scs[0]) {
+		int line = nfaAdd(&a, HL_COMMENT, 2, DFA_ACCEPT, 0);
+		nfaEdge(&a, line, all, line);
+		nfaChain(&a, start, scs, strlen(scs), line, 0, 0);
+	}
 
-	E.numrows++;
-	E.dirty++;
+	int body = -1;
+	if (ml) {
+		body = nfaAdd(&a, 0, 0, DFA_EOL | DFA_OPEN, HL_MLCOMMENT);
+		int close = nfaAdd(&a, HL_MLCOMMENT, 2, DFA_ACCEPT | DFA_STOP, 0);
+		nfaEdge(&a, body, all, body);
+		nfaChain(&a, start, mcs, strlen(mcs), body, 0, 0);
+		nfaChain(&a, body, mce, strlen(mce), close, DFA_EOL | DFA_OPEN, HL_MLCOMMENT);
+	}
+
+	struct syntaxDfa *dfa = dfaBuild(&a, start, body);
+	for (int s = 0; s < a.n; s++) {
+		free(a.states[s].edges);
+	}
+	free(a.states);
+	return dfa;
 }
 
-void editorFreeRow(erow *row) {
-	free(row->render);
-	free(row->chars);
-	free(row->hl);
+/*** syntax files ***/
+
+/*
+ * Syntax definitions are read from the *.syntax files in $KB_SYNTAX_DIR,
+ * ~/.kb/syntax and the syntax directory next to the kb binary, in that
+ * order. The first definition of a filetype wins, and the built-in HLDB
+ * entries come after all of them. Each line of a file is a directive:
+ *
+ *	filetype python
+ *	match .py .pyw          extensions, or whole file names
+ *	keywords if else ...    highlighted as keywords, may repeat
+ *	types int str ...       highlighted as types, may repeat
+ *	comment # [separated]   start of a comment running to the end of the line;
+ *	                        separated: only where no word runs into it
+ *	multiline <start> <end> delimiters of a multi-line comment
+ *	strings " '             quote characters
+ *	escape \                escapes the next character in a string
+ *	numbers                 highlight numbers
+ *	separators ,.()         characters that end a word
+ *
+ * Lines starting with # and unknown directives are ignored.
+ */
+char **editorSyntaxList(char **list, int *n, char *word, const char *suffix) {
+	list = realloc(list, sizeof(char *) * (*n + 2));
+	list[*n] = malloc(strlen(word) + strlen(suffix) + 1);
+	sprintf(list[*n], "%s%s", word, suffix);
+	list[++*n] = NULL;
+	return list;
 }
 
-void editorDelRow(int at) {
-	if (at < 0 || at >= E.numrows) {
-		return;
+void editorSyntaxFree(struct editorSyntax *syn) {
+	for (int j = 0; syn->filematch && syn->filematch[j]; j++) {
+		free(syn->filematch[j]);
 	}
-	editorFreeRow(&E.row[at]);
-	memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-	for (int j = at; j < E.numrows - 1; j++) {
-		E.row[j].idx--;
+	for (int j = 0; syn->keywords && syn->keywords[j]; j++) {
+		free(syn->keywords[j]);
 	}
-	E.numrows--;
-	E.dirty++;
+	free(syn->filetype);
+	free(syn->filematch);
+	free(syn->keywords);
+	free(syn->singleline_comment_start);
+	free(syn->multiline_comment_start);
+	free(syn->multiline_comment_end);
+	free(syn->quotes);
+	free(syn->separators);
 }
 
-void editorRowInsertChar(erow *row, int at, int c) {
-	if (at < 0 || at > row->size) {
-		at = row->size;
+int editorSyntaxLoad(const char *path, struct editorSyntax *syn) {
+	FILE *fp = fopen(path, "r");
+	if (!fp) {
+		return -1;
 	}
-	row->chars = realloc(row->chars, row->size + 2);
-	memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-	row->size++;
-	row->chars[at] = c;
-	editorUpdateRow(row);
-	E.dirty++;
-}
+	memset(syn, 0, sizeof(*syn));
+	int nmatch = 0, nkeywords = 0;
 
-void editorRowAppendString(erow *row, char *s, size_t len) {
-	row->chars = realloc(row->chars, row->size + len + 1);
-	memcpy(&row->chars[row->size], s, len);
-	row->size += len;
-	row->chars[row->size] = '\0';
-	editorUpdateRow(row);
-	E.dirty++;
-}
+	char *line = NULL;
+	size_t linecap = 0;
+	while (getline(&line, &linecap, fp) != -1) {
+		char *save = NULL;
+		char *directive = strtok_r(line, " \t\r\n", &save);
+		if (directive == NULL || directive[0] == '#') {
+			continue;
+		}
+		char *arg = strtok_r(NULL, " \t\r\n", &save);
+		if (strcmp(directive, "numbers") == 0) {
+			syn->flags |= HL_HIGHLIGHT_NUMBERS;
+		}
+		if (arg == NULL) {
+			continue;
+		}
 
-void editorRowDelChar(erow *row, int at) {
-	if (at < 0 || at >= row->size) {
-		return;
+		if (strcmp(directive, "filetype") == 0) {
+			free(syn->filetype);
+			syn->filetype = strdup(arg);
+		}
+		else if (strcmp(directive, "comment") == 0) {
+			char *how = strtok_r(NULL, " \t\r\n", &save);
+			free(syn->singleline_comment_start);
+			syn->singleline_comment_start = strdup(arg);
+			if (how != NULL && strcmp(how, "separated") == 0) {
+				syn->flags |= HL_COMMENT_SEPARATED;
+			}
+		}
+		else if (strcmp(directive, "multiline") == 0) {
+			char *end = strtok_r(NULL, " \t\r\n", &save);
+			if (end != NULL) {
+				free(syn->multiline_comment_start);
+				free(syn->multiline_comment_end);
+				syn->multiline_comment_start = strdup(arg);
+				syn->multiline_comment_end = strdup(end);
+			}
+		}
+		else if (strcmp(directive, "escape") == 0) {
+			syn->escape = (unsigned char) arg[0];
+		}
+		else if (strcmp(directive, "separators") == 0) {
+			free(syn->separators);
+			syn->separators = strdup(arg);
+		}
+		else if (strcmp(directive, "strings") == 0) {
+			syn->flags |= HL_HIGHLIGHT_STRINGS;
+			free(syn->quotes);
+			syn->quotes = calloc(1, linecap + 1);
+			for (int n = 0; arg != NULL; arg = strtok_r(NULL, " \t\r\n", &save)) {
+				syn->quotes[n++] = arg[0];
+			}
+		}
+		else if (strcmp(directive, "match") == 0 || strcmp(directive, "keywords") == 0 || strcmp(directive, "types") == 0) {
+			for (; arg != NULL; arg = strtok_r(NULL, " \t\r\n", &save)) {
+				if (directive[0] == 'm') {
+					syn->filematch = editorSyntaxList(syn->filematch, &nmatch, arg, "");
+				}
+				else {
+					syn->keywords = editorSyntaxList(syn->keywords, &nkeywords, arg, directive[0] == 't' ? "|" : "");
+				}
+			}
+		}
 	}
-	memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-	row->size--;
-	editorUpdateRow(row);
-	E.dirty++;
-}
-
-/*** editor operations ***/
+	free(line);
+	fclose(fp);
 
-void editorInsertChar(int c) {
-	if (E.cy == E.numrows) {
-		editorInsertRow(E.numrows, 0, "", 0);
+	if (syn->filetype == NULL || syn->filematch == NULL) {
+		editorSyntaxFree(syn);
+		return -1;
 	}
-	editorRowInsertChar(&E.row[E.cy], E.cx, c);
-	E.cx++;
+	return 0;
 }
 
-void editorInsertNewline() {
-	if (E.cx == 0) {
-		editorInsertRow(E.cy, 0, "", 0);
-		E.cy++;
+void editorSyntaxLoadDir(const char *dir) {
+	DIR *dp = opendir(dir);
+	if (dp == NULL) {
+		return;
 	}
-	else {
-		erow *row = &E.row[E.cy];
-		int tab_count = 0;
-
-		if (AUTO_INDENTATION) {
-			if (E.cx >= E.row[E.cy].initial_tab_count) {
-				tab_count = E.row[E.cy].initial_tab_count;
+	struct dirent *de;
+	while ((de = readdir(dp)) != NULL) {
+		int len = strlen(de->d_name);
+		if (len <= 7 || strcmp(&de->d_name[len - 7], ".syntax") != 0) {
+			continue;
+		}
+		char *path = malloc(strlen(dir) + len + 2);
+		sprintf(path, "%s/%s", dir, de->d_name);
+		struct editorSyntax syn;
+		if (editorSyntaxLoad(path, &syn) == 0) {
+			int dup = 0;
+			for (int i = 0; i < E.nsyntaxdb; i++) {
+				dup |= strcmp(E.syntaxdb[i].filetype, syn.filetype) == 0;
 			}
-			char c = E.row[E.cy].chars[E.cx - 1];
-			if (validOpeningBracket(c)) {
-				tab_count++;
+			if (dup) {
+				editorSyntaxFree(&syn);
 			}
-		}
-		editorInsertRow(E.cy + 1, tab_count, &row->chars[E.cx], row->size - E.cx);
-		row = &E.row[E.cy];
-		row->size = E.cx;
-		row->chars[row->size] = '\0';
-		editorUpdateRow(row);
-		E.cx = tab_count;
-		E.cy++;
-		if (AUTO_INDENTATION) {
-			row = &E.row[E.cy];
-			if (validClosingBracket(row->chars[E.cx])) {
-				editorInsertRow(E.cy + 1, tab_count - 1, &row->chars[E.cx], row->size - E.cx);
-				row = &E.row[E.cy];
-				row->size = E.cx;
-				row->chars[row->size] = '\0';
-				editorUpdateRow(row);
+			else {
+				E.syntaxdb = realloc(E.syntaxdb, sizeof(struct editorSyntax) * (E.nsyntaxdb + 1));
+				E.syntaxdb[E.nsyntaxdb++] = syn;
 			}
 		}
+		free(path);
 	}
-	
+	closedir(dp);
 }
 
-void editorDelChar() {
-	if (E.cy == E.numrows) return;
-	if (E.cx == 0 && E.cy == 0) return;
+void editorSyntaxLoadAll() {
+	if (E.syntaxdb_loaded) {
+		return;
+	}
+	E.syntaxdb_loaded = 1;
 
-	erow *row = &E.row[E.cy];
-	if (E.cx > 0) {
-		editorRowDelChar(row, E.cx - 1);
-		E.cx--;
+	char path[PATH_MAX];
+	char *env = getenv("KB_SYNTAX_DIR");
+	if (env != NULL) {
+		editorSyntaxLoadDir(env);
 	}
-	else {
-		E.cx = E.row[E.cy - 1].size;
-		editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-		editorDelRow(E.cy);
-		E.cy--;
+	env = getenv("HOME");
+	if (env != NULL && snprintf(path, sizeof(path), "%s/.kb/syntax", env) < (int) sizeof(path)) {
+		editorSyntaxLoadDir(path);
+	}
+	ssize_t len = readlink("/proc/self/exe", path, sizeof(path) - 8);
+	if (len > 0) {
+		path[len] = '\0';
+		char *slash = strrchr(path, '/');
+		if (slash != NULL) {
+			strcpy(slash, "/syntax");
+			editorSyntaxLoadDir(path);
+		}
 	}
 }
 
-/*** file i/o ***/
+/*** syntax highlighting ***/
 
-char *editorRowsToString(int *buflen) {
-	int totlen = 0;
-	for (int j = 0; j < E.numrows; j++) {
-		totlen += E.row[j].size + 1;
-	}
-	*buflen = totlen;
+/* file rows whose rendering changed since the last frame */
+void editorMarkEdit(int lo, int hi) {
+	if (lo < E.editlo) E.editlo = lo;
+	if (hi > E.edithi) E.edithi = hi;
+}
 
-	char *buf = malloc(totlen);
-	char *p = buf;
-	for (int j = 0; j < E.numrows; j++) {
-		memcpy(p, E.row[j].chars, E.row[j].size);
-		p += E.row[j].size;
-		*p = '\n';
-		p++;
-	}
+/*
+ * Runs the syntax DFA over the row, one longest match per token. A row
+ * that starts inside a multi-line comment starts in the DFA's comment
+ * state; one that ends inside a string or comment gets the state's eol
+ * highlight for the rest of the row. Plain text between tokens, the rest
+ * of a word once it cannot be a keyword and the bodies of strings and
+ * comments are skipped a vector at a time. Returns
+ * whether the row ends inside a multi-line comment.
+ */
+int editorLexRow(struct syntaxDfa *dfa, const unsigned char *s, int n, unsigned char *hl, int in_comment) {
+	memset(hl, HL_NORMAL, n);
+	int state = in_comment ? dfa->comment : dfa->start;
 
-	return buf;
+	int i = 0;
+	while (i < n) {
+		if (state == dfa->start) {
+			i += byteTokenFind(&dfa->tokens, &dfa->words, &s[i], n - i);
+			if (i == n) break;
+		}
+		int j = i, end = -1, tok = HL_NORMAL;
+		while (j < n) {
+			state = dfa->next[state * dfa->nclasses + dfa->cls[s[j]]];
+			if (state == 0) break;
+			j++;
+			if (!(dfa->flags[state] & (DFA_ACCEPT | DFA_SKIP))) continue;
+			if (dfa->flags[state] & DFA_SKIP) {
+				int k = dfa->skip[state];
+				j = (k == DFA_SKIP_ALL) ? n : j + byteSetFind(&dfa->stops[k], &s[j], n - j);
+			}
+			if (dfa->flags[state] & DFA_ACCEPT) {
+				end = j;
+				tok = dfa->accept[state];
+				if (dfa->flags[state] & DFA_STOP) break;
+			}
+		}
+		if (j == n && state != 0 && end < n && (dfa->flags[state] & DFA_EOL)) {
+			memset(&hl[i], dfa->eol[state], n - i);
+			in_comment = (dfa->flags[state] & DFA_OPEN) != 0;
+			break;
+		}
+		if (end == -1) {
+			end = i + 1;
+		}
+		if (tok != HL_NORMAL) {
+			memset(&hl[i], tok, end - i);
+		}
+		i = end;
+		state = dfa->start;
+		in_comment = 0;
+	}
+	return in_comment;
 }
 
-void editorOpen(char *filename) {
-	free(E.filename);
-	E.filename = strdup(filename);
-
-	editorSelectSyntaxHighlight();
+int editorHighlightRow(erow *row) {
+	editorMarkEdit(row->idx, row->idx);
+	row->hl = poolRealloc(row->hl, row->rsize);
+	memset(row->hl, HL_NORMAL, row->rsize);
 
-	FILE *fp = fopen(filename, "r");
-	if (!fp) {
-		die("fopen");
+	if (E.syntax == NULL || E.syntax->dfa == NULL) {
+		editorBracketUpdateRow(row);
+		return 0;
 	}
 
-	char *line = NULL;
-	size_t linecap = 0;
-	ssize_t linelen;
-	while ((linelen = getline(&line, &linecap, fp)) != -1) {
-		while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r')) {
-			linelen--;
-		}
-		editorInsertRow(E.numrows, 0, line, linelen);
+	struct syntaxDfa *dfa = E.syntax->dfa;
+	int in_comment = editorLexRow(dfa, (unsigned char *) row->render, row->rsize, row->hl,
+		row->idx > 0 && E.row[row->idx - 1].hl_open_comment && dfa->comment);
+	editorBracketUpdateRow(row);
+	int changed = (row->hl_open_comment != in_comment);
+	row->hl_open_comment = in_comment;
+	return changed;
+}
+
+void editorUpdateSyntax(erow *row) {
+	while (editorHighlightRow(row) && row->idx + 1 < E.numrows) {
+		row = &E.row[row->idx + 1];
 	}
-	free(line);
-	fclose(fp);
-	E.dirty = 0;
 }
 
-void editorSave() {
-	if (E.filename == NULL) {
-		E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
-		if (E.filename == NULL) {
-			editorSetStatusMessage("Save aborted");
-			return;
-		}
-		editorSelectSyntaxHighlight();
+/* rows lo .. hi - 1 in one pass, then the rows below if the last one's comment state changed */
+void editorHighlightRows(int lo, int hi) {
+	int changed = 0;
+	for (int j = lo; j < hi; j++) {
+		changed = editorHighlightRow(&E.row[j]);
+	}
+	if (changed && hi < E.numrows) {
+		editorUpdateSyntax(&E.row[hi]);
 	}
+}
 
-	int len;
-	char *buf = editorRowsToString(&len);
+/*
+ * Rows updated while E.hl_defer is raised are highlighted together once it
+ * drops, from the first of them, hl_lo, to the last, which is hl_tail rows
+ * from the end. Counting that one from the end keeps it right as rows are
+ * inserted above it. Until then the row's hl only has the right size.
+ */
+void editorHighlightLater(erow *row) {
+	row->hl = poolRealloc(row->hl, row->rsize);
+	int tail = E.numrows - row->idx - 1;
+	if (row->idx < E.hl_lo) E.hl_lo = row->idx;
+	if (tail < E.hl_tail) E.hl_tail = tail < 0 ? 0 : tail;
+}
 
-	int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-	if (fd != -1) {
-		if (ftruncate(fd, len) != -1) {
-			if (write(fd, buf, len) == len) {
-				close(fd);
-				free(buf);
-				E.dirty = 0;
-				editorSetStatusMessage("%d bytes written to disk", len);
-				return;
-			}
-		}
-		close(fd);
+/* rows deleted at `at` move the ones put off below it */
+void editorHighlightDeleted(int at) {
+	if (E.hl_lo != INT_MAX) {
+		if (at < E.hl_lo) E.hl_lo = at;
+		E.hl_tail = 0;
 	}
+}
 
-	free(buf);
-	editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+/* highlights the rows put off so far */
+void editorHighlightPending() {
+	if (E.hl_lo == INT_MAX) {
+		return;
+	}
+	int lo = E.hl_lo, hi = E.numrows - E.hl_tail;
+	E.hl_lo = E.hl_tail = INT_MAX;
+	if (lo < E.numrows) {
+		editorHighlightRows(lo, hi > lo ? hi : lo + 1);
+	}
 }
 
-/*** find ***/
+/* called after lowering E.hl_defer */
+void editorHighlightFlush() {
+	if (!E.hl_defer) {
+		editorHighlightPending();
+	}
+}
 
-void editorFindCallback(char *query, int key) {
-	static int last_match = -1;
-	static int direction = 1;
+/*
+ * A run of rows highlighted on a thread of its own. Only hl_open_comment
+ * carries from one row to the next, so the chunk is lexed as if its first
+ * row started outside a comment, straight into the rows, and then as if it
+ * started inside one, into alt, until the two agree on how a row ends:
+ * every row after that comes out the same either way.
+ */
+struct hlChunk {
+	int lo, hi;
+	int speculate;
+	unsigned char **alt;
+	int *alt_open;
+	int nalt;
+};
 
-	static int saved_hl_line;
-	static char *saved_hl = NULL;
+void *editorHighlightChunk(void *arg) {
+	struct hlChunk *c = arg;
+	struct syntaxDfa *dfa = E.syntax->dfa;
 
-	if (saved_hl) {
-		memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-		free(saved_hl);
-		saved_hl = NULL;
+	int open = 0;
+	for (int j = c->lo; j < c->hi; j++) {
+		erow *row = &E.row[j];
+		open = editorLexRow(dfa, (unsigned char *) row->render, row->rsize, row->hl, open);
+		row->hl_open_comment = open;
+		editorRowBrackets(row);
+	}
+	if (!c->speculate || dfa->comment == 0) return NULL;
+
+	/* the pool is not thread safe, these come from malloc */
+	c->alt = malloc(sizeof(unsigned char *) * (c->hi - c->lo));
+	c->alt_open = malloc(sizeof(int) * (c->hi - c->lo));
+	open = 1;
+	for (int j = c->lo; j < c->hi; j++) {
+		erow *row = &E.row[j];
+		unsigned char *hl = malloc(row->rsize + 1);
+		open = editorLexRow(dfa, (unsigned char *) row->render, row->rsize, hl, open);
+		c->alt[c->nalt] = hl;
+		c->alt_open[c->nalt++] = open;
+		if (open == row->hl_open_comment) break;
 	}
+	return NULL;
+}
 
-	if (key == '\r' || key == '\x1b') {
-		last_match = -1;
-		direction = 1;
+/*
+ * Highlights the whole file, as on open or when the filetype changes.
+ * Large files are split into one chunk per core, lexed in parallel, and
+ * then stitched in order: a chunk entered inside a comment takes its
+ * speculative rows.
+ */
+void editorHighlightAll() {
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	E.bracketindex_valid = 0;
+	if (E.syntax == NULL || E.syntax->dfa == NULL || ncpu < 2 || E.numrows < KB_HL_PARALLEL_ROWS) {
+		for (int j = 0; j < E.numrows; j++) {
+			editorHighlightRow(&E.row[j]);
+		}
 		return;
 	}
-	else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
-		direction = 1;
-	}
-	else if (key == ARROW_LEFT || key == ARROW_UP) {
-		direction = -1;
-	}
-	else {
-		last_match = -1;
-		direction = 1;
+
+	editorMarkEdit(0, E.numrows - 1);
+	for (int j = 0; j < E.numrows; j++) {
+		E.row[j].hl = poolRealloc(E.row[j].hl, E.row[j].rsize);
 	}
 
-	if (last_match == -1) {
-		direction = 1;
+	int nchunks = ncpu < KB_HL_MAX_THREADS ? ncpu : KB_HL_MAX_THREADS;
+	struct hlChunk chunks[KB_HL_MAX_THREADS];
+	pthread_t threads[KB_HL_MAX_THREADS];
+	int started[KB_HL_MAX_THREADS];
+	for (int k = 0; k < nchunks; k++) {
+		struct hlChunk *c = &chunks[k];
+		memset(c, 0, sizeof(*c));
+		c->lo = (long long) E.numrows * k / nchunks;
+		c->hi = (long long) E.numrows * (k + 1) / nchunks;
+		c->speculate = (k > 0);
+		started[k] = (k > 0 && pthread_create(&threads[k], NULL, editorHighlightChunk, c) == 0);
 	}
-	int current = last_match;
-	for (int i = 0; i < E.numrows; i++) {
-		current += direction;
-		if (current == -1) {
-			current = E.numrows - 1;
-		}
-		else if (current == E.numrows) {
-			current = 0;
+	for (int k = 0; k < nchunks; k++) {
+		if (started[k]) {
+			pthread_join(threads[k], NULL);
+		} else {
+			editorHighlightChunk(&chunks[k]);
 		}
+	}
 
-		erow *row = &E.row[current];
-		char *match = strstr(row->render, query);
-		if (match) {
-			last_match = current;
-			E.cy = current;
-			E.cx = editorRowRxToCx(row, match - row->render);
-			E.rowoff = E.numrows;
-
-			saved_hl_line = current;
-			saved_hl = malloc(row->rsize);
-			memcpy(saved_hl, row->hl, row->rsize);
-			memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-			break;
+	int open = 0;
+	for (int k = 0; k < nchunks; k++) {
+		struct hlChunk *c = &chunks[k];
+		for (int i = 0; i < c->nalt; i++) {
+			erow *row = &E.row[c->lo + i];
+			if (open) {
+				memcpy(row->hl, c->alt[i], row->rsize);
+				row->hl_open_comment = c->alt_open[i];
+				editorRowBrackets(row);
+			}
+			free(c->alt[i]);
 		}
+		free(c->alt);
+		free(c->alt_open);
+		open = E.row[c->hi - 1].hl_open_comment;
 	}
 }
 
-void editorFind() {
-	int saved_cx = E.cx;
-	int saved_cy = E.cy;
-	int saved_coloff = E.coloff;
+int editorSyntaxToColor(int hl) {
+	switch (hl) {
+		case HL_COMMENT:
+		case HL_MLCOMMENT: return 36;
+		case HL_KEYWORD1: return 33;
+		case HL_KEYWORD2: return 32;
+		case HL_STRING: return 35;
+		case HL_NUMBER: return 31;
+		case HL_MATCH: return 34;
+		default: return 37;
+	}
+}
+
+/* extensions match the end of the name, other patterns the whole base name */
+int editorSyntaxMatches(struct editorSyntax *s, const char *filename) {
+	const char *slash = strrchr(filename, '/');
+	const char *base = slash ? slash + 1 : filename;
+	int len = strlen(filename);
+	for (int i = 0; s->filematch[i]; i++) {
+		char *pat = s->filematch[i];
+		int patlen = strlen(pat);
+		if (pat[0] == '.' ? (len >= patlen && strcmp(&filename[len - patlen], pat) == 0) : strcmp(base, pat) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+void editorSelectSyntaxHighlight() {
+	E.syntax = NULL;
+	if (E.filename == NULL) return;
+
+	editorSyntaxLoadAll();
+	for (unsigned int j = 0; j < E.nsyntaxdb + HLDB_ENTRIES; j++) {
+		struct editorSyntax *s = j < (unsigned int) E.nsyntaxdb ? &E.syntaxdb[j] : &HLDB[j - E.nsyntaxdb];
+		if (!editorSyntaxMatches(s, E.filename)) {
+			continue;
+		}
+		if (s->dfa == NULL) {
+			s->dfa = editorSyntaxCompile(s);
+		}
+		E.syntax = s;
+		editorCompleteKeywords(s);
+		editorHighlightAll();
+		return;
+	}
+}
+
+/*** row operations ***/
+
+/*
+ * row->cols lists every character that is not a plain one byte, one column
+ * character: tabs, multi-byte UTF-8 sequences, wide and zero width code
+ * points. Between two entries the chars offset (cx), the render offset (bx)
+ * and the screen column (rx) advance together, so every conversion below is
+ * a binary search over the entries instead of a decode from column 0.
+ */
+int editorRowColIndex(erow *row, int cx) {
+	int lo = 0, hi = row->ncols;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (row->cols[mid].cx <= cx) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+int editorRowSnapCx(erow *row, int cx) {
+	int k = editorRowColIndex(row, cx);
+	if (k > 0 && cx < row->cols[k - 1].next_cx) {
+		return row->cols[k - 1].cx;
+	}
+	return cx;
+}
+
+int editorRowNextCx(erow *row, int cx) {
+	if (cx >= row->size) {
+		return row->size;
+	}
+	int k = editorRowColIndex(row, cx);
+	if (k > 0 && cx < row->cols[k - 1].next_cx) {
+		cx = row->cols[k - 1].next_cx;
+	}
+	else {
+		cx++;
+	}
+
+	/* combining marks belong to the character before them */
+	while (k < row->ncols && row->cols[k].cx < cx) k++;
+	while (k < row->ncols && row->cols[k].cx == cx && row->cols[k].rx == row->cols[k].next_rx) {
+		cx = row->cols[k++].next_cx;
+	}
+	return cx;
+}
+
+int editorRowPrevCx(erow *row, int cx) {
+	while (cx > 0) {
+		cx = editorRowSnapCx(row, cx - 1);
+		int k = editorRowColIndex(row, cx);
+		if (k == 0 || row->cols[k - 1].cx != cx || row->cols[k - 1].rx != row->cols[k - 1].next_rx) {
+			break;
+		}
+	}
+	return cx;
+}
+
+int editorRowCxToRx(erow *row, int cx) {
+	int lo = 0, hi = row->ncols;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (row->cols[mid].cx < cx) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	if (lo == 0) {
+		return cx + E.gutter;
+	}
+
+	ecol *col = &row->cols[lo - 1];
+	if (cx < col->next_cx) {
+		return col->rx + E.gutter;
+	}
+	return col->next_rx + (cx - col->next_cx) + E.gutter;
+}
+
+int editorRowRxToCx(erow *row, int rx) {
+	int lo = 0, hi = row->ncols;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (row->cols[mid].rx <= rx) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+
+	int cx = rx;
+	if (lo > 0) {
+		ecol *col = &row->cols[lo - 1];
+		if (rx < col->next_rx) {
+			return col->cx;
+		}
+		cx = col->next_cx + (rx - col->next_rx);
+	}
+	return (cx > row->size) ? row->size : cx;
+}
+
+int editorRowBxToCx(erow *row, int bx) {
+	int lo = 0, hi = row->ncols;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (row->cols[mid].bx <= bx) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	if (lo == 0) {
+		return bx;
+	}
+
+	ecol *col = &row->cols[lo - 1];
+	if (bx < col->next_bx) {
+		return col->cx;
+	}
+	return col->next_cx + (bx - col->next_bx);
+}
+
+int editorRowCxToBx(erow *row, int cx) {
+	int lo = 0, hi = row->ncols;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (row->cols[mid].cx <= cx) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	if (lo == 0) {
+		return cx;
+	}
+
+	ecol *col = &row->cols[lo - 1];
+	if (cx < col->next_cx) {
+		return col->bx;
+	}
+	return col->next_bx + (cx - col->next_cx);
+}
+
+void editorUpdateRow(erow *row) {
+	int tabs = 0;
+	int multibyte = 0;
+	for (int j = 0; j < row->size; j++) {
+		j += asciiSpan(&row->chars[j], row->size - j);
+		if (j < row->size) {
+			multibyte++;
+		}
+	}
+	for (char *p = memchr(row->chars, '\t', row->size); p; p = memchr(p + 1, '\t', row->size - (p + 1 - row->chars))) {
+		tabs++;
+	}
+
+	poolFree(row->render);
+	row->render = poolAlloc(row->size + tabs * (KB_TAB_SIZE - 1) + 1);
+
+	poolFree(row->cols);
+	row->cols = poolAlloc(sizeof(ecol) * (tabs + multibyte));
+	row->ncols = 0;
+	row->wide = 0;
+
+	int idx = 0, rx = 0, ok = 1;
+	row->initial_tab_count = 0;
+	int j = 0;
+	while (j < row->size) {
+		char c = row->chars[j];
+		if (c == '\t') {
+			ecol *col = &row->cols[row->ncols++];
+			col->cx = j;
+			col->rx = rx;
+			col->bx = idx;
+			do {
+				row->render[idx++] = ' ';
+				rx++;
+			} while (rx % KB_TAB_SIZE != 0);
+			j++;
+			col->next_cx = j;
+			col->next_rx = rx;
+			col->next_bx = idx;
+			if (ok) row->initial_tab_count++;
+			continue;
+		}
+
+		ok = 0;
+		if (!((unsigned char) c & 0x80)) {
+			row->render[idx++] = c;
+			rx++;
+			j++;
+			continue;
+		}
+
+		int cp;
+		int len = utf8Decode(&row->chars[j], row->size - j, &cp);
+		int width = (cp == -1) ? 1 : codepointWidth(cp);
+		if (width == 2) {
+			row->wide++;
+		}
+		if (len != 1 || width != 1) {
+			ecol *col = &row->cols[row->ncols++];
+			col->cx = j;
+			col->rx = rx;
+			col->bx = idx;
+			col->next_cx = j + len;
+			col->next_rx = rx + width;
+			col->next_bx = idx + len;
+		}
+		memcpy(&row->render[idx], &row->chars[j], len);
+		idx += len;
+		rx += width;
+		j += len;
+	}
+	row->render[idx] = '\0';
+	row->rsize = idx;
+	row->rwidth = rx;
+
+	if (E.wrap) {
+		editorWrapUpdateRow(row);
+	}
+
+	editorCompleteUpdateRow(row);
+	if (E.hl_defer) {
+		editorHighlightLater(row);
+	}
+	else {
+		editorUpdateSyntax(row);
+	}
+}
+
+void editorInitRow(erow *row, int at) {
+	row->idx = at;
+	row->size = 0;
+	row->chars = NULL;
+	row->rsize = 0;
+	row->hl = NULL;
+	row->render = NULL;
+	row->cols = NULL;
+	row->ncols = 0;
+	row->wrap_lines = 1;
+	row->wrap_cols = 0;
+	row->hl_open_comment = 0;
+	row->bracket_sum = 0;
+	row->bracket_lo = 0;
+	row->folded = 0;
+	row->words = NULL;
+	row->nwords = -1;
+	row->initial_tab_count = 0;
+}
+
+/*
+ * Brings the wrap, bracket and fold indexes in step once the rows from
+ * `from` on were inserted, deleted or moved and E.numrows is the new
+ * count, in O(E.numrows - from + log^2 n): the parts of the trees before
+ * `from` are kept. Rows not yet updated count with the values editorInitRow
+ * gave them, so editorUpdateRow can adjust them as usual. An index not in
+ * use is just dropped, to be built when it is needed.
+ */
+void editorRowsMoved(int from, int oldrows) {
+	if (!E.wrap) {
+		E.wrapindex_valid = 0;
+	}
+	if (E.wrapindex_valid) {
+		E.wrapindex = realloc(E.wrapindex, sizeof(int) * (E.numrows + 1));
+		for (int j = from; j < E.numrows; j++) {
+			E.wrapindex[j + 1] = E.row[j].wrap_lines;
+		}
+		fenwickInitFrom(E.wrapindex, E.numrows, from);
+	}
+
+	if (E.nfolds == 0) {
+		E.foldindex_valid = 0;
+	}
+	if (E.foldindex_valid) {
+		E.foldindex = realloc(E.foldindex, sizeof(int) * (E.numrows + 1));
+		for (int j = from; j < E.numrows; j++) {
+			E.foldindex[j + 1] = (E.row[j].folded == 0);
+		}
+		fenwickInitFrom(E.foldindex, E.numrows, from);
+	}
+
+	/* the segment tree keeps its size until the rows outgrow it */
+	if (E.bracketindex_valid && E.numrows > E.bracketsize) {
+		E.bracketindex_valid = 0;
+	}
+	if (E.bracketindex_valid) {
+		struct depthNode *leaf = &E.bracketindex[E.bracketsize];
+		for (int j = from; j < E.numrows; j++) {
+			leaf[j].sum = E.row[j].bracket_sum;
+			leaf[j].lo = E.row[j].bracket_lo;
+		}
+		for (int j = E.numrows; j < oldrows; j++) {
+			leaf[j].sum = leaf[j].lo = 0;
+		}
+		depthTreeInitFrom(E.bracketindex, E.bracketsize, from);
+	}
+}
+
+void editorInsertRow(int at, int tab_count, char *s, size_t len) {
+	if (at < 0 || at > E.numrows) {
+		return;
+	}
+	if (tab_count < 0) {
+		tab_count = 0;
+	}
+
+	editorFoldInsert(at, 1);
+	E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
+	memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
+	for (int j = at + 1; j <= E.numrows; j++) {
+		E.row[j].idx++;
+	}
+
+	editorInitRow(&E.row[at], at);
+	E.row[at].size = len + tab_count;
+	E.row[at].chars = poolAlloc(E.row[at].size + 1);
+	memcpy(&E.row[at].chars[tab_count], s, len);
+	for (int i = 0; i < tab_count; i++) {
+		E.row[at].chars[i] = '\t';
+	}
+	E.row[at].chars[E.row[at].size] = '\0';
+	editorJournalInsert(at, &E.row[at].chars, &E.row[at].size, 1);
+
+	E.numrows++;
+	editorRowsMoved(at, E.numrows - 1);
+	editorMarkEdit(at, INT_MAX);
+	editorUpdateRow(&E.row[at]);
+	E.dirty++;
+}
+
+/*
+ * Inserts n rows at once with a single move of the row array, so bulk
+ * operations such as a paste do not pay for a shift per line.
+ */
+void editorInsertRows(int at, char **lines, int *lens, int n) {
+	if (at < 0 || at > E.numrows || n <= 0) {
+		return;
+	}
+
+	editorFoldInsert(at, n);
+	E.row = realloc(E.row, sizeof(erow) * (E.numrows + n));
+	memmove(&E.row[at + n], &E.row[at], sizeof(erow) * (E.numrows - at));
+	for (int j = at + n; j < E.numrows + n; j++) {
+		E.row[j].idx += n;
+	}
+
+	for (int j = 0; j < n; j++) {
+		erow *row = &E.row[at + j];
+		editorInitRow(row, at + j);
+		row->size = lens[j];
+		row->chars = poolAlloc(lens[j] + 1);
+		memcpy(row->chars, lines[j], lens[j]);
+		row->chars[lens[j]] = '\0';
+	}
+	editorJournalInsert(at, lines, lens, n);
+	E.numrows += n;
+	editorRowsMoved(at, E.numrows - n);
+	editorMarkEdit(at, INT_MAX);
+
+	E.complete_defer++;
+	E.hl_defer++;
+	for (int j = 0; j < n; j++) {
+		editorUpdateRow(&E.row[at + j]);
+	}
+	E.hl_defer--;
+	E.complete_defer--;
+	editorHighlightFlush();
+	E.dirty++;
+}
+
+void editorFreeRow(erow *row) {
+	poolFree(row->render);
+	poolFree(row->chars);
+	poolFree(row->hl);
+	poolFree(row->cols);
+	editorCompleteUnindexRow(row);
+}
+
+void editorDelRow(int at) {
+	if (at < 0 || at >= E.numrows) {
+		return;
+	}
+	editorJournalDelete(at, 1);
+	editorFoldDelete(at, 1);
+	editorFreeRow(&E.row[at]);
+	memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
+	if (E.complete_scan > at) E.complete_scan = at;
+	editorHighlightDeleted(at);
+	editorMarkEdit(at, INT_MAX);
+	for (int j = at; j < E.numrows - 1; j++) {
+		E.row[j].idx--;
+	}
+	E.numrows--;
+	editorRowsMoved(at, E.numrows + 1);
+	E.dirty++;
+}
+
+void editorDelRows(int at, int n) {
+	if (at < 0 || n <= 0 || at + n > E.numrows) {
+		return;
+	}
+	editorJournalDelete(at, n);
+	editorFoldDelete(at, n);
+	for (int j = at; j < at + n; j++) {
+		editorFreeRow(&E.row[j]);
+	}
+	memmove(&E.row[at], &E.row[at + n], sizeof(erow) * (E.numrows - at - n));
+	E.numrows -= n;
+	editorRowsMoved(at, E.numrows + n);
+	if (E.complete_scan > at) E.complete_scan = at;
+	editorHighlightDeleted(at);
+	editorMarkEdit(at, INT_MAX);
+	for (int j = at; j < E.numrows; j++) {
+		E.row[j].idx -= n;
+	}
+	E.dirty++;
+}
+
+void editorRowInsertChar(erow *row, int at, int c) {
+	if (at < 0 || at > row->size) {
+		at = row->size;
+	}
+	row->chars = poolRealloc(row->chars, row->size + 2);
+	memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
+	row->size++;
+	row->chars[at] = c;
+	editorJournalSplice(row->idx, at, 0, &row->chars[at], 1);
+	editorFoldReveal(row->idx);
+	editorUpdateRow(row);
+	E.dirty++;
+}
+
+void editorRowAppendString(erow *row, char *s, size_t len) {
+	row->chars = poolRealloc(row->chars, row->size + len + 1);
+	memcpy(&row->chars[row->size], s, len);
+	row->size += len;
+	row->chars[row->size] = '\0';
+	editorJournalSplice(row->idx, row->size - len, 0, s, len);
+	editorFoldReveal(row->idx);
+	editorUpdateRow(row);
+	E.dirty++;
+}
+
+void editorRowDelChars(erow *row, int at, int len) {
+	if (at < 0 || at >= row->size) {
+		return;
+	}
+	if (len > row->size - at) {
+		len = row->size - at;
+	}
+	row->chars = poolUnshare(row->chars);
+	memmove(&row->chars[at], &row->chars[at + len], row->size - at - len + 1);
+	row->size -= len;
+	editorJournalSplice(row->idx, at, len, NULL, 0);
+	editorFoldReveal(row->idx);
+	editorUpdateRow(row);
+	E.dirty++;
+}
+
+/*** soft wrap ***/
+
+/*
+ * In soft wrap mode every row is cut into segments of E.wrapcols columns;
+ * a wide character that would cross the edge starts the next segment.
+ * E.wrapindex is a Fenwick tree over the number of segments of each row,
+ * so converting between file rows and visual lines is O(log n). A row's
+ * count is only recomputed when the row changes or becomes visible, which
+ * keeps a resize from rewrapping the whole file.
+ */
+int editorRowWrapNext(erow *row, int start, int width) {
+	int next = start + width;
+	if (row->wide == 0) {
+		return next;
+	}
+
+	int lo = 0, hi = row->ncols;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (row->cols[mid].rx < next) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	if (lo > 0) {
+		ecol *col = &row->cols[lo - 1];
+		if (col->next_rx > next && col->next_rx - col->rx == 2 && col->rx > start && row->chars[col->cx] != '\t') {
+			return col->rx;
+		}
+	}
+	return next;
+}
+
+int editorRowWrapLines(erow *row, int width) {
+	if (row->wide == 0) {
+		return row->rwidth / width + 1;
+	}
+	int lines = 1;
+	for (int b = editorRowWrapNext(row, 0, width); b <= row->rwidth; b = editorRowWrapNext(row, b, width)) {
+		lines++;
+	}
+	return lines;
+}
+
+int editorRowWrapStart(erow *row, int seg, int width) {
+	if (row->wide == 0) {
+		return seg * width;
+	}
+	int b = 0;
+	while (seg-- > 0) {
+		b = editorRowWrapNext(row, b, width);
+	}
+	return b;
+}
+
+int editorRowWrapSegment(erow *row, int rx, int width) {
+	if (row->wide == 0) {
+		return rx / width;
+	}
+	int seg = 0;
+	for (int b = editorRowWrapNext(row, 0, width); b <= rx; b = editorRowWrapNext(row, b, width)) {
+		seg++;
+	}
+	return seg;
+}
+
+void editorWrapUpdateRow(erow *row) {
+	int lines = row->folded ? 0 : editorRowWrapLines(row, E.wrapcols);
+	if (E.wrapindex_valid && row->idx < E.numrows) {
+		fenwickAdd(E.wrapindex, E.numrows, row->idx, lines - row->wrap_lines);
+	}
+	row->wrap_lines = lines;
+	row->wrap_cols = E.wrapcols;
+}
+
+void editorWrapIndexBuild() {
+	free(E.wrapindex);
+	E.wrapindex = calloc(E.numrows + 1, sizeof(int));
+	for (int j = 0; j < E.numrows; j++) {
+		E.wrapindex[j + 1] = E.row[j].wrap_lines;
+	}
+	fenwickInit(E.wrapindex, E.numrows);
+	E.wrapindex_valid = 1;
+}
+
+/* brings the rows shown from (rowoff, rowseg) up to the current width */
+void editorWrapRefreshVisible() {
+	if (!E.wrapindex_valid) {
+		editorWrapIndexBuild();
+	}
+	int lines = -E.rowseg;
+	for (int j = E.rowoff; j < E.numrows && lines < E.screenrows; j++) {
+		if (E.row[j].wrap_cols != E.wrapcols) {
+			editorWrapUpdateRow(&E.row[j]);
+		}
+		lines += E.row[j].wrap_lines;
+	}
+	if (E.cy < E.numrows && E.row[E.cy].wrap_cols != E.wrapcols) {
+		editorWrapUpdateRow(&E.row[E.cy]);
+	}
+}
+
+/* visual line number of segment seg of file row filerow */
+int editorWrapLineOf(int filerow, int seg) {
+	return fenwickPrefix(E.wrapindex, filerow) + seg;
+}
+
+void editorWrapRowAt(int line, int *filerow, int *seg) {
+	if (line < 0) {
+		line = 0;
+	}
+	*filerow = fenwickSearch(E.wrapindex, E.numrows, line, seg);
+	if (*filerow >= E.numrows) {
+		*seg = 0;
+	}
+}
+
+void editorWrapPage(int key) {
+	editorWrapRefreshVisible();
+	int top = editorWrapLineOf(E.rowoff, E.rowseg);
+	int line = (key == PAGE_UP) ? top - E.screenrows : top + 2 * E.screenrows - 1;
+
+	int seg;
+	editorWrapRowAt(line, &E.cy, &seg);
+	E.cx = 0;
+	if (E.cy < E.numrows) {
+		erow *row = &E.row[E.cy];
+		E.cx = editorRowRxToCx(row, editorRowWrapStart(row, seg, E.wrapcols));
+	}
+}
+
+void editorToggleWrap() {
+	E.wrap = !E.wrap;
+	E.rowseg = 0;
+	E.shadowtop = -1;
+	E.coloff = 0;
+	if (E.wrap) {
+		E.wrapcols = E.screencols;
+		for (int j = 0; j < E.numrows; j++) {
+			editorWrapUpdateRow(&E.row[j]);
+		}
+		editorWrapIndexBuild();
+	}
+	editorSetStatusMessage("Soft wrap %s", E.wrap ? "on" : "off");
+}
+
+/*** brackets ***/
+
+/*
+ * Brackets outside strings and comments are matched by depth alone, any
+ * kind against any kind. Each row keeps the net depth change of its
+ * brackets and the lowest depth reached inside it, and E.bracketindex is
+ * a segment tree over those summaries, so the row holding the partner of
+ * a bracket any distance away is found in O(log n) and only that row is
+ * scanned. Like the wrap index it is updated in place when a row is
+ * highlighted again, and editorRowsMoved redoes only the part past an
+ * insertion or deletion.
+ */
+void editorRowBrackets(erow *row) {
+	int depth = 0, lo = 0;
+	for (int j = 0; j < row->rsize; j++) {
+		j += byteSetFind(&E.brackets, (unsigned char *) &row->render[j], row->rsize - j);
+		if (j == row->rsize) break;
+		char c = row->render[j];
+		if (row->hl[j] != HL_NORMAL) continue;
+		if (validOpeningBracket(c)) {
+			depth++;
+		}
+		else if (validClosingBracket(c) && --depth < lo) {
+			lo = depth;
+		}
+	}
+	row->bracket_sum = depth;
+	row->bracket_lo = lo;
+}
+
+void editorBracketUpdateRow(erow *row) {
+	editorRowBrackets(row);
+	if (E.bracketindex_valid && row->idx < E.numrows) {
+		depthTreeSet(E.bracketindex, E.bracketsize, row->idx, row->bracket_sum, row->bracket_lo);
+	}
+}
+
+void editorBracketIndexBuild() {
+	free(E.bracketindex);
+	E.bracketsize = depthTreeSize(E.numrows);
+	E.bracketindex = calloc(2 * E.bracketsize, sizeof(struct depthNode));
+	for (int j = 0; j < E.numrows; j++) {
+		E.bracketindex[E.bracketsize + j].sum = E.row[j].bracket_sum;
+		E.bracketindex[E.bracketsize + j].lo = E.row[j].bracket_lo;
+	}
+	depthTreeInit(E.bracketindex, E.bracketsize);
+	E.bracketindex_valid = 1;
+}
+
+/*
+ * Scans row filerow from byte bx in direction dir (1 or -1), starting at
+ * *depth unmatched brackets, for the byte that brings the depth to zero.
+ */
+int editorBracketScan(int filerow, int bx, int dir, int *depth) {
+	erow *row = &E.row[filerow];
+	for (int j = bx; j >= 0 && j < row->rsize; j += dir) {
+		char c = row->render[j];
+		if (row->hl[j] != HL_NORMAL) continue;
+		if (validOpeningBracket(c)) {
+			*depth += dir;
+		}
+		else if (validClosingBracket(c)) {
+			*depth -= dir;
+		}
+		if (*depth == 0) {
+			return j;
+		}
+	}
+	return -1;
+}
+
+/* the partner of the bracket at byte bx of row filerow, if it pairs with it */
+int editorBracketMatch(int filerow, int bx, int *mrow, int *mbx) {
+	erow *row = &E.row[filerow];
+	if (bx < 0 || bx >= row->rsize || row->hl[bx] != HL_NORMAL) {
+		return 0;
+	}
+	char c = row->render[bx];
+	int dir = validOpeningBracket(c) ? 1 : validClosingBracket(c) ? -1 : 0;
+	if (dir == 0) {
+		return 0;
+	}
+
+	int depth = 0, r = filerow;
+	int j = editorBracketScan(r, bx, dir, &depth);
+	if (j < 0) {
+		if (!E.bracketindex_valid) {
+			editorBracketIndexBuild();
+		}
+		if (dir > 0) {
+			r = (r + 1 < E.numrows) ? depthTreeForward(E.bracketindex, E.bracketsize, r + 1, &depth) : -1;
+		}
+		else {
+			r = (r > 0) ? depthTreeBackward(E.bracketindex, E.bracketsize, r - 1, &depth) : -1;
+		}
+		if (r < 0 || r >= E.numrows) {
+			return 0;
+		}
+		j = editorBracketScan(r, dir > 0 ? 0 : E.row[r].rsize - 1, dir, &depth);
+	}
+	if (j < 0) {
+		return 0;
+	}
+	char m = E.row[r].render[j];
+	if (dir > 0 ? pairOf(c) != m : pairOf(m) != c) {
+		return 0;
+	}
+	*mrow = r;
+	*mbx = j;
+	return 1;
+}
+
+/* the bracket under the cursor, or else the one just before it */
+int editorBracketAtCursor(int *bx) {
+	if (E.cy >= E.numrows) {
+		return 0;
+	}
+	erow *row = &E.row[E.cy];
+	for (int cx = E.cx; cx >= E.cx - 1 && cx >= 0; cx--) {
+		if (cx < row->size && (validOpeningBracket(row->chars[cx]) || validClosingBracket(row->chars[cx]))) {
+			*bx = editorRowCxToBx(row, cx);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* works out the pair to show for the cursor, redrawing rows that change */
+void editorBracketRefresh() {
+	int buf = -1, rows[2] = { -1, -1 }, bxs[2] = { -1, -1 };
+	if (editorBracketAtCursor(&bxs[0]) && editorBracketMatch(E.cy, bxs[0], &rows[1], &bxs[1])) {
+		buf = E.curbuf;
+		rows[0] = E.cy;
+	}
+	if (buf == E.bracket_buf && memcmp(rows, E.bracket_row, sizeof(rows)) == 0 && memcmp(bxs, E.bracket_bx, sizeof(bxs)) == 0) {
+		return;
+	}
+
+	for (int k = 0; k < 2 && E.bracket_buf >= 0; k++) {
+		int r = E.bracket_row[k];
+		if (E.bracket_buf == E.curbuf) {
+			editorMarkEdit(r, r);
+		}
+		else {
+			struct editorBuffer *b = &E.buffers[E.bracket_buf];
+			if (r < b->editlo) b->editlo = r;
+			if (r > b->edithi) b->edithi = r;
+		}
+	}
+	for (int k = 0; k < 2 && buf >= 0; k++) {
+		editorMarkEdit(rows[k], rows[k]);
+	}
+	E.bracket_buf = buf;
+	memcpy(E.bracket_row, rows, sizeof(rows));
+	memcpy(E.bracket_bx, bxs, sizeof(bxs));
+}
+
+int editorBracketMarked(erow *row, int bx) {
+	return E.bracket_buf == E.curbuf &&
+		((row->idx == E.bracket_row[0] && bx == E.bracket_bx[0]) ||
+		 (row->idx == E.bracket_row[1] && bx == E.bracket_bx[1]));
+}
+
+void editorBracketJump() {
+	int bx, row, mbx;
+	if (!editorBracketAtCursor(&bx) || !editorBracketMatch(E.cy, bx, &row, &mbx)) {
+		editorSetStatusMessage("No matching bracket");
+		return;
+	}
+	E.cy = row;
+	E.cx = editorRowBxToCx(&E.row[row], mbx);
+}
+
+/*** folding ***/
+
+/*
+ * A fold hides rows start + 1 .. end under its start row, which stays on
+ * screen. E.folds is sorted by start, enclosing folds first; row->folded
+ * counts the folds hiding a row. E.foldindex is a Fenwick tree over which
+ * rows are visible, so going between visible lines and file rows is
+ * O(log n) however much of the file is folded away. Like the wrap index it
+ * is redone past rows inserted or deleted by editorRowsMoved, and with no
+ * folds it is not kept at all: every mapping is the identity.
+ */
+void editorFoldIndexBuild() {
+	free(E.foldindex);
+	E.foldindex = calloc(E.numrows + 1, sizeof(int));
+	for (int j = 0; j < E.numrows; j++) {
+		E.foldindex[j + 1] = (E.row[j].folded == 0);
+	}
+	fenwickInit(E.foldindex, E.numrows);
+	E.foldindex_valid = 1;
+}
+
+/* the visible line file row filerow is on, or would be on if shown */
+int editorFoldLine(int filerow) {
+	if (E.nfolds == 0) {
+		return filerow;
+	}
+	if (!E.foldindex_valid) {
+		editorFoldIndexBuild();
+	}
+	return fenwickPrefix(E.foldindex, filerow);
+}
+
+/* the file row shown on visible line `line`, or E.numrows past the end */
+int editorFoldRow(int line) {
+	if (line < 0) {
+		line = 0;
+	}
+	if (E.nfolds == 0) {
+		return line < E.numrows ? line : E.numrows;
+	}
+	if (!E.foldindex_valid) {
+		editorFoldIndexBuild();
+	}
+	return fenwickSearch(E.foldindex, E.numrows, line, NULL);
+}
+
+int editorFoldNext(int filerow) {
+	filerow++;
+	if (E.nfolds > 0 && filerow < E.numrows && E.row[filerow].folded) {
+		filerow = editorFoldRow(editorFoldLine(filerow));
+	}
+	return filerow;
+}
+
+int editorFoldPrev(int filerow) {
+	filerow--;
+	if (E.nfolds > 0 && filerow > 0 && filerow < E.numrows && E.row[filerow].folded) {
+		filerow = editorFoldRow(editorFoldLine(filerow) - 1);
+	}
+	return filerow;
+}
+
+/* adds delta to the fold count of rows lo..hi, keeping the indexes in step */
+void editorFoldHide(int lo, int hi, int delta) {
+	for (int j = lo; j <= hi; j++) {
+		erow *row = &E.row[j];
+		int was = row->folded;
+		row->folded += delta;
+		if ((was == 0) == (row->folded == 0)) continue;
+		if (E.foldindex_valid) {
+			fenwickAdd(E.foldindex, E.numrows, j, was == 0 ? -1 : 1);
+		}
+		if (E.wrap) {
+			editorWrapUpdateRow(row);
+		}
+	}
+	editorMarkEdit(lo - 1, INT_MAX);
+}
+
+void editorFoldAdd(int start, int end) {
+	int k = E.nfolds;
+	while (k > 0 && (E.folds[k - 1].start > start || (E.folds[k - 1].start == start && E.folds[k - 1].end < end))) {
+		k--;
+	}
+	E.folds = realloc(E.folds, sizeof(struct fold) * (E.nfolds + 1));
+	memmove(&E.folds[k + 1], &E.folds[k], sizeof(struct fold) * (E.nfolds - k));
+	E.folds[k].start = start;
+	E.folds[k].end = end;
+	if (E.nfolds++ == 0) {
+		E.foldindex_valid = 0;
+	}
+	editorFoldHide(start + 1, end, 1);
+}
+
+void editorFoldRemove(int k) {
+	editorFoldHide(E.folds[k].start + 1, E.folds[k].end, -1);
+	memmove(&E.folds[k], &E.folds[k + 1], sizeof(struct fold) * (E.nfolds - k - 1));
+	E.nfolds--;
+}
+
+/* opens every fold hiding filerow, as when the row is edited or jumped to */
+void editorFoldReveal(int filerow) {
+	if (E.nfolds == 0 || filerow < 0 || filerow >= E.numrows || !E.row[filerow].folded) {
+		return;
+	}
+	for (int k = E.nfolds - 1; k >= 0; k--) {
+		if (E.folds[k].start < filerow && filerow <= E.folds[k].end) {
+			editorFoldRemove(k);
+		}
+	}
+}
+
+/* called before n rows are inserted at `at`: inserting into a fold opens it */
+void editorFoldInsert(int at, int n) {
+	for (int k = E.nfolds - 1; k >= 0; k--) {
+		struct fold *f = &E.folds[k];
+		if (f->start >= at) {
+			f->start += n;
+			f->end += n;
+		}
+		else if (at <= f->end) {
+			editorFoldRemove(k);
+		}
+	}
+}
+
+/* called before rows at .. at + n - 1 are deleted */
+void editorFoldDelete(int at, int n) {
+	for (int k = E.nfolds - 1; k >= 0; k--) {
+		struct fold *f = &E.folds[k];
+		if (f->start >= at + n) {
+			f->start -= n;
+			f->end -= n;
+		}
+		else if (f->end >= at) {
+			editorFoldRemove(k);
+		}
+	}
+}
+
+/*
+ * The region a fold starting at filerow would cover: a multi-line comment
+ * opened on the row, or else the block of the first bracket the row
+ * leaves open. *end is the row that closes it.
+ */
+int editorFoldRegion(int filerow, int *end) {
+	erow *row = &E.row[filerow];
+	if (row->hl_open_comment && !(filerow > 0 && E.row[filerow - 1].hl_open_comment)) {
+		int e = filerow + 1;
+		while (e < E.numrows - 1 && E.row[e].hl_open_comment) {
+			e++;
+		}
+		if (e < E.numrows) {
+			*end = e;
+			return 1;
+		}
+	}
+
+	int depth = 0, first = -1, mrow, mbx;
+	for (int j = 0; j < row->rsize; j++) {
+		if (row->hl[j] != HL_NORMAL) continue;
+		if (validOpeningBracket(row->render[j])) {
+			if (depth++ == 0) first = j;
+		}
+		else if (validClosingBracket(row->render[j]) && depth > 0) {
+			depth--;
+		}
+	}
+	if (depth > 0 && editorBracketMatch(filerow, first, &mrow, &mbx) && mrow > filerow) {
+		*end = mrow;
+		return 1;
+	}
+	return 0;
+}
+
+int editorFoldFind(int filerow) {
+	for (int k = 0; k < E.nfolds; k++) {
+		if (E.folds[k].start == filerow) {
+			return k;
+		}
+	}
+	return -1;
+}
+
+/* opens the fold on the cursor row, or folds the block at or around it */
+void editorFoldToggle() {
+	if (E.cy >= E.numrows) {
+		return;
+	}
+	int k = editorFoldFind(E.cy);
+	if (k >= 0) {
+		editorFoldRemove(k);
+		return;
+	}
+
+	int start = E.cy, end;
+	if (!editorFoldRegion(start, &end)) {
+		/* the block the cursor row is in opens on the row that leaves one bracket unclosed above it */
+		int need = 1;
+		if (!E.bracketindex_valid) {
+			editorBracketIndexBuild();
+		}
+		start = E.cy > 0 ? depthTreeBackward(E.bracketindex, E.bracketsize, E.cy - 1, &need) : -1;
+		if (start < 0 || start >= E.numrows || !editorFoldRegion(start, &end) || end < E.cy) {
+			editorSetStatusMessage("Nothing to fold");
+			return;
+		}
+	}
+	editorFoldAdd(start, end);
+	E.cy = start;
+	editorSnapCursor();
+}
+
+/* folds every top-level block and comment, or opens all folds if there are any */
+void editorFoldAll() {
+	if (E.nfolds > 0) {
+		while (E.nfolds > 0) {
+			editorFoldRemove(E.nfolds - 1);
+		}
+		return;
+	}
+
+	int depth = 0, end;
+	for (int r = 0; r < E.numrows; r++) {
+		int last = r;
+		if (depth == 0 && editorFoldRegion(r, &end)) {
+			editorFoldAdd(r, end);
+			last = end;
+		}
+		for (; r <= last; r++) {
+			depth += E.row[r].bracket_sum;
+			if (depth < 0) depth = 0;
+		}
+		r--;
+	}
+	if (E.cy < E.numrows && E.row[E.cy].folded) {
+		E.cy = editorFoldRow(editorFoldLine(E.cy) - 1);
+		editorSnapCursor();
+	}
+}
+
+/*** editor operations ***/
+
+void editorInsertChar(int c) {
+	if (E.cy == E.numrows) {
+		editorInsertRow(E.numrows, 0, "", 0);
+	}
+	editorRowInsertChar(&E.row[E.cy], E.cx, c);
+	E.cx++;
+}
+
+/*
+ * Inserts n lines at the cursor as-is: no auto-indentation and no bracket
+ * pairing. The first line goes into the cursor's row, the others become
+ * new rows in one bulk insert.
+ */
+void editorInsertLines(char **lines, int *lens, int n) {
+	if (E.cy == E.numrows) {
+		editorInsertRow(E.numrows, 0, "", 0);
+	}
+
+	erow *row = &E.row[E.cy];
+	if (n == 1) {
+		int len = lens[0];
+		row->chars = poolRealloc(row->chars, row->size + len + 1);
+		memmove(&row->chars[E.cx + len], &row->chars[E.cx], row->size - E.cx + 1);
+		memcpy(&row->chars[E.cx], lines[0], len);
+		row->size += len;
+		editorJournalSplice(E.cy, E.cx, 0, lines[0], len);
+		editorUpdateRow(row);
+		E.cx += len;
+	}
+	else {
+		int taillen = row->size - E.cx;
+		char *last = malloc(lens[n - 1] + taillen);
+		memcpy(last, lines[n - 1], lens[n - 1]);
+		memcpy(&last[lens[n - 1]], &row->chars[E.cx], taillen);
+		int lastlen = lens[n - 1];
+		char *lastline = lines[n - 1];
+		lines[n - 1] = last;
+		lens[n - 1] += taillen;
+
+		editorJournalSplice(E.cy, E.cx, taillen, lines[0], lens[0]);
+		row->chars = poolRealloc(row->chars, E.cx + lens[0] + 1);
+		memcpy(&row->chars[E.cx], lines[0], lens[0]);
+		row->size = E.cx + lens[0];
+		row->chars[row->size] = '\0';
+		editorUpdateRow(row);
+
+		editorInsertRows(E.cy + 1, &lines[1], &lens[1], n - 1);
+		E.cy += n - 1;
+		E.cx = lastlen;
+		lines[n - 1] = lastline;
+		lens[n - 1] = lastlen;
+		free(last);
+	}
+	E.dirty++;
+}
+
+/* Inserts text at the cursor; lines end at "\r\n", "\r" or "\n". */
+void editorInsertText(char *s, int len) {
+	int n = 1;
+	for (int i = 0; i < len; i++) {
+		if (s[i] == '\n' || (s[i] == '\r' && (i + 1 == len || s[i + 1] != '\n'))) {
+			n++;
+		}
+	}
+	char **lines = malloc(sizeof(char *) * n);
+	int *lens = malloc(sizeof(int) * n);
+	int k = 0, start = 0;
+	for (int i = 0; i < len; i++) {
+		if (s[i] == '\n' || s[i] == '\r') {
+			lines[k] = &s[start];
+			lens[k++] = i - start;
+			if (s[i] == '\r' && i + 1 < len && s[i + 1] == '\n') {
+				i++;
+			}
+			start = i + 1;
+		}
+	}
+	lines[k] = &s[start];
+	lens[k] = len - start;
+
+	editorInsertLines(lines, lens, n);
+	free(lines);
+	free(lens);
+}
+
+void editorInsertNewline() {
+	if (E.cx == 0) {
+		editorInsertRow(E.cy, 0, "", 0);
+		E.cy++;
+	}
+	else {
+		erow *row = &E.row[E.cy];
+		int tab_count = 0;
+
+		if (AUTO_INDENTATION) {
+			if (E.cx >= E.row[E.cy].initial_tab_count) {
+				tab_count = E.row[E.cy].initial_tab_count;
+			}
+			char c = E.row[E.cy].chars[E.cx - 1];
+			if (validOpeningBracket(c)) {
+				tab_count++;
+			}
+		}
+		editorInsertRow(E.cy + 1, tab_count, &row->chars[E.cx], row->size - E.cx);
+		row = &E.row[E.cy];
+		editorJournalSplice(E.cy, E.cx, row->size - E.cx, NULL, 0);
+		row->chars = poolUnshare(row->chars);
+		row->size = E.cx;
+		row->chars[row->size] = '\0';
+		editorUpdateRow(row);
+		E.cx = tab_count;
+		E.cy++;
+		if (AUTO_INDENTATION) {
+			row = &E.row[E.cy];
+			if (validClosingBracket(row->chars[E.cx])) {
+				editorInsertRow(E.cy + 1, tab_count - 1, &row->chars[E.cx], row->size - E.cx);
+				row = &E.row[E.cy];
+				editorJournalSplice(E.cy, E.cx, row->size - E.cx, NULL, 0);
+				row->chars = poolUnshare(row->chars);
+				row->size = E.cx;
+				row->chars[row->size] = '\0';
+				editorUpdateRow(row);
+			}
+		}
+	}
+	
+}
+
+void editorDelChar() {
+	if (E.cy == E.numrows) return;
+	if (E.cx == 0 && E.cy == 0) return;
+
+	erow *row = &E.row[E.cy];
+	if (E.cx > 0) {
+		int prev = editorRowPrevCx(row, E.cx);
+		editorRowDelChars(row, prev, E.cx - prev);
+		E.cx = prev;
+	}
+	else {
+		E.cx = E.row[E.cy - 1].size;
+		editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
+		editorDelRow(E.cy);
+		E.cy--;
+	}
+}
+
+/*** keymap ***/
+
+/*
+ * Keys reach editorProcessKeypress through E.keymap, which starts out with
+ * editorDefaultBindings and then reads $KB_KEYMAP, or ~/.kb/keymap if that
+ * is not set, in the format keymapLoad describes:
+ *
+ *	bind C-q quit
+ *	bind C-k C-s save       a chord
+ *	unbind C-w
+ *
+ * A chord cannot go through a key that is bound to a command, nor a key
+ * be bound while chords start with it; the file has to unbind it first.
+ * A key bound to nothing is typed into the text. command_key holds the key
+ * each command has by default; the cursor code still works in those keys.
+ */
+void editorKeymapInit() {
+	keymapInit(&E.keymap);
+	for (int c = 0; c < CMD_COUNT; c++) {
+		E.command_key[c] = -1;
+	}
+	for (unsigned int j = 0; j < DEFAULT_BINDINGS; j++) {
+		struct editorBinding *b = &editorDefaultBindings[j];
+		keymapBind(&E.keymap, &b->key, 1, b->command);
+		if (E.command_key[b->command] < 0) {
+			E.command_key[b->command] = b->key;
+		}
+	}
+
+	char path[PATH_MAX];
+	char *file = getenv("KB_KEYMAP");
+	if (file == NULL) {
+		char *home = getenv("HOME");
+		if (home == NULL || snprintf(path, sizeof(path), "%s/.kb/keymap", home) >= (int) sizeof(path)) {
+			return;
+		}
+		file = path;
+	}
+	int bad = keymapLoad(&E.keymap, file, editorCommands, CMD_COUNT);
+	if (bad > 0) {
+		editorSetStatusMessage("%.60s:%d: bad or clashing binding", file, bad);
+	}
+}
+
+/*** completion ***/
+
+/*
+ * Ctrl-Space completes the word before the cursor from a ternary search
+ * tree (utils.c) holding every identifier of the open buffers, counted
+ * once per occurrence, and the keywords of their filetypes. Each row
+ * keeps the tree nodes of its words so editorUpdateRow can take them out
+ * again before counting the new contents.
+ *
+ * Rows read from disk are not indexed on the spot: while complete_defer
+ * is raised they are left for editorCompleteStep, which indexes them from
+ * complete_scan on in slices between keystrokes. complete_scan is a lower
+ * bound on the first row not indexed yet, INT_MAX once there is none.
+ */
+int editorIsWordChar(int c) {
+	return isalnum(c) || c == '_';
+}
+
+void editorCompleteIndexRow(erow *row) {
+	int n = 0;
+	for (int j = 0; j < row->size; j++) {
+		unsigned char c = row->chars[j];
+		if (editorIsWordChar(c) && !isdigit(c) && (j == 0 || !editorIsWordChar((unsigned char) row->chars[j - 1]))) {
+			n++;
+		}
+	}
+	row->words = n ? poolAlloc(sizeof(int) * n) : NULL;
+	row->nwords = 0;
+
+	int j = 0;
+	while (j < row->size) {
+		if (!editorIsWordChar((unsigned char) row->chars[j])) {
+			j++;
+			continue;
+		}
+		int start = j;
+		while (j < row->size && editorIsWordChar((unsigned char) row->chars[j])) {
+			j++;
+		}
+		int len = j - start;
+		if (isdigit((unsigned char) row->chars[start]) || len < 2 || len > TST_MAX_WORD) {
+			continue;
+		}
+		int x = tstInsert(&E.words, &row->chars[start], len);
+		tstAdd(&E.words, x, 1);
+		row->words[row->nwords++] = x;
+	}
+}
+
+void editorCompleteUnindexRow(erow *row) {
+	for (int j = 0; j < row->nwords; j++) {
+		tstAdd(&E.words, row->words[j], -1);
+	}
+	poolFree(row->words);
+	row->words = NULL;
+	row->nwords = -1;
+}
+
+/* called from editorUpdateRow; the deferring callers never change chars */
+void editorCompleteUpdateRow(erow *row) {
+	if (E.complete_defer) {
+		if (row->nwords < 0 && E.complete_scan > row->idx) {
+			E.complete_scan = row->idx;
+			editorCompleteSchedule();
+		}
+		return;
+	}
+	editorCompleteUnindexRow(row);
+	editorCompleteIndexRow(row);
+}
+
+void editorCompleteStep() {
+	E.complete_scheduled = 0;
+	long long start = editorNow();
+	int j = E.complete_scan;
+	while (j < E.numrows && editorNow() - start < KB_COMPLETE_SLICE_MS) {
+		int end = j + 1024 < E.numrows ? j + 1024 : E.numrows;
+		for (; j < end; j++) {
+			if (E.row[j].nwords < 0) {
+				editorCompleteIndexRow(&E.row[j]);
+			}
+		}
+	}
+	E.complete_scan = (j < E.numrows) ? j : INT_MAX;
+	editorCompleteSchedule();
+}
+
+void editorCompleteSchedule() {
+	if (E.complete_scan != INT_MAX && !E.complete_scheduled) {
+		E.complete_scheduled = 1;
+		editorSchedule(editorCompleteStep, 0);
+	}
+}
+
+/* keywords count once, so any identifier used in the buffer ranks above them */
+void editorCompleteKeywords(struct editorSyntax *s) {
+	if (s->words_indexed || s->keywords == NULL) return;
+	s->words_indexed = 1;
+	for (int j = 0; s->keywords[j]; j++) {
+		int len = strlen(s->keywords[j]);
+		if (len > 0 && s->keywords[j][len - 1] == '|') len--;
+		if (len < 2 || len > TST_MAX_WORD) continue;
+		tstAdd(&E.words, tstInsert(&E.words, s->keywords[j], len), 1);
+	}
+}
+
+/* the candidates are listed in the message bar, the selected one in brackets */
+void editorCompleteShow(char (*words)[TST_MAX_WORD + 1], int n, int sel, int *first) {
+	char msg[sizeof(E.statusmsg)];
+	if (sel < *first) *first = sel;
+	while (1) {
+		int len = 0, shown = 0;
+		for (int i = *first; i < n; i++) {
+			int w = strlen(words[i]) + 2;
+			if (len + w + 1 >= (int) sizeof(msg)) break;
+			len += snprintf(&msg[len], sizeof(msg) - len, i == sel ? "[%s] " : " %s  ", words[i]);
+			shown = i;
+		}
+		if (shown >= sel || *first == sel) break;
+		(*first)++;
+	}
+	editorSetStatusMessage("%s", msg);
+}
+
+void editorComplete() {
+	char words[KB_COMPLETE_MAX][TST_MAX_WORD + 1];
+	int counts[KB_COMPLETE_MAX];
+	int sel = 0, first = 0;
+
+	while (1) {
+		if (E.cy >= E.numrows) return;
+		erow *row = &E.row[E.cy];
+		int start = E.cx;
+		while (start > 0 && editorIsWordChar((unsigned char) row->chars[start - 1])) {
+			start--;
+		}
+		int len = E.cx - start;
+		int n = 0;
+		if (len > 0 && !isdigit((unsigned char) row->chars[start])) {
+			n = tstTop(&E.words, &row->chars[start], len, words, counts, KB_COMPLETE_MAX);
+		}
+		if (n == 0) {
+			editorSetStatusMessage("No completions");
+			return;
+		}
+		if (sel >= n) sel = n - 1;
+		editorCompleteShow(words, n, sel, &first);
+		editorRefreshScreen();
+
+		int c = editorReadKey();
+		if (c == 0 || c == ARROW_DOWN || c == ARROW_RIGHT) {
+			sel = (sel + 1) % n;
+		}
+		else if (c == ARROW_UP || c == ARROW_LEFT) {
+			sel = (sel + n - 1) % n;
+		}
+		else if (c == '\r' || c == '\t') {
+			editorSetStatusMessage("");
+			editorInsertText(&words[sel][len], strlen(words[sel]) - len);
+			return;
+		}
+		else if (c == BACKSPACE || c == DEL_KEY) {
+			editorDelChar();
+			sel = first = 0;
+		}
+		else if (c < 128 && editorIsWordChar(c)) {
+			editorInsertChar(c);
+			sel = first = 0;
+		}
+		else {
+			editorSetStatusMessage("");
+			return;
+		}
+	}
+}
+
+/*** selection ***/
+
+/*
+ * Shift with an arrow, Home or End selects from an anchor (sel_cx, sel_cy)
+ * to the cursor. Ctrl-C copies the selection, or the cursor's line and its
+ * newline when nothing is selected, Ctrl-X cuts it and Ctrl-V pastes the
+ * latest kill; Alt-Y right after a paste swaps it for the kill before,
+ * going round the ring.
+ *
+ * Kills do not copy text. Their spans point into the chars blocks of the
+ * rows, which poolShare keeps alive and unchanged: a row edited later gets
+ * a private copy from poolRealloc or poolUnshare, and a cut simply leaves
+ * the blocks of the deleted rows to the ring. A paste hands the spans to
+ * editorInsertLines, so its rows go in with one move of the row array and
+ * are highlighted in one pass.
+ */
+
+/* the selection in file order, or 0 if nothing is selected */
+int editorSelection(int *r0, int *c0, int *r1, int *c1) {
+	if (!E.sel_active || E.numrows == 0) return 0;
+	int pos[2][2] = { { E.sel_cy, E.sel_cx }, { E.cy, E.cx } };
+	for (int k = 0; k < 2; k++) {
+		if (pos[k][0] >= E.numrows) {
+			pos[k][0] = E.numrows - 1;
+			pos[k][1] = E.row[E.numrows - 1].size;
+		}
+		if (pos[k][1] > E.row[pos[k][0]].size) {
+			pos[k][1] = E.row[pos[k][0]].size;
+		}
+	}
+	int first = (pos[0][0] < pos[1][0] || (pos[0][0] == pos[1][0] && pos[0][1] <= pos[1][1])) ? 0 : 1;
+	*r0 = pos[first][0];
+	*c0 = pos[first][1];
+	*r1 = pos[!first][0];
+	*c1 = pos[!first][1];
+	return *r0 != *r1 || *c0 != *c1;
+}
+
+void editorSelectionClear() {
+	E.sel_active = 0;
+}
+
+/* moves the cursor for a shifted key, anchoring a new selection where it was */
+void editorSelectionExtend(int key) {
+	if (!E.sel_active) {
+		E.sel_active = 1;
+		E.sel_cx = E.cx;
+		E.sel_cy = E.cy;
+	}
+	switch (key) {
+		case SHIFT_ARROW_LEFT: editorMoveCursor(ARROW_LEFT); break;
+		case SHIFT_ARROW_RIGHT: editorMoveCursor(ARROW_RIGHT); break;
+		case SHIFT_ARROW_UP: editorMoveCursor(ARROW_UP); break;
+		case SHIFT_ARROW_DOWN: editorMoveCursor(ARROW_DOWN); break;
+		case SHIFT_HOME_KEY: E.cx = 0; break;
+		case SHIFT_END_KEY:
+			if (E.cy < E.numrows) E.cx = E.row[E.cy].size;
+			break;
+	}
+}
+
+/* works out the selection to show, redrawing rows that change */
+void editorSelectionRefresh() {
+	int buf = -1, sel[4] = { -1, -1, -1, -1 };
+	if (editorSelection(&sel[0], &sel[1], &sel[2], &sel[3])) {
+		buf = E.curbuf;
+	}
+	if (buf == E.sel_buf && memcmp(sel, E.sel_shown, sizeof(sel)) == 0) {
+		return;
+	}
+
+	if (E.sel_buf == E.curbuf) {
+		editorMarkEdit(E.sel_shown[0], E.sel_shown[2]);
+	}
+	else if (E.sel_buf >= 0) {
+		struct editorBuffer *b = &E.buffers[E.sel_buf];
+		if (E.sel_shown[0] < b->editlo) b->editlo = E.sel_shown[0];
+		if (E.sel_shown[2] > b->edithi) b->edithi = E.sel_shown[2];
+	}
+	if (buf >= 0) {
+		editorMarkEdit(sel[0], sel[2]);
+	}
+	E.sel_buf = buf;
+	memcpy(E.sel_shown, sel, sizeof(sel));
+}
+
+/* the bytes of the row's render that are selected, as [*lo, *hi) */
+void editorSelectionSpan(erow *row, int *lo, int *hi) {
+	*lo = *hi = 0;
+	if (E.sel_buf != E.curbuf || row->idx < E.sel_shown[0] || row->idx > E.sel_shown[2]) {
+		return;
+	}
+	int c0 = (row->idx == E.sel_shown[0]) ? E.sel_shown[1] : 0;
+	int c1 = (row->idx == E.sel_shown[2]) ? E.sel_shown[3] : row->size;
+	*lo = editorRowCxToBx(row, c0 < row->size ? c0 : row->size);
+	*hi = (c1 < row->size) ? editorRowCxToBx(row, c1) : row->rsize;
+}
+
+void editorKillFree(struct killEntry *k) {
+	for (int j = 0; j < k->nspans; j++) {
+		poolFree(k->spans[j].block);
+	}
+	free(k->spans);
+}
+
+/*
+ * Puts the text from (r0, c0) to (r1, c1) on the kill ring. r1 may be
+ * E.numrows with c1 0, for text that ends with the newline of the last row.
+ */
+void editorKillRegion(int r0, int c0, int r1, int c1) {
+	if (E.nkill == KB_KILL_RING) {
+		editorKillFree(&E.kill[0]);
+		memmove(&E.kill[0], &E.kill[1], sizeof(struct killEntry) * (KB_KILL_RING - 1));
+		E.nkill--;
+	}
+	struct killEntry *k = &E.kill[E.nkill++];
+	k->nspans = r1 - r0 + 1;
+	k->spans = malloc(sizeof(struct killSpan) * k->nspans);
+	for (int r = r0; r <= r1; r++) {
+		struct killSpan *span = &k->spans[r - r0];
+		if (r == E.numrows) {
+			span->block = NULL;
+			span->off = span->len = 0;
+			continue;
+		}
+		int from = (r == r0) ? c0 : 0;
+		int to = (r == r1) ? c1 : E.row[r].size;
+		span->block = poolShare(E.row[r].chars);
+		span->off = from;
+		span->len = to - from;
+	}
+}
+
+/* deletes from (r0, c0) to (r1, c1), as editorKillRegion takes them */
+void editorDelRegion(int r0, int c0, int r1, int c1) {
+	if (r1 == E.numrows) {
+		editorDelRows(r0, r1 - r0);
+	}
+	else if (r0 == r1) {
+		editorRowDelChars(&E.row[r0], c0, c1 - c0);
+	}
+	else {
+		erow *first = &E.row[r0];
+		if (c0 < first->size) {
+			editorRowDelChars(first, c0, first->size - c0);
+		}
+		erow *last = &E.row[r1];
+		if (c1 < last->size) {
+			editorRowAppendString(&E.row[r0], &last->chars[c1], last->size - c1);
+		}
+		editorDelRows(r0 + 1, r1 - r0);
+	}
+	E.cy = r0;
+	E.cx = c0;
+}
+
+/* deletes the selected text, if any, and returns whether there was some */
+int editorSelectionDelete() {
+	int r0, c0, r1, c1;
+	int selected = editorSelection(&r0, &c0, &r1, &c1);
+	E.sel_active = 0;
+	if (selected) {
+		editorDelRegion(r0, c0, r1, c1);
+	}
+	return selected;
+}
+
+void editorCopy(int cut) {
+	int r0, c0, r1, c1;
+	if (!editorSelection(&r0, &c0, &r1, &c1)) {
+		if (E.cy >= E.numrows) return;
+		r0 = r1 = E.cy;
+		c0 = 0;
+		c1 = E.row[E.cy].size;
+		if (E.cy + 1 < E.numrows || c1 > 0) {
+			r1 = E.cy + 1;
+			c1 = 0;
+		}
+		if (r1 == r0) return;
+	}
+	editorKillRegion(r0, c0, r1, c1);
+	E.sel_active = 0;
+
+	struct killEntry *k = &E.kill[E.nkill - 1];
+	long long bytes = k->nspans - 1;
+	for (int j = 0; j < k->nspans; j++) {
+		bytes += k->spans[j].len;
+	}
+	if (cut) {
+		editorDelRegion(r0, c0, r1, c1);
+	}
+	editorSetStatusMessage("%s %lld bytes", cut ? "Cut" : "Copied", bytes);
+}
+
+void editorYankEntry(struct killEntry *k) {
+	char **lines = malloc(sizeof(char *) * k->nspans);
+	int *lens = malloc(sizeof(int) * k->nspans);
+	for (int j = 0; j < k->nspans; j++) {
+		struct killSpan *span = &k->spans[j];
+		lines[j] = span->block ? &span->block[span->off] : "";
+		lens[j] = span->len;
+	}
+	editorInsertLines(lines, lens, k->nspans);
+	free(lines);
+	free(lens);
+}
+
+void editorYank() {
+	if (E.nkill == 0) {
+		editorSetStatusMessage("Nothing to paste");
+		return;
+	}
+	editorSelectionDelete();
+	E.yank_cx = E.cx;
+	E.yank_cy = E.cy;
+	E.yank_index = E.nkill - 1;
+	editorYankEntry(&E.kill[E.yank_index]);
+	E.yank_active = 1;
+}
+
+void editorYankPop() {
+	if (!E.yank_active) {
+		editorSetStatusMessage("Alt-Y only follows a paste");
+		return;
+	}
+	editorDelRegion(E.yank_cy, E.yank_cx, E.cy, E.cx);
+	E.yank_index = (E.yank_index + E.nkill - 1) % E.nkill;
+	editorYankEntry(&E.kill[E.yank_index]);
+	editorSetStatusMessage("Kill %d of %d", E.nkill - E.yank_index, E.nkill);
+}
+
+/*** cursors ***/
+
+/*
+ * Besides the cursor at (E.cx, E.cy) there can be any number of extra
+ * ones in E.cursors, kept sorted. Ctrl-D adds one on the next match of the
+ * word at the cursor or of the selected text, Alt-A one on every match and
+ * Alt-C one on each line of the selection, at the cursor's column. ESC
+ * drops them.
+ *
+ * Movement and editing keys go to all cursors at once. Typing, Backspace
+ * and Delete inside rows rebuild each affected row a single time however
+ * many cursors it holds, then update it once. Keys that split or join rows
+ * rebuild the row array once for all cursors, so neither costs a pass over
+ * the file per cursor.
+ */
+int editorCursorCmp(const void *a, const void *b) {
+	const struct cursor *p = a, *q = b;
+	if (p->cy != q->cy) {
+		return p->cy < q->cy ? -1 : 1;
+	}
+	return (p->cx > q->cx) - (p->cx < q->cx);
+}
+
+struct cursor editorCursorClamp(struct cursor c) {
+	if (c.cy >= E.numrows) {
+		c.cy = E.numrows;
+		c.cx = 0;
+	}
+	else {
+		erow *row = &E.row[c.cy];
+		c.cx = editorRowSnapCx(row, c.cx > row->size ? row->size : c.cx);
+	}
+	return c;
+}
+
+/* every cursor, the primary one at *primary, in order and without duplicates */
+struct cursor *editorCursorsGather(int *n, int *primary) {
+	struct cursor *all = malloc(sizeof(struct cursor) * (E.ncursors + 1));
+	struct cursor main = editorCursorClamp((struct cursor) { E.cx, E.cy });
+	for (int j = 0; j < E.ncursors; j++) {
+		all[j] = editorCursorClamp(E.cursors[j]);
+	}
+	all[E.ncursors] = main;
+	qsort(all, E.ncursors + 1, sizeof(struct cursor), editorCursorCmp);
+
+	int m = 0;
+	for (int j = 0; j <= E.ncursors; j++) {
+		if (m == 0 || editorCursorCmp(&all[m - 1], &all[j]) != 0) {
+			all[m++] = all[j];
+		}
+	}
+	*n = m;
+	*primary = (struct cursor *) bsearch(&main, all, m, sizeof(struct cursor), editorCursorCmp) - all;
+	return all;
+}
+
+/* makes primary the cursor and the rest of all the extra ones, merging those that met */
+void editorCursorsScatter(struct cursor *all, int n, struct cursor primary) {
+	qsort(all, n, sizeof(struct cursor), editorCursorCmp);
+	E.cx = primary.cx;
+	E.cy = primary.cy;
+	E.cursors = realloc(E.cursors, sizeof(struct cursor) * n);
+	E.ncursors = 0;
+	for (int j = 0; j < n; j++) {
+		if ((j > 0 && editorCursorCmp(&all[j], &all[j - 1]) == 0) || editorCursorCmp(&all[j], &primary) == 0) {
+			continue;
+		}
+		E.cursors[E.ncursors++] = all[j];
+	}
+	free(all);
+}
+
+/*
+ * Replaces, at every cursor, the character before it (back) and the one
+ * after it (fwd) with s. Each row is rebuilt, journaled and updated once.
+ */
+void editorCursorsSplice(struct cursor *all, int n, int back, int fwd, const char *s, int len) {
+	int i = 0;
+	while (i < n) {
+		int k = i;
+		while (k < n && all[k].cy == all[i].cy) {
+			k++;
+		}
+		if (all[i].cy >= E.numrows) {
+			i = k;
+			continue;
+		}
+
+		erow *row = &E.row[all[i].cy];
+		char *chars = poolAlloc(row->size + (k - i) * len + 1);
+		int from = 0, to = 0, lo = -1;
+		for (int j = i; j < k; j++) {
+			int d0 = back ? editorRowPrevCx(row, all[j].cx) : all[j].cx;
+			int d1 = fwd ? editorRowNextCx(row, all[j].cx) : all[j].cx;
+			if (d0 < from) d0 = from;
+			if (lo < 0) lo = d0;
+			memcpy(&chars[to], &row->chars[from], d0 - from);
+			to += d0 - from;
+			memcpy(&chars[to], s, len);
+			to += len;
+			all[j].cx = to;
+			from = d1 > d0 ? d1 : d0;
+		}
+		int hi = from, newhi = to;
+		memcpy(&chars[to], &row->chars[from], row->size - from);
+		to += row->size - from;
+		chars[to] = '\0';
+
+		if (hi > lo || newhi > lo) {
+			editorJournalSplice(row->idx, lo, hi - lo, &chars[lo], newhi - lo);
+			poolFree(row->chars);
+			row->chars = chars;
+			row->size = to;
+			editorFoldReveal(row->idx);
+			editorUpdateRow(row);
+		}
+		else {
+			poolFree(chars);
+		}
+		i = k;
+	}
+	E.dirty++;
+}
+
+/* the rows the key at cursor c reaches, *lo .. *hi */
+void editorCursorReach(struct cursor c, int key, int *lo, int *hi) {
+	*lo = *hi = c.cy;
+	if (key == BACKSPACE && c.cx == 0 && c.cy > 0) {
+		(*lo)--;
+	}
+	else if (key == DEL_KEY && c.cx == E.row[c.cy].size && c.cy + 1 < E.numrows) {
+		(*hi)++;
+	}
+}
+
+/* a run of rows a .. b reached by cursors i .. k - 1, and the rows lo .. hi - 1 it became */
+struct cursorRun {
+	int a, b;
+	int i, k;
+	int lo, hi;
+};
+
+/*
+ * Edits the text of rows a .. b, joined with newlines, at the run's
+ * cursors, and leaves the new rows at rows[*nrows ..]. Indentation for
+ * Enter comes from the row as it was before the key.
+ */
+void editorCursorsRun(struct cursor *all, struct cursorRun *run, int key, erow *rows, int *nrows) {
+	int *starts = malloc(sizeof(int) * (run->b - run->a + 1));
+	int len = 0, room = 0;
+	for (int r = run->a; r <= run->b; r++) {
+		starts[r - run->a] = len;
+		len += E.row[r].size + 1;
+	}
+	for (int j = run->i; j < run->k; j++) {
+		room += 2 * E.row[all[j].cy].initial_tab_count + 4;
+	}
+	char *text = malloc(len), *out = malloc(len + room);
+	for (int r = run->a; r <= run->b; r++) {
+		memcpy(&text[starts[r - run->a]], E.row[r].chars, E.row[r].size);
+		text[starts[r - run->a] + E.row[r].size] = '\n';
+	}
+	len--;
+
+	int from = 0, to = 0;
+	for (int j = run->i; j < run->k; j++) {
+		erow *row = &E.row[all[j].cy];
+		int cx = all[j].cx, at = starts[all[j].cy - run->a] + cx;
+		int d0 = at, d1 = at, tabs = 0, split = 0;
+		if (key == '\r') {
+			if (cx > 0 && AUTO_INDENTATION) {
+				tabs = cx >= row->initial_tab_count ? row->initial_tab_count : 0;
+				tabs += validOpeningBracket(row->chars[cx - 1]);
+				split = validClosingBracket(row->chars[cx]);
+			}
+		}
+		else if (key == BACKSPACE) {
+			d0 = cx > 0 ? at - (cx - editorRowPrevCx(row, cx)) : at - (all[j].cy > 0);
+		}
+		else {
+			d1 = cx < row->size ? at + (editorRowNextCx(row, cx) - cx) : at + (all[j].cy + 1 < E.numrows);
+		}
+		if (d0 < from) d0 = from;
+
+		memcpy(&out[to], &text[from], d0 - from);
+		to += d0 - from;
+		if (key == '\r') {
+			out[to++] = '\n';
+			memset(&out[to], '\t', tabs);
+			to += tabs;
+		}
+		all[j].cx = to;
+		if (split) {
+			/* the closing bracket goes one level out, as editorInsertNewline puts it */
+			out[to++] = '\n';
+			if (tabs > 1) {
+				memset(&out[to], '\t', tabs - 1);
+				to += tabs - 1;
+			}
+		}
+		from = d1 > d0 ? d1 : d0;
+	}
+	memcpy(&out[to], &text[from], len - from);
+	to += len - from;
+	free(text);
+	free(starts);
+
+	/* split it into rows and find the cursors in them */
+	int j = run->i, s = 0;
+	run->lo = *nrows;
+	for (int e = 0; e <= to; e++) {
+		if (e < to && out[e] != '\n') {
+			continue;
+		}
+		erow *row = &rows[*nrows];
+		editorInitRow(row, *nrows);
+		row->size = e - s;
+		row->chars = poolAlloc(row->size + 1);
+		memcpy(row->chars, &out[s], row->size);
+		row->chars[row->size] = '\0';
+		for (; j < run->k && all[j].cx <= e; j++) {
+			all[j].cx -= s;
+			all[j].cy = *nrows;
+		}
+		(*nrows)++;
+		s = e + 1;
+	}
+	run->hi = *nrows;
+	free(out);
+}
+
+/*
+ * Runs a key that may split or join rows at every cursor in one pass. The
+ * cursors are grouped into runs of rows their edits reach, each run is
+ * edited as one string and split again, and the row array is rebuilt once
+ * around the new rows.
+ */
+void editorCursorsRows(struct cursor *all, int n, int key) {
+	/* a cursor past the last row stays there, Enter adding an empty row above it */
+	struct cursor *past = NULL;
+	if (all[n - 1].cy == E.numrows) {
+		past = &all[--n];
+		if (key == '\r') {
+			editorInsertRow(E.numrows, 0, "", 0);
+			past->cy = E.numrows;
+		}
+		if (n == 0) {
+			return;
+		}
+	}
+
+	struct cursorRun *runs = malloc(sizeof(struct cursorRun) * n);
+	int nruns = 0;
+	int i = 0;
+	do {
+		struct cursorRun *run = &runs[nruns++];
+		int lo, hi;
+		editorCursorReach(all[i], key, &run->a, &run->b);
+		run->i = i++;
+		while (i < n) {
+			editorCursorReach(all[i], key, &lo, &hi);
+			if (lo > run->b) break;
+			if (hi > run->b) run->b = hi;
+			i++;
+		}
+		run->k = i;
+	} while (i < n);
+
+	/* folds the edits reach open, while the rows are still where they say */
+	for (int f = E.nfolds - 1; f >= 0; f--) {
+		for (int r = 0; r < nruns; r++) {
+			if (runs[r].a <= E.folds[f].end && E.folds[f].start <= runs[r].b) {
+				editorFoldRemove(f);
+				break;
+			}
+		}
+	}
+
+	erow *rows = malloc(sizeof(erow) * (E.numrows + 2 * n));
+	int nrows = 0, next = 0;
+	for (int r = 0; r < nruns; r++) {
+		struct cursorRun *run = &runs[r];
+		memcpy(&rows[nrows], &E.row[next], sizeof(erow) * (run->a - next));
+		nrows += run->a - next;
+		editorCursorsRun(all, run, key, rows, &nrows);
+		for (int j = run->a; j <= run->b; j++) {
+			editorFreeRow(&E.row[j]);
+		}
+		next = run->b + 1;
+
+		editorJournalDelete(run->lo, run->b - run->a + 1);
+		char **lines = malloc(sizeof(char *) * (run->hi - run->lo));
+		int *lens = malloc(sizeof(int) * (run->hi - run->lo));
+		for (int j = run->lo; j < run->hi; j++) {
+			lines[j - run->lo] = rows[j].chars;
+			lens[j - run->lo] = rows[j].size;
+		}
+		editorJournalInsert(run->lo, lines, lens, run->hi - run->lo);
+		free(lines);
+		free(lens);
+	}
+	memcpy(&rows[nrows], &E.row[next], sizeof(erow) * (E.numrows - next));
+	nrows += E.numrows - next;
+
+	/* the folds left are all outside the runs */
+	for (int f = 0, r = 0; f < E.nfolds; f++) {
+		while (r < nruns && runs[r].b < E.folds[f].start) r++;
+		int shift = r > 0 ? runs[r - 1].hi - runs[r - 1].b - 1 : 0;
+		E.folds[f].start += shift;
+		E.folds[f].end += shift;
+	}
+
+	/* rows above the first run kept their place */
+	int first = runs[0].a;
+	if (nrows < E.numrows) {
+		editorHighlightDeleted(first);
+	}
+	free(E.row);
+	E.row = rows;
+	int oldrows = E.numrows;
+	E.numrows = nrows;
+	for (int j = first; j < nrows; j++) {
+		E.row[j].idx = j;
+	}
+	editorRowsMoved(first, oldrows);
+	if (E.complete_scan > first) E.complete_scan = first;
+	editorMarkEdit(first, INT_MAX);
+
+	E.complete_defer++;
+	E.hl_defer++;
+	for (int r = 0; r < nruns; r++) {
+		for (int j = runs[r].lo; j < runs[r].hi; j++) {
+			editorUpdateRow(&E.row[j]);
+		}
+	}
+	E.hl_defer--;
+	E.complete_defer--;
+	editorHighlightFlush();
+	free(runs);
+	if (past) past->cy = E.numrows;
+	E.dirty++;
+}
+/*
+ * Applies command at every cursor, or types c at each when command is
+ * KEYMAP_UNBOUND; returns 0 for commands that are only for the primary one.
+ */
+int editorCursorsKeypress(int command, int c) {
+	int n, primary;
+	struct cursor *all;
+
+	switch (command) {
+		case CMD_CANCEL:
+			E.ncursors = 0;
+			return 1;
+
+		case CMD_UP:
+		case CMD_DOWN:
+		case CMD_LEFT:
+		case CMD_RIGHT:
+		case CMD_LINE_START:
+		case CMD_LINE_END:
+			c = E.command_key[command];
+			all = editorCursorsGather(&n, &primary);
+			for (int j = 0; j < n; j++) {
+				E.cx = all[j].cx;
+				E.cy = all[j].cy;
+				if (c == HOME_KEY) {
+					E.cx = 0;
+				}
+				else if (c == END_KEY) {
+					if (E.cy < E.numrows) E.cx = E.row[E.cy].size;
+				}
+				else {
+					editorMoveCursor(c);
+				}
+				all[j].cx = E.cx;
+				all[j].cy = E.cy;
+			}
+			editorCursorsScatter(all, n, all[primary]);
+			return 1;
+
+		case CMD_NEWLINE:
+		case CMD_BACKSPACE:
+		case CMD_DELETE: {
+			c = E.command_key[command];
+			all = editorCursorsGather(&n, &primary);
+			int rows = (c == '\r');
+			for (int j = 0; j < n && !rows; j++) {
+				int r = all[j].cy;
+				if (r < E.numrows && (c == BACKSPACE ? (all[j].cx == 0 && r > 0) : (all[j].cx == E.row[r].size && r + 1 < E.numrows))) {
+					rows = 1;
+				}
+			}
+			if (rows) {
+				editorCursorsRows(all, n, c);
+			}
+			else {
+				editorCursorsSplice(all, n, c == BACKSPACE, c == DEL_KEY, "", 0);
+			}
+			editorCursorsScatter(all, n, all[primary]);
+			return 1;
+		}
+	}
+
+	if (command != KEYMAP_UNBOUND || c >= ARROW_LEFT || (c < 128 && iscntrl(c) && c != '\t')) {
+		return 0;
+	}
+	all = editorCursorsGather(&n, &primary);
+	if (all[n - 1].cy == E.numrows) {
+		editorInsertRow(E.numrows, 0, "", 0);
+	}
+
+	char s[2] = { c, 0 };
+	int len = 1, skip = validClosingBracket(c) && AUTO_BRACKETS;
+	for (int j = 0; j < n && skip; j++) {
+		erow *row = &E.row[all[j].cy];
+		skip = (all[j].cx < row->size && row->chars[all[j].cx] == c);
+	}
+	if (skip) {
+		for (int j = 0; j < n; j++) {
+			all[j].cx++;
+		}
+	}
+	else {
+		if (validOpeningBracket(c) && AUTO_BRACKETS) {
+			s[len++] = pairOf(c);
+		}
+		editorCursorsSplice(all, n, 0, 0, s, len);
+		for (int j = 0; j < n; j++) {
+			all[j].cx -= len - 1;
+		}
+	}
+	editorCursorsScatter(all, n, all[primary]);
+	return 1;
+}
+
+/* whether pat occurs at x in the row, as a whole word if word is set */
+int editorCursorsMatchAt(erow *row, int x, const char *pat, int len, int word) {
+	if (x + len > row->size || memcmp(&row->chars[x], pat, len) != 0) {
+		return 0;
+	}
+	return !word || ((x == 0 || !editorIsWordChar((unsigned char) row->chars[x - 1])) &&
+		(x + len == row->size || !editorIsWordChar((unsigned char) row->chars[x + len])));
+}
+
+/*
+ * The text to put cursors on: the selection if it is on one row, else the
+ * word at the cursor. *row and *col are where it is, *off where the cursor
+ * is in it.
+ */
+char *editorCursorsPattern(int *row, int *col, int *len, int *off, int *word) {
+	int r0, c0, r1, c1;
+	*word = 0;
+	if (!editorSelection(&r0, &c0, &r1, &c1) || r0 != r1) {
+		if (E.cy >= E.numrows) return NULL;
+		erow *row = &E.row[E.cy];
+		r0 = E.cy;
+		c0 = c1 = E.cx;
+		while (c0 > 0 && editorIsWordChar((unsigned char) row->chars[c0 - 1])) c0--;
+		while (c1 < row->size && editorIsWordChar((unsigned char) row->chars[c1])) c1++;
+		if (c0 == c1) return NULL;
+		*word = 1;
+	}
+	*row = r0;
+	*col = c0;
+	*len = c1 - c0;
+	*off = (E.cy == r0 && E.cx >= c0 && E.cx <= c1) ? E.cx - c0 : *len;
+	char *pat = malloc(*len);
+	memcpy(pat, &E.row[r0].chars[c0], *len);
+	return pat;
+}
+
+void editorCursorsAddNext() {
+	int r, x, len, off, word;
+	char *pat = editorCursorsPattern(&r, &x, &len, &off, &word);
+	if (pat == NULL) {
+		editorSetStatusMessage("No word at the cursor");
+		return;
+	}
+
+	/* search on from just after the start of the match the cursor is on, wrapping round */
+	x++;
+	for (int k = 0; k <= E.numrows; k++, r = (r + 1) % E.numrows, x = 0) {
+		erow *row = &E.row[r];
+		char *p;
+		while (x + len <= row->size && (p = memmem(&row->chars[x], row->size - x, pat, len)) != NULL) {
+			x = p - row->chars;
+			if (editorCursorsMatchAt(row, x, pat, len, word)) {
+				break;
+			}
+			x++;
+		}
+		if (x + len <= row->size && editorCursorsMatchAt(row, x, pat, len, word)) {
+			break;
+		}
+	}
+	free(pat);
+
+	struct cursor c = { x + off, r }, *all;
+	int n, primary;
+	all = editorCursorsGather(&n, &primary);
+	if (bsearch(&c, all, n, sizeof(struct cursor), editorCursorCmp) != NULL) {
+		free(all);
+		editorSetStatusMessage("No more matches");
+		return;
+	}
+	all = realloc(all, sizeof(struct cursor) * (n + 1));
+	all[n] = c;
+	E.sel_active = 0;
+	editorCursorsScatter(all, n + 1, c);
+	editorSetStatusMessage("%d cursors", E.ncursors + 1);
+}
+
+void editorCursorsAddAll() {
+	int row, col, len, off, word;
+	char *pat = editorCursorsPattern(&row, &col, &len, &off, &word);
+	if (pat == NULL) {
+		editorSetStatusMessage("No word at the cursor");
+		return;
+	}
+
+	int n, primary, cap;
+	struct cursor *all = editorCursorsGather(&n, &primary);
+	cap = n;
+	for (int r = 0; r < E.numrows; r++) {
+		erow *row = &E.row[r];
+		char *p;
+		int x = 0;
+		while (x + len <= row->size && (p = memmem(&row->chars[x], row->size - x, pat, len)) != NULL) {
+			x = p - row->chars;
+			if (!editorCursorsMatchAt(row, x, pat, len, word)) {
+				x++;
+				continue;
+			}
+			if (n == cap) {
+				cap *= 2;
+				all = realloc(all, sizeof(struct cursor) * cap);
+			}
+			all[n].cx = x + off;
+			all[n++].cy = r;
+			x += len;
+		}
+	}
+	free(pat);
+	E.sel_active = 0;
+	editorCursorsScatter(all, n, editorCursorClamp((struct cursor) { E.cx, E.cy }));
+	editorSetStatusMessage("%d cursors", E.ncursors + 1);
+}
+
+/* one cursor per selected row, in the screen column of the cursor */
+void editorCursorsAddColumn() {
+	int r0, c0, r1, c1;
+	if (!editorSelection(&r0, &c0, &r1, &c1) || r0 == r1) {
+		editorSetStatusMessage("Select two or more lines first");
+		return;
+	}
+	int rx = (E.cy < E.numrows) ? editorRowCxToRx(&E.row[E.cy], E.cx) - E.gutter : 0;
+	if (c1 == 0 && r1 > r0 && E.cy != r1) r1--;
+
+	int n, primary;
+	struct cursor *all = editorCursorsGather(&n, &primary);
+	all = realloc(all, sizeof(struct cursor) * (n + r1 - r0 + 1));
+	for (int r = r0; r <= r1; r++) {
+		all[n].cx = editorRowRxToCx(&E.row[r], rx);
+		all[n++].cy = r;
+	}
+	E.sel_active = 0;
+	editorCursorsScatter(all, n, editorCursorClamp((struct cursor) { E.cx, E.cy }));
+	editorSetStatusMessage("%d cursors", E.ncursors + 1);
+}
+
+/* redraws the rows whose extra cursors changed since the last frame */
+void editorCursorsRefresh() {
+	int buf = E.ncursors ? E.curbuf : -1;
+	if (buf == E.cursors_buf && E.ncursors == E.ncursors_shown && (E.ncursors == 0 ||
+		memcmp(E.cursors, E.cursors_shown, sizeof(struct cursor) * E.ncursors) == 0)) {
+		return;
+	}
+
+	if (E.ncursors_shown > 0) {
+		int lo = E.cursors_shown[0].cy, hi = E.cursors_shown[E.ncursors_shown - 1].cy;
+		if (E.cursors_buf == E.curbuf) {
+			editorMarkEdit(lo, hi);
+		}
+		else if (E.cursors_buf >= 0) {
+			struct editorBuffer *b = &E.buffers[E.cursors_buf];
+			if (lo < b->editlo) b->editlo = lo;
+			if (hi > b->edithi) b->edithi = hi;
+		}
+	}
+	if (E.ncursors > 0) {
+		editorMarkEdit(E.cursors[0].cy, E.cursors[E.ncursors - 1].cy);
+	}
+	E.cursors_buf = buf;
+	E.cursors_shown = realloc(E.cursors_shown, sizeof(struct cursor) * (E.ncursors + 1));
+	if (E.ncursors > 0) {
+		memcpy(E.cursors_shown, E.cursors, sizeof(struct cursor) * E.ncursors);
+	}
+	E.ncursors_shown = E.ncursors;
+}
+
+/* the index in cursors_shown of the first extra cursor on the row */
+int editorCursorsOnRow(erow *row) {
+	if (E.cursors_buf != E.curbuf) {
+		return E.ncursors_shown;
+	}
+	int lo = 0, hi = E.ncursors_shown;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (E.cursors_shown[mid].cy < row->idx) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/* the render offset of cursor k if it is on the row, else INT_MAX */
+int editorCursorsBx(erow *row, int k) {
+	if (k >= E.ncursors_shown || E.cursors_shown[k].cy != row->idx || E.cursors_shown[k].cx > row->size) {
+		return INT_MAX;
+	}
+	return editorRowCxToBx(row, E.cursors_shown[k].cx);
+}
+
+/*** macros ***/
+
+/*
+ * Alt-R starts recording keys, as the codes editorReadKey returns, and
+ * stops again. record_start is where the keys of the binding being typed
+ * begin in record, so a chord that stops recording is dropped whole. Alt-E
+ * replays the last macro a number of times, or once on each line of a
+ * range with the cursor put at the start of the line. The keys go through
+ * editorReadKey to editorProcessKeypress as if typed, but nothing is drawn
+ * and no row highlighted until the replay is over; the rows it touched are
+ * then highlighted in one pass. Pasted text is not recorded.
+ */
+void editorMacroRecord(int c) {
+	if (c == PASTE_START || c == PASTE_END) {
+		return;
+	}
+	if (E.nrecord == E.recordcap) {
+		E.recordcap = E.recordcap ? 2 * E.recordcap : 64;
+		E.record = realloc(E.record, sizeof(int) * E.recordcap);
+	}
+	E.record[E.nrecord++] = c;
+}
+
+void editorMacroToggle() {
+	char keys[40] = "macro-record";
+	keymapDescribe(&E.keymap, CMD_MACRO_RECORD, keys, sizeof(keys));
+	if (!E.recording) {
+		E.recording = 1;
+		E.nrecord = E.record_start = 0;
+		editorSetStatusMessage("Recording macro (%s to stop)", keys);
+		return;
+	}
+
+	/* drop the keys of the binding that stops it, from record_start on */
+	E.recording = 0;
+	E.nrecord = E.record_start;
+	if (E.nrecord == 0) {
+		editorSetStatusMessage("Macro is empty, kept the last one");
+		return;
+	}
+	E.macro = realloc(E.macro, sizeof(int) * E.nrecord);
+	memcpy(E.macro, E.record, sizeof(int) * E.nrecord);
+	E.nmacro = E.nrecord;
+	editorSetStatusMessage("Recorded %d keys", E.nmacro);
+}
+
+/*
+ * Replays the macro times times; with from set, once on each of the rows
+ * from .. to instead. Rows the macro adds or removes move the rest of the
+ * range with them. Returns how many times it ran.
+ */
+int editorMacroRun(int times, int from, int to) {
+	int n = 0;
+	E.hl_defer++;
+	for (; n < times; n++) {
+		if (from >= 0) {
+			if (from > to || from >= E.numrows) {
+				break;
+			}
+			E.cx = 0;
+			E.cy = from;
+			editorSelectionClear();
+			editorFoldReveal(from);
+		}
+		int before = E.numrows;
+		E.macro_pos = 0;
+		while (E.macro_pos < E.nmacro) {
+			editorProcessKeypress();
+		}
+		if (from >= 0) {
+			from += 1 + E.numrows - before;
+			to += E.numrows - before;
+		}
+	}
+	E.macro_pos = -1;
+	E.hl_defer--;
+	editorHighlightFlush();
+	return n;
+}
+
+void editorMacroReplay() {
+	if (E.recording) {
+		char keys[40] = "macro-record";
+		keymapDescribe(&E.keymap, CMD_MACRO_RECORD, keys, sizeof(keys));
+		E.nrecord = E.record_start;
+		editorSetStatusMessage("Stop recording with %s first", keys);
+		return;
+	}
+	if (E.nmacro == 0) {
+		editorSetStatusMessage("No macro recorded");
+		return;
+	}
+
+	char *arg = editorPrompt("Replay macro: %s (times, or lines FROM-TO; ESC to cancel)", NULL);
+	if (arg == NULL) {
+		return;
+	}
+	char *dash = strchr(arg, '-');
+	long long start = editorNow();
+	if (dash) {
+		int from = atoi(arg) - 1;
+		int to = dash[1] ? atoi(dash + 1) - 1 : E.numrows - 1;
+		int n = editorMacroRun(INT_MAX, from < 0 ? 0 : from, to);
+		editorSetStatusMessage("Replayed macro on %d lines in %lld ms", n, editorNow() - start);
+	}
+	else {
+		int n = editorMacroRun(atoi(arg), -1, -1);
+		editorSetStatusMessage("Replayed macro %d times in %lld ms", n, editorNow() - start);
+	}
+	free(arg);
+}
+
+/*** file i/o ***/
+
+char *editorRowsToString(int *buflen) {
+	int totlen = 0;
+	for (int j = 0; j < E.numrows; j++) {
+		totlen += E.row[j].size + 1;
+	}
+	*buflen = totlen;
+
+	char *buf = malloc(totlen);
+	char *p = buf;
+	for (int j = 0; j < E.numrows; j++) {
+		memcpy(p, E.row[j].chars, E.row[j].size);
+		p += E.row[j].size;
+		*p = '\n';
+		p++;
+	}
+
+	return buf;
+}
+
+int editorOpen(char *filename) {
+	FILE *fp = fopen(filename, "r");
+	if (!fp) {
+		return -1;
+	}
+
+	free(E.filename);
+	E.filename = strdup(filename);
+	editorDiskRecord(&E.buffers[E.curbuf], fileno(fp));
+
+	/* rows are highlighted all at once when the filetype is picked below */
+	E.syntax = NULL;
+
+	char *line = NULL;
+	size_t linecap = 0;
+	ssize_t linelen;
+	off_t size = 0;
+	E.journal_suspend++;
+	E.complete_defer++;
+	while ((linelen = getline(&line, &linecap, fp)) != -1) {
+		size += linelen;
+		while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r')) {
+			linelen--;
+		}
+		editorInsertRow(E.numrows, 0, line, linelen);
+	}
+	E.complete_defer--;
+	E.journal_suspend--;
+	free(line);
+	fclose(fp);
+	editorSelectSyntaxHighlight();
+	E.buffers[E.curbuf].filesize = size;
+	E.dirty = 0;
+	return 0;
+}
+
+void editorSave() {
+	if (E.filename == NULL) {
+		E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
+		if (E.filename == NULL) {
+			editorSetStatusMessage("Save aborted");
+			return;
+		}
+		editorSelectSyntaxHighlight();
+	}
+
+	/* never silently overwrite what another program wrote since we read the file */
+	struct editorBuffer *b = &E.buffers[E.curbuf];
+	if (b->disk_ino != 0 && !b->overwrite && (b->disk_changed || editorDiskChanged(b, E.filename))) {
+		b->disk_changed = 1;
+		b->overwrite = 1;
+		editorSetStatusMessage("WARNING!!! %.20s changed on disk. Press Ctrl-S again to overwrite it.", E.filename);
+		return;
+	}
+
+	int len;
+	char *buf = editorRowsToString(&len);
+
+	int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
+	if (fd != -1) {
+		if (ftruncate(fd, len) != -1) {
+			if (write(fd, buf, len) == len) {
+				editorDiskRecord(b, fd);
+				close(fd);
+				free(buf);
+				if (b->watch_wd == 0) {
+					editorWatchFile(E.curbuf);
+				}
+				b->filesize = len;
+				b->follow_off = len;
+				b->follow_partial = 0;
+				E.dirty = 0;
+				editorJournalReset(b);
+				editorSetStatusMessage("%d bytes written to disk", len);
+				return;
+			}
+		}
+		close(fd);
+	}
+
+	free(buf);
+	editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+}
+
+/*** buffers ***/
+
+/*
+ * Every open file is an editorBuffer. The active one is unpacked into E, so
+ * the rest of the editor only ever works on E; switching stores E back into
+ * its slot and loads the other buffer.
+ *
+ * Rows of all buffers are allocated from the pool in utils.c. When the pool
+ * grows past E.memlimit, the render, hl and cols caches of the least
+ * recently used inactive buffers are dropped. They are rebuilt from chars
+ * when the buffer becomes active again.
+ */
+void editorBufferStore() {
+	struct editorBuffer *b = &E.buffers[E.curbuf];
+	editorHighlightPending();
+	b->cx = E.cx;
+	b->cy = E.cy;
+	b->rowoff = E.rowoff;
+	b->rowseg = E.rowseg;
+	b->coloff = E.coloff;
+	b->numrows = E.numrows;
+	b->row = E.row;
+	b->wrapindex = E.wrapindex;
+	b->wrapindex_valid = E.wrapindex_valid;
+	b->bracketindex = E.bracketindex;
+	b->bracketsize = E.bracketsize;
+	b->bracketindex_valid = E.bracketindex_valid;
+	b->folds = E.folds;
+	b->nfolds = E.nfolds;
+	b->foldindex = E.foldindex;
+	b->foldindex_valid = E.foldindex_valid;
+	b->complete_scan = E.complete_scan;
+	b->sel_active = E.sel_active;
+	b->sel_cx = E.sel_cx;
+	b->sel_cy = E.sel_cy;
+	b->cursors = E.cursors;
+	b->ncursors = E.ncursors;
+	b->dirty = E.dirty;
+	b->filename = E.filename;
+	b->syntax = E.syntax;
+	b->editlo = E.editlo;
+	b->edithi = E.edithi;
+	b->last_used = editorNow();
+}
+
+void editorBufferLoad(int i) {
+	struct editorBuffer *b = &E.buffers[i];
+	E.curbuf = i;
+	E.cx = b->cx;
+	E.cy = b->cy;
+	E.rowoff = b->rowoff;
+	E.rowseg = b->rowseg;
+	E.coloff = b->coloff;
+	E.numrows = b->numrows;
+	E.row = b->row;
+	E.wrapindex = b->wrapindex;
+	E.wrapindex_valid = b->wrapindex_valid;
+	E.bracketindex = b->bracketindex;
+	E.bracketsize = b->bracketsize;
+	E.bracketindex_valid = b->bracketindex_valid;
+	E.folds = b->folds;
+	E.nfolds = b->nfolds;
+	E.foldindex = b->foldindex;
+	E.foldindex_valid = b->foldindex_valid;
+	E.complete_scan = b->complete_scan;
+	E.sel_active = b->sel_active;
+	E.sel_cx = b->sel_cx;
+	E.sel_cy = b->sel_cy;
+	E.cursors = b->cursors;
+	E.ncursors = b->ncursors;
+	E.dirty = b->dirty;
+	E.filename = b->filename;
+	E.syntax = b->syntax;
+	E.editlo = b->editlo;
+	E.edithi = b->edithi;
+
+	if (!b->cached) {
+		/* every render has to exist before highlighting looks at the row above */
+		E.syntax = NULL;
+		E.complete_defer++;
+		for (int j = 0; j < E.numrows; j++) {
+			editorUpdateRow(&E.row[j]);
+		}
+		E.complete_defer--;
+		E.syntax = b->syntax;
+		editorHighlightAll();
+		b->cached = 1;
+	}
+	if (E.wrap) {
+		for (int j = 0; j < E.numrows; j++) {
+			if (E.row[j].wrap_cols != E.wrapcols) {
+				E.wrapindex_valid = 0;
+				editorWrapUpdateRow(&E.row[j]);
+			}
+		}
+	}
+
+	editorCompleteSchedule();
+
+	E.gutterrows = 0;
+	E.shadowtop = -1;
+}
+
+void editorBufferDropCaches(struct editorBuffer *b) {
+	for (int j = 0; j < b->numrows; j++) {
+		erow *row = &b->row[j];
+		poolFree(row->render);
+		poolFree(row->hl);
+		poolFree(row->cols);
+		row->render = NULL;
+		row->hl = NULL;
+		row->cols = NULL;
+		row->ncols = 0;
+	}
+	b->cached = 0;
+}
+
+int editorBufferVisible(int i) {
+	for (int v = 0; v < E.nviews; v++) {
+		if (E.views[v].buf == i) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+void editorBufferTrim() {
+	while (poolUsed() > E.memlimit) {
+		struct editorBuffer *lru = NULL;
+		for (int i = 0; i < E.nbuffers; i++) {
+			struct editorBuffer *b = &E.buffers[i];
+			if (i != E.curbuf && b->cached && !editorBufferVisible(i) && (lru == NULL || b->last_used < lru->last_used)) {
+				lru = b;
+			}
+		}
+		if (lru == NULL) {
+			break;
+		}
+		editorBufferDropCaches(lru);
+	}
+}
+
+int editorBufferDirty() {
+	for (int i = 0; i < E.nbuffers; i++) {
+		if (i == E.curbuf ? E.dirty : E.buffers[i].dirty) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+void editorBufferSwitch(int i) {
+	if (E.nbuffers < 2) {
+		editorSetStatusMessage("No other buffers");
+		return;
+	}
+	editorBufferStore();
+	editorBufferLoad((i + E.nbuffers) % E.nbuffers);
+	editorBufferTrim();
+	editorSetStatusMessage("[%d/%d] %s", E.curbuf + 1, E.nbuffers,
+		E.filename ? E.filename : "[No Name]");
+}
+
+/* the buffer holding the file at filename, however it was spelled, or -1 */
+int editorBufferFind(const char *filename) {
+	struct stat st, bst;
+	if (stat(filename, &st) == -1) {
+		return -1;
+	}
+	for (int i = 0; i < E.nbuffers; i++) {
+		char *name = editorBufferFilename(i);
+		if (name && stat(name, &bst) == 0 && bst.st_dev == st.st_dev && bst.st_ino == st.st_ino) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* opens filename in a new buffer, or switches to the buffer that has it open already */
+int editorBufferOpen(char *filename) {
+	int found = editorBufferFind(filename);
+	if (found >= 0) {
+		if (found != E.curbuf) {
+			editorBufferStore();
+			editorBufferLoad(found);
+			editorBufferTrim();
+		}
+		return 0;
+	}
+
+	int prev = E.curbuf;
+	/* the empty buffer kb starts with is taken over by the first file */
+	int added = (E.numrows > 0 || E.dirty || E.filename);
+	if (added) {
+		editorBufferStore();
+		E.buffers = realloc(E.buffers, sizeof(struct editorBuffer) * (E.nbuffers + 1));
+		memset(&E.buffers[E.nbuffers], 0, sizeof(struct editorBuffer));
+		E.buffers[E.nbuffers].editlo = INT_MAX;
+		E.buffers[E.nbuffers].edithi = -1;
+		E.buffers[E.nbuffers].complete_scan = INT_MAX;
+		E.buffers[E.nbuffers].cached = 1;
+		editorBufferLoad(E.nbuffers++);
+	}
+
+	if (editorOpen(filename) == -1) {
+		int err = errno;
+		if (added) {
+			E.nbuffers--;
+			editorBufferLoad(prev);
+		}
+		errno = err;
+		return -1;
+	}
+	editorJournalRecover();
+	editorWatchFile(E.curbuf);
+	editorBufferTrim();
+	return 0;
+}
+
+void editorBufferPromptOpen() {
+	char *filename = editorPrompt("Open: %s (ESC to cancel)", NULL);
+	if (filename == NULL) {
+		return;
+	}
+	if (editorBufferOpen(filename) == -1) {
+		editorSetStatusMessage("Can't open %s: %s", filename, strerror(errno));
+	}
+	else {
+		editorSetStatusMessage("[%d/%d] %s", E.curbuf + 1, E.nbuffers, E.filename);
+	}
+	free(filename);
+}
+
+/*** follow ***/
+
+/*
+ * A followed buffer behaves like tail -f: inotify reports writes to its
+ * file and only the bytes past follow_off are read and turned into rows.
+ * Writes are collected for one frame interval, so a file growing by
+ * thousands of lines a second costs one read and one redraw per frame.
+ */
+void editorFollowAppend(char *s, int len) {
+	struct editorBuffer *b = &E.buffers[E.curbuf];
+	int oldrows = E.numrows;
+	int dirty = E.dirty;
+	char *end = s + len;
+
+	/* the last row is continued if the file did not end in a newline */
+	if (b->follow_partial && E.numrows > 0) {
+		char *nl = memchr(s, '\n', len);
+		char *stop = nl ? nl : end;
+		int n = stop - s;
+		if (nl && n > 0 && s[n - 1] == '\r') n--;
+		editorRowAppendString(&E.row[E.numrows - 1], s, n);
+		editorMarkEdit(E.numrows - 1, E.numrows - 1);
+		b->follow_partial = (nl == NULL);
+		s = nl ? nl + 1 : end;
+	}
+
+	int n = 0, cap = 0;
+	char **lines = NULL;
+	int *lens = NULL;
+	while (s < end) {
+		char *nl = memchr(s, '\n', end - s);
+		char *stop = nl ? nl : end;
+		if (n == cap) {
+			cap = cap ? cap * 2 : 64;
+			lines = realloc(lines, sizeof(char *) * cap);
+			lens = realloc(lens, sizeof(int) * cap);
+		}
+		lines[n] = s;
+		lens[n] = stop - s;
+		if (nl && lens[n] > 0 && s[lens[n] - 1] == '\r') lens[n]--;
+		n++;
+		b->follow_partial = (nl == NULL);
+		s = nl ? nl + 1 : end;
+	}
+	editorInsertRows(E.numrows, lines, lens, n);
+	free(lines);
+	free(lens);
+	E.dirty = dirty;
+
+	/* cursors sitting on the last row stay at the end of the file */
+	if (E.numrows > oldrows) {
+		if (E.cy >= oldrows - 1) {
+			E.cy = E.numrows - 1;
+			E.cx = 0;
+		}
+		for (int i = 0; i < E.nviews; i++) {
+			struct editorView *v = &E.views[i];
+			if (i != E.curview && v->buf == E.curbuf && v->cy >= oldrows - 1) {
+				v->cy = E.numrows - 1;
+				v->cx = 0;
+			}
+		}
+	}
+}
+
+void editorFollowRead(int i) {
+	struct editorBuffer *b = &E.buffers[i];
+	struct stat st;
+	if (fstat(b->follow_fd, &st) == -1) {
+		return;
+	}
+	if (st.st_size < b->follow_off) {
+		b->follow_off = st.st_size;
+		b->follow_partial = 0;
+		editorSetStatusMessage("%s was truncated", b == &E.buffers[E.curbuf] ? E.filename : b->filename);
+		return;
+	}
+	if (st.st_size == b->follow_off) {
+		return;
+	}
+
+	int prev = E.curbuf;
+	if (i != prev) {
+		editorBufferStore();
+		editorBufferLoad(i);
+	}
+
+	/* appending to an unmodified buffer needs no journal, the file has it all */
+	int clean = !E.dirty;
+	if (clean) E.journal_suspend++;
+	char *chunk = malloc(KB_VIEW_CHUNK);
+	while (b->follow_off < st.st_size) {
+		int want = st.st_size - b->follow_off < KB_VIEW_CHUNK ? st.st_size - b->follow_off : KB_VIEW_CHUNK;
+		int len = pread(b->follow_fd, chunk, want, b->follow_off);
+		if (len <= 0) break;
+		editorFollowAppend(chunk, len);
+		b->follow_off += len;
+	}
+	free(chunk);
+	editorDiskRecord(b, b->follow_fd);
+	if (clean) {
+		E.journal_suspend--;
+		editorJournalReset(b);
+	}
+	else {
+		/* the file has the appended rows now too, so the journal is rewritten against it */
+		b->journal_base_size = b->disk_size;
+		b->journal_base_mtime = b->disk_mtime;
+		b->journal_rebase = 1;
+	}
+
+	if (i != prev) {
+		editorBufferStore();
+		editorBufferLoad(prev);
+	}
+}
+
+void editorFollowPoll() {
+	E.follow_scheduled = 0;
+	for (int i = 0; i < E.nbuffers; i++) {
+		if (E.buffers[i].follow && E.buffers[i].follow_pending) {
+			E.buffers[i].follow_pending = 0;
+			editorFollowRead(i);
+		}
+	}
+	editorRequestFrame();
+}
+
+void editorFollowToggle() {
+	struct editorBuffer *b = &E.buffers[E.curbuf];
+	if (b->follow) {
+		inotify_rm_watch(E.inotifyfd, b->follow_wd);
+		close(b->follow_fd);
+		b->follow = 0;
+		editorSetStatusMessage("Stopped following %s", E.filename);
+		return;
+	}
+	if (E.filename == NULL) {
+		editorSetStatusMessage("No file to follow");
+		return;
+	}
+	if (editorWatchInit() == -1) {
+		editorSetStatusMessage("Can't follow: %s", strerror(errno));
+		return;
+	}
+
+	b->follow_fd = open(E.filename, O_RDONLY | O_CLOEXEC);
+	if (b->follow_fd == -1) {
+		editorSetStatusMessage("Can't follow %s: %s", E.filename, strerror(errno));
+		return;
+	}
+	b->follow_wd = inotify_add_watch(E.inotifyfd, E.filename, IN_MODIFY);
+	if (b->follow_wd == -1) {
+		editorSetStatusMessage("Can't follow %s: %s", E.filename, strerror(errno));
+		close(b->follow_fd);
+		return;
+	}
+
+	/* pick up from the end of what was loaded into the rows */
+	char last = '\n';
+	b->follow = 1;
+	b->follow_off = b->filesize;
+	b->follow_partial = b->filesize > 0 && pread(b->follow_fd, &last, 1, b->filesize - 1) == 1 && last != '\n';
+	b->follow_pending = 1;
+	if (E.numrows > 0) {
+		E.cy = E.numrows - 1;
+		E.cx = 0;
+	}
+	editorFollowPoll();
+	editorSetStatusMessage("Following %s", E.filename);
+}
+
+/*** file watching ***/
+
+/*
+ * The directory of every open file is watched with inotify, so a file
+ * replaced by rename is noticed as well as one written in place. Changes
+ * are checked KB_RELOAD_DELAY_MS after the last event against the inode,
+ * size and mtime recorded when kb last read or wrote the file. Unmodified
+ * buffers are reloaded in place: lineDiff matches the hashes of the rows
+ * against the new lines and only the rows between matched runs are
+ * replaced, so the rest keep their render and highlighting. Modified
+ * buffers are only flagged, and editorSave asks before overwriting.
+ */
+int editorWatchInit() {
+	if (E.inotifyfd == -1) {
+		E.inotifyfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (E.inotifyfd != -1) {
+			editorEventAdd(E.inotifyfd);
+		}
+	}
+	return E.inotifyfd;
+}
+
+char *editorBufferFilename(int i) {
+	return i == E.curbuf ? E.filename : E.buffers[i].filename;
+}
+
+void editorWatchFile(int i) {
+	char *filename = editorBufferFilename(i);
+	if (filename == NULL || editorWatchInit() == -1) {
+		return;
+	}
+	char *dir = strdup(filename);
+	char *slash = strrchr(dir, '/');
+	if (slash == NULL) {
+		strcpy(dir, ".");
+	}
+	else {
+		slash[slash == dir] = '\0';
+	}
+	int wd = inotify_add_watch(E.inotifyfd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MODIFY);
+	E.buffers[i].watch_wd = wd == -1 ? 0 : wd;
+	free(dir);
+}
+
+void editorDiskRecord(struct editorBuffer *b, int fd) {
+	struct stat st;
+	if (fstat(fd, &st) == 0) {
+		b->disk_ino = st.st_ino;
+		b->disk_size = st.st_size;
+		b->disk_mtime = st.st_mtim;
+	}
+	b->disk_changed = 0;
+	b->overwrite = 0;
+}
+
+int editorDiskChanged(struct editorBuffer *b, const char *filename) {
+	struct stat st;
+	if (stat(filename, &st) == -1) {
+		return 0;
+	}
+	return st.st_ino != b->disk_ino || st.st_size != b->disk_size ||
+		st.st_mtim.tv_sec != b->disk_mtime.tv_sec || st.st_mtim.tv_nsec != b->disk_mtime.tv_nsec;
+}
+
+/* moves a row number kept across replacing rows [lo, hi) by n new ones */
+void editorShiftRow(int *row, int lo, int hi, int n) {
+	if (*row >= hi) {
+		*row += n - (hi - lo);
+	}
+	else if (*row >= lo) {
+		*row = lo;
+	}
+}
+
+/* reloads the active buffer from disk, returns the number of rows replaced or -1 */
+int editorReload() {
+	int fd = open(E.filename, O_RDONLY);
+	if (fd == -1) {
+		return -1;
+	}
+	struct editorBuffer *b = &E.buffers[E.curbuf];
+	editorDiskRecord(b, fd);
+	char *text = malloc(b->disk_size + 1);
+	off_t size = 0;
+	int len;
+	while (size < b->disk_size && (len = read(fd, &text[size], b->disk_size - size)) > 0) {
+		size += len;
+	}
+	close(fd);
+
+	int n = 0, cap = 64;
+	char **lines = malloc(sizeof(char *) * cap);
+	int *lens = malloc(sizeof(int) * cap);
+	for (char *s = text, *end = text + size; s < end; ) {
+		char *nl = memchr(s, '\n', end - s);
+		char *stop = nl ? nl : end;
+		if (n == cap) {
+			cap *= 2;
+			lines = realloc(lines, sizeof(char *) * cap);
+			lens = realloc(lens, sizeof(int) * cap);
+		}
+		lines[n] = s;
+		lens[n] = stop - s;
+		while (lens[n] > 0 && s[lens[n] - 1] == '\r') lens[n]--;
+		n++;
+		s = nl ? nl + 1 : end;
+	}
+
+	int m = E.numrows;
+	uint64_t *oldh = malloc(sizeof(uint64_t) * (m + 1));
+	uint64_t *newh = malloc(sizeof(uint64_t) * (n + 1));
+	for (int j = 0; j < m; j++) {
+		oldh[j] = hashBytes(E.row[j].chars, E.row[j].size);
+	}
+	for (int j = 0; j < n; j++) {
+		newh[j] = hashBytes(lines[j], lens[j]);
+	}
+	int *runs = malloc(sizeof(int) * 3 * ((m < n ? m : n) + 2));
+	int nruns = lineDiff(oldh, m, newh, n, runs);
+	E.journal_suspend++;
+
+	/* replace the gaps between matched runs, last one first so indices stay valid */
+	int replaced = 0;
+	for (int r = nruns; r >= 0; r--) {
+		int alo = r > 0 ? runs[3 * (r - 1)] + runs[3 * (r - 1) + 2] : 0;
+		int blo = r > 0 ? runs[3 * (r - 1) + 1] + runs[3 * (r - 1) + 2] : 0;
+		int ahi = r < nruns ? runs[3 * r] : m;
+		int bhi = r < nruns ? runs[3 * r + 1] : n;
+		if (alo == ahi && blo == bhi) {
+			continue;
+		}
+		editorDelRows(alo, ahi - alo);
+		editorInsertRows(alo, &lines[blo], &lens[blo], bhi - blo);
+		/* the row below was highlighted after the old rows */
+		if (alo + bhi - blo < E.numrows) {
+			editorUpdateSyntax(&E.row[alo + bhi - blo]);
+		}
+		replaced += bhi - blo;
+
+		editorShiftRow(&E.cy, alo, ahi, bhi - blo);
+		editorShiftRow(&E.rowoff, alo, ahi, bhi - blo);
+		for (int i = 0; i < E.nviews; i++) {
+			struct editorView *v = &E.views[i];
+			if (i != E.curview && v->buf == E.curbuf) {
+				editorShiftRow(&v->cy, alo, ahi, bhi - blo);
+				editorShiftRow(&v->rowoff, alo, ahi, bhi - blo);
+			}
+		}
+	}
+
+	E.journal_suspend--;
+	free(runs);
+	free(oldh);
+	free(newh);
+	free(lines);
+	free(lens);
+	free(text);
+
+	if (E.cy > E.numrows) E.cy = E.numrows;
+	if (E.rowoff > E.numrows) E.rowoff = E.numrows;
+	E.rowseg = 0;
+	editorSnapCursor();
+	b->filesize = size;
+	E.dirty = 0;
+	editorJournalReset(b);
+	return replaced;
+}
+
+void editorReloadCheck(int i) {
+	struct editorBuffer *b = &E.buffers[i];
+	char *filename = editorBufferFilename(i);
+	if (b->follow || filename == NULL || !editorDiskChanged(b, filename)) {
+		return;
+	}
+	if (i == E.curbuf ? E.dirty : b->dirty) {
+		b->disk_changed = 1;
+		editorSetStatusMessage("%.20s changed on disk", filename);
+		return;
+	}
+
+	int prev = E.curbuf;
+	if (i != prev) {
+		editorBufferStore();
+		editorBufferLoad(i);
+	}
+	int replaced = editorReload();
+	if (replaced >= 0) {
+		editorSetStatusMessage("Reloaded %.20s, %d lines changed", E.filename, replaced);
+	}
+	if (i != prev) {
+		editorBufferStore();
+		editorBufferLoad(prev);
+	}
+}
+
+void editorReloadPoll() {
+	for (int i = 0; i < E.nbuffers; i++) {
+		if (E.buffers[i].reload_pending) {
+			E.buffers[i].reload_pending = 0;
+			editorReloadCheck(i);
+		}
+	}
+	editorRequestFrame();
+}
+
+void editorWatchEvents() {
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	int len;
+	int follow = 0, reload = 0;
+	while ((len = read(E.inotifyfd, buf, sizeof(buf))) > 0) {
+		for (char *p = buf; p < buf + len; ) {
+			struct inotify_event *ev = (struct inotify_event *) p;
+			for (int i = 0; i < E.nbuffers; i++) {
+				struct editorBuffer *b = &E.buffers[i];
+				char *filename = editorBufferFilename(i);
+				if (b->follow && b->follow_wd == ev->wd) {
+					b->follow_pending = 1;
+					follow = 1;
+				}
+				else if (!b->follow && b->watch_wd == ev->wd && ev->len && filename) {
+					char *base = strrchr(filename, '/');
+					if (strcmp(ev->name, base ? base + 1 : filename) == 0) {
+						b->reload_pending = 1;
+						reload = 1;
+					}
+				}
+			}
+			p += sizeof(struct inotify_event) + ev->len;
+		}
+	}
+
+	if (follow && !E.follow_scheduled) {
+		E.follow_scheduled = 1;
+		editorSchedule(editorFollowPoll, 1000 / KB_MAX_FPS);
+	}
+	/* wait for the writer to settle before comparing */
+	if (reload) {
+		editorSchedule(editorReloadPoll, KB_RELOAD_DELAY_MS);
+	}
+}
+
+/*** journal ***/
+
+/*
+ * Edits are logged to a swap file next to the file, ".NAME.kbswp", so kb
+ * can replay them when the file is opened after a crash. Row operations
+ * only append records to the buffer's journal_buf; a timer writes the
+ * batch and fdatasyncs it KB_JOURNAL_FLUSH_MS later, so typing never
+ * waits for the disk.
+ *
+ * The swap file is KB_JOURNAL_MAGIC followed by records: a 32-bit payload
+ * length, the CRC-32 of the payload, then the payload, an opcode byte and
+ * its fields. The first record holds the size and mtime of the file the
+ * edits apply to. Replay stops at the first record that is short or fails
+ * its checksum, which drops a write torn by the crash. A journal grown past
+ * KB_JOURNAL_COMPACT_MB and twice the text is rewritten as one snapshot of
+ * the rows, and so is the journal of a modified buffer that follow mode
+ * appended to, against the grown file. Saving, reloading or quitting
+ * removes it. If the swap file cannot be written, the buffer is not
+ * journaled again until it is saved, so no swap file is left that misses
+ * some of the edits.
+ */
+char *editorJournalPath(const char *filename) {
+	const char *slash = strrchr(filename, '/');
+	int dirlen = slash ? slash - filename + 1 : 0;
+	char *path = malloc(strlen(filename) + 8);
+	memcpy(path, filename, dirlen);
+	sprintf(&path[dirlen], ".%s.kbswp", &filename[dirlen]);
+	return path;
+}
+
+int editorJournaling() {
+	return E.filename != NULL && E.journal_suspend == 0 && !E.buffers[E.curbuf].journal_broken;
+}
+
+/* reserves a record with a size byte payload after the opcode, returns the payload */
+char *editorJournalRecord(struct editorBuffer *b, int op, int size) {
+	int need = 9 + size;
+	if (b->journal_len + need > b->journal_cap) {
+		b->journal_cap = b->journal_cap * 2 > b->journal_len + need ? b->journal_cap * 2 : b->journal_len + need + 4096;
+		b->journal_buf = realloc(b->journal_buf, b->journal_cap);
+	}
+	char *rec = &b->journal_buf[b->journal_len];
+	rec[8] = op;
+	return &rec[9];
+}
+
+/* fills in length and checksum of the record at rec */
+int editorJournalFrame(char *rec, int size) {
+	uint32_t len = size + 1;
+	uint32_t crc = crc32Bytes(0, &rec[8], len);
+	memcpy(rec, &len, 4);
+	memcpy(&rec[4], &crc, 4);
+	return 8 + len;
+}
+
+void editorJournalFlush();
+
+void editorJournalCommit(struct editorBuffer *b, int size) {
+	b->journal_len += editorJournalFrame(&b->journal_buf[b->journal_len], size);
+	if (!E.journal_scheduled) {
+		E.journal_scheduled = 1;
+		editorSchedule(editorJournalFlush, KB_JOURNAL_FLUSH_MS);
+	}
+}
+
+char *editorJournalPut(char *p, int v) {
+	memcpy(p, &v, 4);
+	return p + 4;
+}
+
+void editorJournalInsert(int at, char **lines, int *lens, int n) {
+	if (!editorJournaling()) {
+		return;
+	}
+	struct editorBuffer *b = &E.buffers[E.curbuf];
+	int size = 8;
+	for (int j = 0; j < n; j++) {
+		size += 4 + lens[j];
+	}
+	char *p = editorJournalRecord(b, JOURNAL_INSERT, size);
+	p = editorJournalPut(p, at);
+	p = editorJournalPut(p, n);
+	for (int j = 0; j < n; j++) {
+		p = editorJournalPut(p, lens[j]);
+		memcpy(p, lines[j], lens[j]);
+		p += lens[j];
+	}
+	editorJournalCommit(b, size);
+}
+
+void editorJournalDelete(int at, int n) {
+	if (!editorJournaling()) {
+		return;
+	}
+	struct editorBuffer *b = &E.buffers[E.curbuf];
+	char *p = editorJournalRecord(b, JOURNAL_DELETE, 8);
+	p = editorJournalPut(p, at);
+	editorJournalPut(p, n);
+	editorJournalCommit(b, 8);
+}
+
+/* row at had del chars at col replaced by len bytes of s */
+void editorJournalSplice(int at, int col, int del, char *s, int len) {
+	if (!editorJournaling()) {
+		return;
+	}
+	struct editorBuffer *b = &E.buffers[E.curbuf];
+	char *p = editorJournalRecord(b, JOURNAL_SPLICE, 12 + len);
+	p = editorJournalPut(p, at);
+	p = editorJournalPut(p, col);
+	p = editorJournalPut(p, del);
+	if (len > 0) {
+		memcpy(p, s, len);
+	}
+	editorJournalCommit(b, 12 + len);
+}
+
+/* magic and base record of b's journal, returns their length */
+int editorJournalHeader(struct editorBuffer *b, char *out) {
+	int64_t base[3] = { b->journal_base_size, b->journal_base_mtime.tv_sec, b->journal_base_mtime.tv_nsec };
+	memcpy(out, KB_JOURNAL_MAGIC, 8);
+	out[16] = JOURNAL_BASE;
+	memcpy(&out[17], base, sizeof(base));
+	return 8 + editorJournalFrame(&out[8], sizeof(base));
+}
+
+int editorJournalWrite(int fd, char *buf, int len) {
+	while (len > 0) {
+		int n = write(fd, buf, len);
+		if (n == -1) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* forgets the journal of b; its rows now match the file as last read or written */
+void editorJournalReset(struct editorBuffer *b) {
+	if (b->journal_open) {
+		close(b->journal_fd);
+		unlink(b->journal_path);
+		b->journal_open = 0;
+	}
+	free(b->journal_path);
+	b->journal_path = NULL;
+	b->journal_len = 0;
+	b->journal_size = 0;
+	b->journal_base_size = b->disk_size;
+	b->journal_base_mtime = b->disk_mtime;
+	b->journal_rebase = 0;
+	b->journal_broken = 0;
+}
+
+/* removes the swap file of b after a failed write and stops journaling it until it is saved */
+void editorJournalFail(struct editorBuffer *b) {
+	editorSetStatusMessage("Can't write swap file: %s; not journaling until saved", strerror(errno));
+	editorJournalReset(b);
+	b->journal_broken = 1;
+}
+
+/*
+ * Rewrites the journal of buffer i as a snapshot of its rows, next to it
+ * and renamed over it. Returns -1 and leaves the old swap file alone if
+ * that fails.
+ */
+int editorJournalCompact(int i) {
+	struct editorBuffer *b = &E.buffers[i];
+	erow *rows = i == E.curbuf ? E.row : b->row;
+	int numrows = i == E.curbuf ? E.numrows : b->numrows;
+
+	char *tmp = malloc(strlen(b->journal_path) + 5);
+	if (tmp == NULL) {
+		return -1;
+	}
+	char header[64];
+	b->journal_len = 0;
+	editorJournalRecord(b, JOURNAL_CLEAR, 0);
+	editorJournalCommit(b, 0);
+	for (int j = 0; j < numrows; ) {
+		int n = 0, size = 8;
+		while (j + n < numrows && (n == 0 || size < (1 << 20))) {
+			size += 4 + rows[j + n].size;
+			n++;
+		}
+		char *p = editorJournalRecord(b, JOURNAL_INSERT, size);
+		p = editorJournalPut(p, j);
+		p = editorJournalPut(p, n);
+		for (int k = j; k < j + n; k++) {
+			p = editorJournalPut(p, rows[k].size);
+			memcpy(p, rows[k].chars, rows[k].size);
+			p += rows[k].size;
+		}
+		editorJournalCommit(b, size);
+		j += n;
+	}
+
+	sprintf(tmp, "%s.new", b->journal_path);
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	int len = editorJournalHeader(b, header);
+	int ok = fd != -1 && editorJournalWrite(fd, header, len) == 0 &&
+		editorJournalWrite(fd, b->journal_buf, b->journal_len) == 0 &&
+		fdatasync(fd) == 0 && rename(tmp, b->journal_path) == 0;
+	if (ok) {
+		if (b->journal_open) {
+			close(b->journal_fd);
+		}
+		b->journal_open = 1;
+		b->journal_fd = fd;
+		b->journal_size = len + b->journal_len;
+	}
+	else if (fd != -1) {
+		close(fd);
+		unlink(tmp);
+	}
+	free(tmp);
+	b->journal_len = 0;
+	return ok ? 0 : -1;
+}
+
+/* creates the swap file of b and writes its header, unless it is open already */
+int editorJournalOpen(struct editorBuffer *b, const char *filename) {
+	if (b->journal_open) {
+		return 0;
+	}
+	char header[64];
+	b->journal_path = editorJournalPath(filename);
+	b->journal_fd = open(b->journal_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (b->journal_fd == -1) {
+		return -1;
+	}
+	b->journal_open = 1;
+	b->journal_size = editorJournalHeader(b, header);
+	return editorJournalWrite(b->journal_fd, header, b->journal_size);
+}
+
+void editorJournalFlush() {
+	E.journal_scheduled = 0;
+	for (int i = 0; i < E.nbuffers; i++) {
+		struct editorBuffer *b = &E.buffers[i];
+		char *filename = editorBufferFilename(i);
+		if (b->journal_len == 0 || filename == NULL) {
+			continue;
+		}
+
+		if (b->journal_rebase) {
+			if (b->journal_path == NULL) {
+				b->journal_path = editorJournalPath(filename);
+			}
+			b->journal_rebase = 0;
+			if (editorJournalCompact(i) == -1) {
+				editorJournalFail(b);
+			}
+		}
+		else if (editorJournalOpen(b, filename) == -1 ||
+			editorJournalWrite(b->journal_fd, b->journal_buf, b->journal_len) == -1 || fdatasync(b->journal_fd) == -1) {
+			editorJournalFail(b);
+		}
+		else {
+			b->journal_size += b->journal_len;
+			b->journal_len = 0;
+
+			off_t text = 0;
+			int numrows = i == E.curbuf ? E.numrows : b->numrows;
+			erow *rows = i == E.curbuf ? E.row : b->row;
+			if (b->journal_size > ((off_t) KB_JOURNAL_COMPACT_MB << 20)) {
+				for (int j = 0; j < numrows; j++) {
+					text += rows[j].size + 1;
+				}
+				if (b->journal_size > 2 * text) {
+					editorJournalCompact(i);
+				}
+			}
+		}
+		if (b->journal_cap > (1 << 20)) {
+			free(b->journal_buf);
+			b->journal_buf = NULL;
+			b->journal_cap = 0;
+		}
+	}
+}
+
+/* applies one journal record to the active buffer, returns -1 if it does not fit the rows */
+int editorJournalApply(char *p, int len) {
+	int v[3] = { 0, 0, 0 };
+	int nargs = p[0] == JOURNAL_SPLICE ? 3 : (p[0] == JOURNAL_CLEAR ? 0 : 2);
+	if (p[0] == JOURNAL_BASE || len < 1 + 4 * nargs) {
+		return -1;
+	}
+	memcpy(v, &p[1], 4 * nargs);
+	char *data = &p[1 + 4 * nargs], *end = &p[len];
+
+	switch (p[0]) {
+		case JOURNAL_CLEAR:
+			editorDelRows(0, E.numrows);
+			E.cy = 0;
+			break;
+
+		case JOURNAL_DELETE:
+			if (v[0] < 0 || v[1] < 0 || v[1] > E.numrows - v[0]) return -1;
+			editorDelRows(v[0], v[1]);
+			E.cy = v[0];
+			break;
+
+		case JOURNAL_INSERT: {
+			if (v[0] < 0 || v[0] > E.numrows || v[1] < 0 || v[1] > (end - data) / 4) return -1;
+			char **lines = malloc(sizeof(char *) * (v[1] + 1));
+			int *lens = malloc(sizeof(int) * (v[1] + 1));
+			int ok = 1;
+			for (int j = 0; j < v[1] && ok; j++) {
+				ok = end - data >= 4;
+				if (ok) {
+					memcpy(&lens[j], data, 4);
+					lines[j] = data + 4;
+					ok = lens[j] >= 0 && lens[j] <= end - data - 4;
+					data += 4 + (ok ? lens[j] : 0);
+				}
+			}
+			if (ok) {
+				editorInsertRows(v[0], lines, lens, v[1]);
+				E.cy = v[0] + v[1] - 1;
+				E.cx = v[1] > 0 ? lens[v[1] - 1] : 0;
+			}
+			free(lines);
+			free(lens);
+			return ok ? 0 : -1;
+		}
+
+		case JOURNAL_SPLICE: {
+			int n = end - data;
+			if (v[0] < 0 || v[0] >= E.numrows) return -1;
+			erow *row = &E.row[v[0]];
+			if (v[1] < 0 || v[1] > row->size || v[2] < 0 || v[2] > row->size - v[1]) return -1;
+			row->chars = poolUnshare(row->chars);
+			if (n > v[2]) {
+				row->chars = poolRealloc(row->chars, row->size - v[2] + n + 1);
+			}
+			memmove(&row->chars[v[1] + n], &row->chars[v[1] + v[2]], row->size - v[1] - v[2] + 1);
+			memcpy(&row->chars[v[1]], data, n);
+			row->size += n - v[2];
+			editorUpdateRow(row);
+			E.dirty++;
+			E.cy = v[0];
+			E.cx = v[1] + n;
+			return 0;
+		}
+
+		default:
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * Replays the swap file of the buffer just opened, if a crash left one.
+ * A swap file written against a different version of the file is moved
+ * aside to NAME.kbswp~ rather than applied. Returns the edits replayed.
+ */
+int editorJournalRecover() {
+	struct editorBuffer *b = &E.buffers[E.curbuf];
+	editorJournalReset(b);
+	char *path = editorJournalPath(E.filename);
+	int fd = open(path, O_RDWR | O_CLOEXEC);
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		if (fd != -1) close(fd);
+		free(path);
+		return 0;
+	}
+
+	char *buf = malloc(st.st_size + 1);
+	off_t size = 0;
+	int len;
+	while (size < st.st_size && (len = read(fd, &buf[size], st.st_size - size)) > 0) {
+		size += len;
+	}
+
+	char header[64];
+	int hlen = editorJournalHeader(b, header);
+	int edits = -1;
+	off_t off = hlen;
+	if (size >= hlen && memcmp(buf, header, hlen) == 0) {
+		edits = 0;
+		E.journal_suspend++;
+		while (size - off >= 8) {
+			uint32_t reclen, crc;
+			memcpy(&reclen, &buf[off], 4);
+			memcpy(&crc, &buf[off + 4], 4);
+			if (reclen == 0 || reclen > size - off - 8 || crc32Bytes(0, &buf[off + 8], reclen) != crc) {
+				break;
+			}
+			if (editorJournalApply(&buf[off + 8], reclen) == -1) {
+				break;
+			}
+			edits++;
+			off += 8 + reclen;
+		}
+		E.journal_suspend--;
+	}
+	free(buf);
+
+	if (edits <= 0) {
+		close(fd);
+		if (edits == -1 && size > 0) {
+			char *aside = malloc(strlen(path) + 2);
+			sprintf(aside, "%s~", path);
+			rename(path, aside);
+			editorSetStatusMessage("Swap file of %.20s is for another version, moved to %.30s", E.filename, aside);
+			free(aside);
+		}
+		else {
+			unlink(path);
+		}
+		free(path);
+		return 0;
+	}
+
+	/* keep appending after the last good record */
+	ftruncate(fd, off);
+	lseek(fd, off, SEEK_SET);
+	b->journal_open = 1;
+	b->journal_fd = fd;
+	b->journal_path = path;
+	b->journal_size = off;
+	E.dirty = edits;
+	if (E.cy > E.numrows) E.cy = E.numrows;
+	editorSnapCursor();
+	editorSetStatusMessage("Recovered %d edits of %.20s from its swap file", edits, E.filename);
+	return edits;
+}
+
+/*** find ***/
+
+void editorFindCallback(char *query, int key) {
+	static int last_match = -1;
+	static int direction = 1;
+
+	static int saved_hl_line;
+	static char *saved_hl = NULL;
+
+	if (saved_hl) {
+		memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
+		editorMarkEdit(saved_hl_line, saved_hl_line);
+		free(saved_hl);
+		saved_hl = NULL;
+	}
+
+	if (key == '\r' || key == '\x1b') {
+		last_match = -1;
+		direction = 1;
+		return;
+	}
+	else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
+		direction = 1;
+	}
+	else if (key == ARROW_LEFT || key == ARROW_UP) {
+		direction = -1;
+	}
+	else {
+		last_match = -1;
+		direction = 1;
+	}
+
+	if (last_match == -1) {
+		direction = 1;
+	}
+	int current = last_match;
+	for (int i = 0; i < E.numrows; i++) {
+		current += direction;
+		if (current == -1) {
+			current = E.numrows - 1;
+		}
+		else if (current == E.numrows) {
+			current = 0;
+		}
+
+		erow *row = &E.row[current];
+		char *match = strstr(row->render, query);
+		if (match) {
+			last_match = current;
+			E.cy = current;
+			E.cx = editorRowBxToCx(row, match - row->render);
+			E.rowoff = E.numrows;
+
+			saved_hl_line = current;
+			saved_hl = malloc(row->rsize);
+			memcpy(saved_hl, row->hl, row->rsize);
+			memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
+			editorMarkEdit(current, current);
+			break;
+		}
+	}
+}
+
+void editorFind() {
+	int saved_cx = E.cx;
+	int saved_cy = E.cy;
+	int saved_coloff = E.coloff;
 	int saved_rowoff = E.rowoff;
+	int saved_rowseg = E.rowseg;
+
+	char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallback);
+
+	if (query) {
+		free(query);
+	}
+	else {
+		E.cx = saved_cx;
+		E.cy = saved_cy;
+		E.coloff = saved_coloff;
+		E.rowoff = saved_rowoff;
+		E.rowseg = saved_rowseg;
+	}
+}
+
+/*** gutter ***/
+
+/*
+ * The gutter is wide enough for the largest line number, but never narrower
+ * than GUTTER_MIN_DIGITS. The numbers of the rows on screen are cached in
+ * E.gutterbuf, E.gutter bytes per row starting at file row E.gutterfirst,
+ * and only rebuilt when the view or the number of rows changes.
+ */
+void editorUpdateGutter() {
+	int digits = 1;
+	for (int n = E.numrows; n >= 10; n /= 10) {
+		digits++;
+	}
+	if (digits < GUTTER_MIN_DIGITS) {
+		digits = GUTTER_MIN_DIGITS;
+	}
+
+	E.gutter = digits + 2;
+	E.screencols = E.viewcols - E.gutter;
+	if (E.screencols < 1) E.screencols = 1;
+}
+
+void editorGutterBuild() {
+	int digits = E.gutter - 2;
+	E.gutterbuf = realloc(E.gutterbuf, E.screenrows * E.gutter + 1);
+	if (E.gutterbuf == NULL) die("realloc");
+
+	char *s = E.gutterbuf;
+	toString(s, E.rowoff + 1, digits);
+	s[digits] = ' ';
+	s[digits + 1] = ' ';
+	/* every following entry is the previous one plus one */
+	for (int y = 1; y < E.screenrows; y++) {
+		char *next = s + E.gutter;
+		memcpy(next, s, E.gutter);
+		int j = digits - 1;
+		while (j >= 0 && next[j] == '9') {
+			next[j--] = '0';
+		}
+		if (j >= 0) {
+			next[j]++;
+		}
+		s = next;
+	}
+
+	E.gutterfirst = E.rowoff;
+	E.gutterrows = E.screenrows;
+	E.gutternumrows = E.numrows;
+}
+
+char *editorGutterLine(int filerow) {
+	if (E.gutterfirst != E.rowoff || E.gutterrows != E.screenrows || E.gutternumrows != E.numrows) {
+		editorGutterBuild();
+	}
+	if (filerow - E.gutterfirst >= E.gutterrows) {
+		/* below a fold the rows on screen are no longer consecutive */
+		static char buf[32];
+		toString(buf, filerow + 1, E.gutter - 2);
+		buf[E.gutter - 2] = ' ';
+		buf[E.gutter - 1] = ' ';
+		return buf;
+	}
+	return &E.gutterbuf[(filerow - E.gutterfirst) * E.gutter];
+}
+
+/*** append buffer ***/
+
+struct abuf {
+	char *b;
+	int len;
+};
+
+#define ABUF_INIT {NULL, 0}
+
+void abAppend(struct abuf *ab, const char *s, int len) {
+	char *new = realloc(ab->b, ab->len + len);
+
+	if (new == NULL) return;
+	memcpy(&new[ab->len], s, len);
+	ab->b = new;
+	ab->len += len;
+}
+
+void abAppendSpaces(struct abuf *ab, int n) {
+	static const char spaces[] = "                ";
+	while (n > 0) {
+		int len = n < (int) sizeof(spaces) - 1 ? n : (int) sizeof(spaces) - 1;
+		abAppend(ab, spaces, len);
+		n -= len;
+	}
+}
+
+void abFree(struct abuf *ab) {
+	free(ab->b);
+}
+
+/*** views ***/
+
+/*
+ * The screen is split into views laid out by a binary tree of splits. Every
+ * view has its own cursor and scroll position over one of the buffers; the
+ * active view is unpacked into E like the active buffer, with its size in
+ * E.screenrows and E.viewcols.
+ */
+void editorLayoutSplit(int node, int top, int left, int rows, int cols) {
+	struct editorSplit *sp = &E.splits[node];
+	sp->top = top;
+	sp->left = left;
+	sp->rows = rows;
+	sp->cols = cols;
+	if (sp->kind == SPLIT_VIEW) {
+		struct editorView *v = &E.views[sp->view];
+		v->top = top;
+		v->left = left;
+		v->rows = rows;
+		v->cols = cols;
+	}
+	else if (sp->kind == SPLIT_HORIZONTAL) {
+		int upper = (rows - 1) / 2;
+		editorLayoutSplit(sp->a, top, left, upper, cols);
+		editorLayoutSplit(sp->b, top + upper + 1, left, rows - upper - 1, cols);
+	}
+	else {
+		int leftcols = (cols - 1) / 2;
+		editorLayoutSplit(sp->a, top, left, rows, leftcols);
+		editorLayoutSplit(sp->b, top, left + leftcols + 1, rows, cols - leftcols - 1);
+	}
+}
+
+void editorLayout() {
+	editorLayoutSplit(E.root, 0, 0, E.winrows, E.wincols);
+}
+
+void editorViewStore() {
+	struct editorView *v = &E.views[E.curview];
+	v->buf = E.curbuf;
+	v->cx = E.cx;
+	v->cy = E.cy;
+	v->rowoff = E.rowoff;
+	v->rowseg = E.rowseg;
+	v->coloff = E.coloff;
+}
+
+void editorViewLoad(int i) {
+	struct editorView *v = &E.views[i];
+	E.curview = i;
+	if (v->buf != E.curbuf) {
+		editorBufferStore();
+		editorBufferLoad(v->buf);
+	}
+	E.cx = v->cx;
+	E.cy = v->cy;
+	E.rowoff = v->rowoff;
+	E.rowseg = v->rowseg;
+	E.coloff = v->coloff;
+	E.screenrows = v->rows > 0 ? v->rows : 1;
+	E.viewcols = v->cols > 0 ? v->cols : 1;
+	editorUpdateGutter();
+
+	/* another view may have deleted rows under the cursor */
+	if (E.cy > E.numrows) {
+		E.cy = E.numrows;
+	}
+	editorSnapCursor();
+}
+
+int editorSplitNew() {
+	int i = 0;
+	while (i < E.nsplits && E.splits[i].kind != SPLIT_FREE) {
+		i++;
+	}
+	if (i == E.nsplits) {
+		E.splits = realloc(E.splits, sizeof(struct editorSplit) * ++E.nsplits);
+	}
+	E.splits[i].kind = SPLIT_VIEW;
+	return i;
+}
+
+int editorSplitOf(int view) {
+	for (int i = 0; i < E.nsplits; i++) {
+		if (E.splits[i].kind == SPLIT_VIEW && E.splits[i].view == view) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+void editorSplitView(int kind) {
+	struct editorView *v = &E.views[E.curview];
+	int min = E.gutter + 2;
+	if ((kind == SPLIT_HORIZONTAL && v->rows < 3) || (kind == SPLIT_VERTICAL && v->cols < 2 * min + 1)) {
+		editorSetStatusMessage("View too small to split");
+		return;
+	}
+	editorViewStore();
+
+	E.views = realloc(E.views, sizeof(struct editorView) * (E.nviews + 1));
+	int view = E.nviews++;
+	E.views[view] = E.views[E.curview];
+	E.views[view].lines = NULL;
+	E.views[view].nlines = 0;
+
+	int node = editorSplitOf(E.curview);
+	int a = editorSplitNew();
+	int b = editorSplitNew();
+	E.splits[a] = E.splits[node];
+	E.splits[b].kind = SPLIT_VIEW;
+	E.splits[b].view = view;
+	E.splits[node].kind = kind;
+	E.splits[node].a = a;
+	E.splits[node].b = b;
+
+	editorLayout();
+	editorViewLoad(view);
+}
+
+/* leaves of the layout tree, top to bottom and left to right */
+int editorSplitLeaves(int node, int *order, int n) {
+	if (E.splits[node].kind == SPLIT_VIEW) {
+		order[n] = E.splits[node].view;
+		return n + 1;
+	}
+	n = editorSplitLeaves(E.splits[node].a, order, n);
+	return editorSplitLeaves(E.splits[node].b, order, n);
+}
+
+void editorNextView() {
+	if (E.nviews < 2) {
+		return;
+	}
+	int *order = malloc(sizeof(int) * E.nviews);
+	editorSplitLeaves(E.root, order, 0);
+	int next = 0;
+	for (int i = 0; i < E.nviews; i++) {
+		if (order[i] == E.curview) {
+			next = order[(i + 1) % E.nviews];
+		}
+	}
+	free(order);
+
+	editorViewStore();
+	editorViewLoad(next);
+}
+
+void editorCloseView() {
+	if (E.nviews < 2) {
+		editorSetStatusMessage("Only one view");
+		return;
+	}
+	int leaf = editorSplitOf(E.curview);
+	int parent = 0;
+	for (int i = 0; i < E.nsplits; i++) {
+		int kind = E.splits[i].kind;
+		if ((kind == SPLIT_HORIZONTAL || kind == SPLIT_VERTICAL) && (E.splits[i].a == leaf || E.splits[i].b == leaf)) {
+			parent = i;
+		}
+	}
+	int sibling = (E.splits[parent].a == leaf) ? E.splits[parent].b : E.splits[parent].a;
+
+	/* the sibling takes over the parent's place in the tree */
+	E.splits[parent] = E.splits[sibling];
+	E.splits[sibling].kind = SPLIT_FREE;
+	E.splits[leaf].kind = SPLIT_FREE;
+
+	struct editorView *v = &E.views[E.curview];
+	for (int y = 0; y < v->nlines; y++) {
+		abFree(&v->lines[y]);
+	}
+	free(v->lines);
+	int last = --E.nviews;
+	if (E.curview != last) {
+		E.views[E.curview] = E.views[last];
+		E.splits[editorSplitOf(last)].view = E.curview;
+	}
+
+	editorLayout();
+	int *order = malloc(sizeof(int) * E.nviews);
+	editorSplitLeaves(parent, order, 0);
+	editorViewLoad(order[0]);
+	free(order);
+}
+
+/*** output ***/
+
+void editorScrollWrapped() {
+	E.coloff = 0;
+	if (E.wrapcols != E.screencols) {
+		E.wrapcols = E.screencols;
+	}
+	if (E.rowoff > E.numrows) {
+		E.rowoff = E.numrows;
+	}
+	editorWrapRefreshVisible();
+	if (E.rowoff >= E.numrows || E.rowseg >= E.row[E.rowoff].wrap_lines) {
+		E.rowseg = 0;
+	}
+
+	int cseg = 0;
+	if (E.cy < E.numrows) {
+		cseg = editorRowWrapSegment(&E.row[E.cy], E.rx - E.gutter, E.wrapcols);
+	}
+	if (E.cy < E.rowoff || (E.cy == E.rowoff && cseg < E.rowseg)) {
+		E.rowoff = E.cy;
+		E.rowseg = cseg;
+		return;
+	}
+
+	int top = editorWrapLineOf(E.rowoff, E.rowseg);
+	int cursor = editorWrapLineOf(E.cy, cseg);
+	if (cursor >= top + E.screenrows) {
+		editorWrapRowAt(cursor - E.screenrows + 1, &E.rowoff, &E.rowseg);
+		editorWrapRefreshVisible();
+	}
+}
+
+void editorScroll() {
+	editorUpdateGutter();
+	E.rx = E.gutter;
+	if (E.cy < E.numrows) {
+		E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+	}
+
+	/* a jump into a fold opens it, and the view never starts inside one */
+	if (E.nfolds > 0) {
+		editorFoldReveal(E.cy);
+		if (E.rowoff < E.numrows && E.row[E.rowoff].folded) {
+			E.rowoff = editorFoldRow(editorFoldLine(E.rowoff) - 1);
+		}
+	}
+
+	if (E.wrap) {
+		editorScrollWrapped();
+		return;
+	}
+
+	int top = editorFoldLine(E.rowoff);
+	int cursor = editorFoldLine(E.cy);
+	if (cursor < top) {
+		E.rowoff = E.cy;
+	}
+	if (cursor >= top + E.screenrows) {
+		E.rowoff = editorFoldRow(cursor - E.screenrows + 1);
+	}
+	if (E.rx - E.gutter < E.coloff) {
+		E.coloff = E.rx - E.gutter;
+	}
+	if (E.rx >= E.coloff + E.screencols + E.gutter) {
+		E.coloff = E.rx - E.screencols - E.gutter + 1;
+	}
+}
+
+/*
+ * E.shadow holds a hash of every screen line as it was last sent to the
+ * terminal, so a frame only rewrites the lines that changed. When the view
+ * moved by less than a screen, the text area is first shifted with a
+ * DECSTBM scroll region so the lines still on screen keep matching.
+ */
+void editorInvalidateScreen() {
+	E.shadowrows = E.winrows + 2;
+	E.shadow = realloc(E.shadow, sizeof(*E.shadow) * E.shadowrows);
+	if (E.shadow == NULL) die("realloc");
+	memset(E.shadow, 0, sizeof(*E.shadow) * E.shadowrows);
+	E.shadowtop = -1;
+}
+
+uint64_t editorHashLine(const char *s, int len) {
+	uint64_t h = hashBytes(s, len);
+	return h ? h : 1;
+}
+
+void editorScrollLines(struct abuf *ab, int top) {
+	int delta = top - E.shadowtop;
+	int n = delta > 0 ? delta : -delta;
+	if (E.shadowtop >= 0 && n > 0 && n < E.screenrows) {
+		char buf[32];
+		int len = snprintf(buf, sizeof(buf), "\x1b[1;%dr\x1b[%d%c\x1b[r",
+			E.screenrows, n, delta > 0 ? 'S' : 'T');
+		abAppend(ab, buf, len);
+
+		if (delta > 0) {
+			memmove(E.shadow, E.shadow + n, sizeof(*E.shadow) * (E.screenrows - n));
+			memset(E.shadow + E.screenrows - n, 0, sizeof(*E.shadow) * n);
+		}
+		else {
+			memmove(E.shadow + n, E.shadow, sizeof(*E.shadow) * (E.screenrows - n));
+			memset(E.shadow, 0, sizeof(*E.shadow) * n);
+		}
+	}
+	E.shadowtop = top;
+}
 
-	char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallback);
+void editorFlushLine(struct abuf *ab, int y, struct abuf *line) {
+	uint64_t h = editorHashLine(line->b, line->len);
+	if (E.shadow[y] != h) {
+		E.shadow[y] = h;
+		char buf[16];
+		int len = snprintf(buf, sizeof(buf), "\x1b[%d;1H", y + 1);
+		abAppend(ab, buf, len);
+		abAppend(ab, line->b, line->len);
+	}
+	line->len = 0;
+}
 
-	if (query) {
-		free(query);
+int editorDrawRowSlice(struct abuf *ab, erow *row, int startcol, int width) {
+	/* find the first character starting at or after startcol */
+	int k = 0, hi = row->ncols;
+	while (k < hi) {
+		int mid = (k + hi) / 2;
+		if (row->cols[mid].rx <= startcol) {
+			k = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	int bx = startcol, col = startcol;
+	if (k > 0) {
+		ecol *prev = &row->cols[k - 1];
+		if (startcol < prev->next_rx) {
+			if (startcol == prev->rx) {
+				bx = prev->bx;
+				k--;
+			}
+			else {
+				bx = prev->next_bx;
+				col = prev->next_rx;
+			}
+		}
+		else {
+			bx = prev->next_bx + (startcol - prev->next_rx);
+		}
+	}
+	for (int pad = startcol; pad < col; pad++) {
+		abAppend(ab, " ", 1);
+	}
+
+	char *c = row->render;
+	unsigned char *hl = row->hl;
+	int limit = startcol + width;
+	int current_color = -1;
+	int sel_lo, sel_hi, inverse = 0;
+	editorSelectionSpan(row, &sel_lo, &sel_hi);
+	int cur = editorCursorsOnRow(row), curbx = editorCursorsBx(row, cur);
+	while (bx < row->rsize && col < limit) {
+		int j = bx, len = 1, width = 1;
+		if (k < row->ncols && row->cols[k].bx == bx) {
+			len = row->cols[k].next_bx - bx;
+			width = row->cols[k].next_rx - row->cols[k].rx;
+			k++;
+		}
+		if (col + width > limit) {
+			break;
+		}
+		bx += len;
+		col += width;
+
+		while (curbx < j) {
+			curbx = editorCursorsBx(row, ++cur);
+		}
+		int mark = editorBracketMarked(row, j) || (j >= sel_lo && j < sel_hi) || j == curbx;
+		if (mark != inverse) {
+			abAppend(ab, mark ? "\x1b[7m" : "\x1b[27m", mark ? 4 : 5);
+			inverse = mark;
+		}
+		if (len == 1 && (iscntrl((unsigned char) c[j]) || ((unsigned char) c[j] & 0x80))) {
+			char sym = ((unsigned char) c[j] <= 26) ? '@' + c[j] : '?';
+			abAppend(ab, "\x1b[7m", 4);
+			abAppend(ab, &sym, 1);
+			abAppend(ab, "\x1b[m", 3);
+			inverse = 0;
+			if (current_color != -1) {
+				char buf[16];
+				int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
+				abAppend(ab, buf, clen);
+			}
+		}
+		else if (hl[j] == HL_NORMAL) {
+			if (current_color != -1) {
+				abAppend(ab, "\x1b[39m", 5);
+				current_color = -1;
+			}
+			abAppend(ab, &c[j], len);
+		}
+		else {
+			int color = editorSyntaxToColor(hl[j]);
+			if (color != current_color) {
+				current_color = color;
+				char buf[16];
+				int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
+				abAppend(ab, buf, clen);
+			}
+			abAppend(ab, &c[j], len);
+		}
+	}
+	if (inverse) {
+		abAppend(ab, "\x1b[27m", 5);
+	}
+	abAppend(ab, "\x1b[39m", 5);
+
+	/* an extra cursor at the end of the row */
+	while (curbx < bx) {
+		curbx = editorCursorsBx(row, ++cur);
+	}
+	if (bx == row->rsize && curbx == bx && col < limit) {
+		abAppend(ab, "\x1b[7m \x1b[27m", 10);
+		col++;
+	}
+	return col - startcol;
+}
+
+/* " [+N lines]" after a row that heads a fold, cut to room columns */
+int editorDrawFoldMarker(struct abuf *ab, int filerow, int next, int room) {
+	int hidden = next - filerow - 1;
+	if (hidden <= 0 || room <= 0) {
+		return 0;
+	}
+	char buf[32];
+	int len = snprintf(buf, sizeof(buf), " [+%d lines]", hidden);
+	if (len > room) {
+		len = room;
+	}
+	abAppend(ab, "\x1b[36m", 5);
+	abAppend(ab, buf, len);
+	abAppend(ab, "\x1b[39m", 5);
+	return len;
+}
+
+int editorDrawWelcome(struct abuf *ab) {
+	char welcome[80];
+	int welcomelen = snprintf(welcome, sizeof(welcome),
+		"KB editor -- version %s", KB_VERSION);
+	if (welcomelen > E.screencols) {
+		welcomelen = E.screencols;
+	}
+	int padding = (E.screencols - welcomelen) / 2;
+	int width = padding + welcomelen;
+	if (padding) {
+		abAppend(ab, "~", 1);
+		padding--;
+	}
+	while (padding--) {
+		abAppend(ab, " ", 1);
+	}
+	abAppend(ab, welcome, welcomelen);
+	return width;
+}
+
+/*
+ * Draws the rows of the active view into rows[0 .. E.screenrows - 1], each
+ * exactly E.viewcols wide unless edge says the view reaches the right edge
+ * of the terminal. Returns the first file row below the view.
+ */
+int editorDrawRows(struct abuf *rows, int edge) {
+	int filerow = E.rowoff;
+	int seg = E.wrap ? E.rowseg : 0;
+	for (int y = 0; y < E.screenrows; y++) {
+		struct abuf *line = &rows[y];
+		int width;
+		line->len = 0;
+		if (filerow >= E.numrows) {
+			if (E.numrows == 0 && y == E.screenrows / 3) {
+				width = editorDrawWelcome(line);
+			}
+			else {
+				abAppend(line, "~", 1);
+				width = 1;
+			}
+		}
+		else if (E.wrap) {
+			erow *row = &E.row[filerow];
+			if (seg == 0) {
+				abAppend(line, editorGutterLine(filerow), E.gutter);
+			}
+			else {
+				abAppendSpaces(line, E.gutter);
+			}
+			int start = editorRowWrapStart(row, seg, E.wrapcols);
+			width = E.gutter + editorDrawRowSlice(line, row, start, editorRowWrapNext(row, start, E.wrapcols) - start);
+			if (++seg >= row->wrap_lines) {
+				int next = editorFoldNext(filerow);
+				width += editorDrawFoldMarker(line, filerow, next, E.gutter + E.screencols - width);
+				seg = 0;
+				filerow = next;
+			}
+		}
+		else {
+			int next = editorFoldNext(filerow);
+			abAppend(line, editorGutterLine(filerow), E.gutter);
+			width = E.gutter + editorDrawRowSlice(line, &E.row[filerow], E.coloff, E.screencols);
+			width += editorDrawFoldMarker(line, filerow, next, E.gutter + E.screencols - width);
+			filerow = next;
+		}
+
+		if (edge) {
+			abAppend(line, "\x1b[K", 3);
+		}
+		else {
+			abAppendSpaces(line, E.viewcols - width);
+		}
+	}
+	return filerow;
+}
+
+/*
+ * A view keeps the rows it drew last time and reuses them as long as its
+ * viewKey is unchanged and no edit since the last frame touched the file
+ * rows it shows.
+ */
+void editorDrawView(struct editorView *v, struct abuf *lines) {
+	struct viewKey key = {E.curbuf, E.rowoff, E.rowseg, E.coloff, E.screenrows, E.viewcols, E.gutter, E.wrap};
+	if (v->nlines != E.screenrows || memcmp(&key, &v->key, sizeof(key)) != 0 || (E.edithi >= E.rowoff && E.editlo <= v->lastrow)) {
+		if (v->nlines < E.screenrows) {
+			v->lines = realloc(v->lines, sizeof(struct abuf) * E.screenrows);
+			for (int y = v->nlines; y < E.screenrows; y++) {
+				v->lines[y].b = NULL;
+				v->lines[y].len = 0;
+			}
+		}
+		else {
+			for (int y = E.screenrows; y < v->nlines; y++) {
+				abFree(&v->lines[y]);
+			}
+		}
+		v->nlines = E.screenrows;
+		v->key = key;
+		v->lastrow = editorDrawRows(v->lines, v->left + v->cols >= E.wincols);
+	}
+	for (int y = 0; y < v->nlines; y++) {
+		abAppend(&lines[v->top + y], v->lines[y].b, v->lines[y].len);
+	}
+}
+
+/* appends every view below node to lines[], in left to right order per line */
+void editorDrawSplit(int node, struct abuf *lines) {
+	struct editorSplit *sp = &E.splits[node];
+	if (sp->kind == SPLIT_VIEW) {
+		struct editorView *v = &E.views[sp->view];
+		if (v->rows <= 0 || v->cols <= 0) {
+			v->nlines = 0;
+			return;
+		}
+		editorViewLoad(sp->view);
+		editorScroll();
+		editorDrawView(v, lines);
+		editorViewStore();
+		return;
+	}
+
+	editorDrawSplit(sp->a, lines);
+	struct editorSplit *b = &E.splits[sp->b];
+	if (sp->kind == SPLIT_HORIZONTAL) {
+		if (b->top > 0) {
+			struct abuf *line = &lines[b->top - 1];
+			abAppend(line, "\x1b[7m", 4);
+			abAppendSpaces(line, b->cols);
+			abAppend(line, "\x1b[m", 3);
+		}
+	}
+	else if (b->left > 0) {
+		for (int y = b->top; y < b->top + b->rows; y++) {
+			abAppend(&lines[y], "\x1b[7m \x1b[m", 8);
+		}
+	}
+	editorDrawSplit(sp->b, lines);
+}
+
+void editorDrawStatusBar(struct abuf *ab) {
+	abAppend(ab, "\x1b[7m", 4);
+	char status[80], rstatus[80];
+	int len = 0;
+	if (E.nbuffers > 1) {
+		len = snprintf(status, sizeof(status), "[%d/%d] ", E.curbuf + 1, E.nbuffers);
+	}
+	len += snprintf(&status[len], sizeof(status) - len, "%.20s - %d lines %s", E.filename ? E.filename : "[No Name]", E.numrows, E.dirty ? "(modified)" : "");
+	int rlen = snprintf(rstatus, sizeof(rstatus), "%s%s | %d:%d", E.recording ? "rec | " : "", E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, E.rx - E.gutter + 1);
+	if (len > E.wincols) {
+		len = E.wincols;
+	}
+	abAppend(ab, status, len);
+	while (len < E.wincols) {
+		if (E.wincols - len == rlen) {
+			abAppend(ab, rstatus, rlen);
+			break;
+		}
+		else {
+			abAppend(ab, " ", 1);
+			len++;
+		}
+	}
+	abAppend(ab, "\x1b[m", 3);
+}
+
+void editorDrawMessageBar(struct abuf *ab) {
+	abAppend(ab, "\x1b[K", 3);
+	int msglen = strlen(E.statusmsg);
+	if (msglen > E.wincols) {
+		msglen = E.wincols;
+	}
+	if (msglen && time(NULL) - E.statusmsg_time < 5) {
+		abAppend(ab, E.statusmsg, msglen);
+	}
+}
+
+void editorRefreshScreen() {
+	/* a macro being replayed is drawn once, when it is over */
+	if (E.macro_pos >= 0) {
+		return;
+	}
+	E.redraw = 0;
+	E.last_frame = editorNow();
+	if (E.frame_pending) {
+		E.frame_pending = 0;
+		editorCancel(editorRenderFrame);
+	}
+	if (E.stream) {
+		viewerRefreshScreen();
+		return;
+	}
+	editorBracketRefresh();
+	editorSelectionRefresh();
+	editorCursorsRefresh();
+	editorViewStore();
+	int active = E.curview;
+
+	struct abuf ab = ABUF_INIT;
+	struct abuf *lines = calloc(E.winrows + 2, sizeof(struct abuf));
+
+	abAppend(&ab, "\x1b[?25l", 6);
+	editorDrawSplit(E.root, lines);
+
+	editorViewLoad(active);
+	editorScroll();
+	struct editorView *v = &E.views[active];
+	if (E.nviews == 1) {
+		editorScrollLines(&ab, E.wrap ? editorWrapLineOf(E.rowoff, E.rowseg) : editorFoldLine(E.rowoff));
 	}
 	else {
-		E.cx = saved_cx;
-		E.cy = saved_cy;
-		E.coloff = saved_coloff;
-		E.rowoff = saved_rowoff;
+		E.shadowtop = -1;
+	}
+
+	editorDrawStatusBar(&lines[E.winrows]);
+	editorDrawMessageBar(&lines[E.winrows + 1]);
+	for (int y = 0; y < E.winrows + 2; y++) {
+		editorFlushLine(&ab, y, &lines[y]);
+		abFree(&lines[y]);
+	}
+	free(lines);
+
+	/* every view has now seen the edits made since the last frame */
+	E.editlo = INT_MAX;
+	E.edithi = -1;
+	for (int i = 0; i < E.nbuffers; i++) {
+		E.buffers[i].editlo = INT_MAX;
+		E.buffers[i].edithi = -1;
+	}
+
+	char buf[32];
+	int cursor_y = editorFoldLine(E.cy) - editorFoldLine(E.rowoff);
+	int cursor_x = E.rx - E.coloff;
+	if (E.wrap) {
+		int cseg = 0;
+		if (E.cy < E.numrows) {
+			cseg = editorRowWrapSegment(&E.row[E.cy], E.rx - E.gutter, E.wrapcols);
+			cursor_x = E.rx - editorRowWrapStart(&E.row[E.cy], cseg, E.wrapcols);
+		}
+		cursor_y = editorWrapLineOf(E.cy, cseg) - editorWrapLineOf(E.rowoff, E.rowseg);
+	}
+	snprintf(buf, sizeof(buf), "\x1b[%d;%dH", v->top + cursor_y + 1, v->left + cursor_x + 1);
+	abAppend(&ab, buf, strlen(buf));
+
+	abAppend(&ab, "\x1b[?25h", 6);
+
+	write(STDOUT_FILENO, ab.b, ab.len);
+	abFree(&ab);
+}
+
+/*
+ * Frames are rendered at most KB_MAX_FPS times a second. A frame that is
+ * requested too early is deferred to the next frame slot instead of being
+ * dropped, so the screen always catches up once input stops.
+ */
+void editorRenderFrame() {
+	editorRefreshScreen();
+}
+
+void editorRequestFrame() {
+	long long wait = E.last_frame + 1000 / KB_MAX_FPS - editorNow();
+	if (wait <= 0) {
+		editorRefreshScreen();
+	}
+	else if (!E.frame_pending) {
+		E.frame_pending = 1;
+		editorSchedule(editorRenderFrame, wait);
 	}
 }
 
-/*** append buffer ***/
+void editorStatusExpire() {
+	E.redraw = 1;
+}
 
-struct abuf {
-	char *b;
+void editorSetStatusMessage(const char *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
+	va_end(ap);
+	E.statusmsg_time = time(NULL);
+	editorSchedule(editorStatusExpire, KB_STATUS_TIMEOUT_MS);
+}
+
+/*** stream viewer ***/
+
+/*
+ * kb --view FILE pages a read-only file through a fixed number of cached
+ * KB_VIEW_PAGE sized windows read with pread, so memory use does not grow
+ * with the file. Line numbers come from a sparse index holding the offset
+ * of every stride-th line; it is built in idle time and halves itself
+ * whenever it reaches KB_VIEW_MAX_MARKS entries. Going to a line the index
+ * has not reached yet lands on an estimate, moved to the exact line once
+ * the index gets there.
+ */
+char *viewerPage(off_t page, int *len) {
+	struct streamView *sv = E.stream;
+	struct viewPage *slot = &sv->pages[0];
+	for (int i = 0; i < sv->npages; i++) {
+		struct viewPage *p = &sv->pages[i];
+		if (p->page == page) {
+			p->last_used = ++sv->clock;
+			*len = p->len;
+			return p->data;
+		}
+		if (p->last_used < slot->last_used) {
+			slot = p;
+		}
+	}
+
+	if (slot->data == NULL) {
+		slot->data = malloc(KB_VIEW_PAGE);
+	}
+	slot->len = pread(sv->fd, slot->data, KB_VIEW_PAGE, page * KB_VIEW_PAGE);
+	if (slot->len < 0) {
+		slot->len = 0;
+	}
+	slot->page = page;
+	slot->last_used = ++sv->clock;
+	*len = slot->len;
+	return slot->data;
+}
+
+/* points *p at the bytes from off to the end of its page, returns their count */
+int viewerFetch(off_t off, char **p) {
 	int len;
-};
+	char *data = viewerPage(off / KB_VIEW_PAGE, &len);
+	int at = off % KB_VIEW_PAGE;
+	*p = &data[at];
+	return at < len ? len - at : 0;
+}
 
-#define ABUF_INIT {NULL, 0}
+/* copies at most n bytes of the line starting at off, without the newline */
+int viewerReadLine(off_t off, char *buf, int n) {
+	int len = 0;
+	while (len < n && off + len < E.stream->size) {
+		char *p;
+		int avail = viewerFetch(off + len, &p);
+		if (avail == 0) break;
+		if (avail > n - len) avail = n - len;
+		char *nl = memchr(p, '\n', avail);
+		if (nl) {
+			memcpy(&buf[len], p, nl - p);
+			return len + (nl - p);
+		}
+		memcpy(&buf[len], p, avail);
+		len += avail;
+	}
+	return len;
+}
 
-void abAppend(struct abuf *ab, const char *s, int len) {
-	char *new = realloc(ab->b, ab->len + len);
+/* offset of the line after the one containing off, or the file size */
+off_t viewerNextLine(off_t off) {
+	while (off < E.stream->size) {
+		char *p;
+		int avail = viewerFetch(off, &p);
+		if (avail == 0) break;
+		char *nl = memchr(p, '\n', avail);
+		if (nl) {
+			return off + (nl - p) + 1;
+		}
+		off += avail;
+	}
+	return E.stream->size;
+}
 
-	if (new == NULL) return;
-	memcpy(&new[ab->len], s, len);
-	ab->b = new;
-	ab->len += len;
+/* offset of the start of the line containing off */
+off_t viewerLineStart(off_t off) {
+	while (off > 0) {
+		char *p;
+		off_t page = (off - 1) / KB_VIEW_PAGE;
+		int avail = viewerFetch(page * KB_VIEW_PAGE, &p);
+		int len = off - page * KB_VIEW_PAGE;
+		if (len > avail) len = avail;
+		char *nl = memrchr(p, '\n', len);
+		if (nl) {
+			return page * KB_VIEW_PAGE + (nl - p) + 1;
+		}
+		off = page * KB_VIEW_PAGE;
+	}
+	return 0;
 }
 
-void abFree(struct abuf *ab) {
-	free(ab->b);
+/* the last line start is the file size only for an empty file */
+int viewerHasLine(off_t off) {
+	return off < E.stream->size || off == 0;
+}
+
+void viewerIndexChunk() {
+	struct streamView *sv = E.stream;
+	int len = pread(sv->fd, sv->chunk, KB_VIEW_CHUNK, sv->indexed);
+	if (len <= 0) {
+		sv->size = sv->indexed;
+		sv->indexed_all = 1;
+		return;
+	}
+
+	char *p = sv->chunk, *end = sv->chunk + len;
+	while ((p = memchr(p, '\n', end - p)) != NULL) {
+		p++;
+		if (++sv->lines % sv->stride == 0) {
+			if (sv->nmarks == KB_VIEW_MAX_MARKS) {
+				for (int i = 0; i < sv->nmarks / 2; i++) {
+					sv->marks[i] = sv->marks[2 * i + 1];
+				}
+				sv->nmarks /= 2;
+				sv->stride *= 2;
+			}
+			if (sv->lines % sv->stride == 0) {
+				sv->marks[sv->nmarks++] = sv->indexed + (p - sv->chunk);
+			}
+		}
+	}
+	sv->indexed += len;
+	if (sv->indexed >= sv->size) {
+		sv->indexed_all = 1;
+	}
+}
+
+void viewerPlaceLine(long long n);
+
+void viewerIndexStep() {
+	struct streamView *sv = E.stream;
+	long long start = editorNow();
+	while (!sv->indexed_all && editorNow() - start < KB_VIEW_INDEX_SLICE_MS) {
+		viewerIndexChunk();
+	}
+	if (sv->goto_line >= 0 && (sv->lines >= sv->goto_line || sv->indexed_all)) {
+		viewerPlaceLine(sv->goto_line);
+	}
+	if (!sv->indexed_all) {
+		editorSchedule(viewerIndexStep, 0);
+	}
+	E.redraw = 1;
+}
+
+/* zero based line number of the line starting at off, or -1 if not indexed yet */
+long long viewerLineOf(off_t off) {
+	struct streamView *sv = E.stream;
+	if (off > sv->indexed) {
+		return -1;
+	}
+	int lo = 0, hi = sv->nmarks;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (sv->marks[mid] <= off) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	long long line = (long long) lo * sv->stride;
+	off_t at = lo ? sv->marks[lo - 1] : 0;
+	while (at < off) {
+		at = viewerNextLine(at);
+		line++;
+	}
+	return line;
+}
+
+/*
+ * offset of zero based line n. Past the end of the index it is estimated
+ * from the average length of the lines indexed so far, and *exact is 0.
+ */
+off_t viewerOffsetOfLine(long long n, int *exact) {
+	struct streamView *sv = E.stream;
+	*exact = sv->lines >= n || sv->indexed_all;
+	if (!*exact) {
+		double avg = sv->lines ? (double) sv->indexed / sv->lines : 80;
+		double off = sv->indexed + (n - sv->lines) * avg;
+		return viewerLineStart(off < sv->size ? (off_t) off : sv->size);
+	}
+	if (n > sv->lines) {
+		n = sv->lines;
+	}
+	long long mark = n / sv->stride;
+	if (mark > sv->nmarks) {
+		mark = sv->nmarks;
+	}
+	off_t off = mark ? sv->marks[mark - 1] : 0;
+	for (long long line = mark * sv->stride; line < n; line++) {
+		off = viewerNextLine(off);
+	}
+	return off;
+}
+
+/* shows zero based line n at the top, or an estimate of it until it is indexed */
+void viewerPlaceLine(long long n) {
+	struct streamView *sv = E.stream;
+	int exact;
+	sv->top = viewerOffsetOfLine(n, &exact);
+	if (!viewerHasLine(sv->top)) {
+		sv->top = viewerLineStart(sv->top - 1);
+	}
+	sv->topline = viewerLineOf(sv->top);
+	sv->goto_line = exact ? -1 : n;
+}
+
+void viewerScroll(int lines) {
+	struct streamView *sv = E.stream;
+	sv->goto_line = -1;
+	while (lines > 0) {
+		off_t next = viewerNextLine(sv->top);
+		if (!viewerHasLine(next)) break;
+		sv->top = next;
+		if (sv->topline >= 0) sv->topline++;
+		lines--;
+	}
+	while (lines < 0 && sv->top > 0) {
+		sv->top = viewerLineStart(sv->top - 1);
+		if (sv->topline >= 0) sv->topline--;
+		lines++;
+	}
+}
+
+void viewerGoto(off_t off) {
+	struct streamView *sv = E.stream;
+	if (off > sv->size) {
+		off = sv->size;
+	}
+	sv->goto_line = -1;
+	sv->top = viewerLineStart(off);
+	if (!viewerHasLine(sv->top)) {
+		sv->top = viewerLineStart(sv->top - 1);
+	}
+	sv->topline = viewerLineOf(sv->top);
+}
+
+void viewerPromptGoto() {
+	char *target = editorPrompt("Go to line or percentage: %s (ESC to cancel)", NULL);
+	if (target == NULL) {
+		return;
+	}
+	struct streamView *sv = E.stream;
+	long long n = atoll(target);
+	if (strchr(target, '%')) {
+		viewerGoto((off_t) ((double) sv->size * n / 100));
+	}
+	else if (n > 0) {
+		viewerPlaceLine(n - 1);
+	}
+	free(target);
+}
+
+/*
+ * Searches stream over the file in KB_VIEW_CHUNK blocks with memmem, like
+ * the editor searches its rows with strstr, without going through the page
+ * cache. Returns the offset of the first match after from (or the last one
+ * before it), wrapping around the end of the file, or -1.
+ */
+off_t viewerSearch(off_t from, const char *query, int direction) {
+	struct streamView *sv = E.stream;
+	int qlen = strlen(query);
+	if (qlen == 0 || qlen >= KB_VIEW_CHUNK) {
+		return -1;
+	}
+	int step = KB_VIEW_CHUNK - qlen + 1;
+	off_t scanned = 0;
+	off_t at = from;
+	while (scanned < sv->size + step) {
+		off_t start = direction > 0 ? at : at - step;
+		if (direction > 0 && start >= sv->size) {
+			start = at = 0;
+		}
+		else if (direction < 0 && at <= 0) {
+			at = sv->size;
+			start = at - step;
+		}
+		if (start < 0) {
+			start = 0;
+		}
+		int len = pread(sv->fd, sv->chunk, KB_VIEW_CHUNK, start);
+		if (len <= 0) {
+			return -1;
+		}
+		char *match = NULL;
+		if (direction > 0) {
+			match = memmem(sv->chunk, len, query, qlen);
+		}
+		else {
+			/* the last match that starts before at */
+			int limit = at - start + qlen - 1;
+			if (limit > len) limit = len;
+			char *p = sv->chunk;
+			while ((p = memmem(p, limit - (p - sv->chunk), query, qlen)) != NULL) {
+				match = p++;
+			}
+		}
+		if (match) {
+			return start + (match - sv->chunk);
+		}
+		scanned += direction > 0 ? step : at - start;
+		at = direction > 0 ? start + step : start;
+	}
+	return -1;
 }
 
-/*** output ***/
+void viewerFindCallback(char *query, int key) {
+	static int direction = 1;
+	struct streamView *sv = E.stream;
 
-void editorScroll() {
-	E.rx = LEFT_MARGIN;
-	if (E.cy < E.numrows) {
-		E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+	if (key == '\r' || key == '\x1b') {
+		direction = 1;
+		return;
+	}
+	else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
+		direction = 1;
+	}
+	else if (key == ARROW_LEFT || key == ARROW_UP) {
+		direction = -1;
+	}
+	else {
+		sv->match = -1;
+		direction = 1;
 	}
 
-	if (E.cy < E.rowoff) {
-		E.rowoff = E.cy;
+	off_t from = sv->top;
+	if (sv->match >= 0) {
+		from = sv->match + (direction > 0);
 	}
-	if (E.cy >= E.rowoff + E.screenrows) {
-		E.rowoff = E.cy - E.screenrows + 1;
+	off_t match = viewerSearch(from, query, direction);
+	sv->match = match;
+	sv->matchlen = strlen(query);
+	if (match >= 0) {
+		viewerGoto(match);
+		off_t col = match - sv->top;
+		sv->coloff = col < E.wincols / 2 ? 0 : col - E.wincols / 2;
 	}
-	if (E.rx - LEFT_MARGIN < E.coloff) {
-		E.coloff = E.rx - LEFT_MARGIN;
+}
+
+void viewerFind() {
+	struct streamView *sv = E.stream;
+	off_t saved_top = sv->top;
+	long long saved_topline = sv->topline;
+	int saved_coloff = sv->coloff;
+
+	sv->match = -1;
+	char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)", viewerFindCallback);
+
+	if (query) {
+		free(query);
 	}
-	if (E.rx >= E.coloff + E.screencols + LEFT_MARGIN) {
-		E.coloff = E.rx - E.screencols - LEFT_MARGIN + 1;
+	else {
+		sv->top = saved_top;
+		sv->topline = saved_topline;
+		sv->coloff = saved_coloff;
 	}
+	sv->match = -1;
 }
 
-void editorDrawRows(struct abuf *ab) {
-	char s[5];
-	s[4] = '\0';
-	for (int y = 0; y < E.screenrows; y++) {
-		int filerow = y + E.rowoff;
-		if (filerow >= E.numrows) {
-			if (E.numrows == 0 && y == E.screenrows / 3) {
-				char welcome[80];
-				int welcomelen = snprintf(welcome, sizeof(welcome),
-					"KB editor -- version %s", KB_VERSION);
-				if (welcomelen > E.screencols) {
-					welcomelen = E.screencols;
-				}
-				int padding = (E.screencols - welcomelen) / 2;
-				if (padding) {
-					abAppend(ab, "~", 1);
-					padding--;
-				}
-				while (padding--) {
-					abAppend(ab, " ", 1);
-				}
-				abAppend(ab, welcome, welcomelen);
+/* renders the line at off into ab, E.screencols columns from sv->coloff on */
+void viewerDrawLine(struct abuf *ab, off_t off) {
+	struct streamView *sv = E.stream;
+	int limit = sv->coloff + E.screencols;
+	int want = limit * 4 + 4;
+	if (want > sv->linecap) {
+		sv->linecap = want;
+		sv->line = realloc(sv->line, want);
+	}
+	int len = viewerReadLine(off, sv->line, want);
+	char *s = sv->line;
+	int col = 0, current_color = -1;
+	for (int j = 0; j < len && col < limit; ) {
+		int cp, n = 1, width = 1;
+		unsigned char c = s[j];
+		if (c == '\t') {
+			width = KB_TAB_SIZE - col % KB_TAB_SIZE;
+		}
+		else if (c & 0x80) {
+			n = utf8Decode(&s[j], len - j, &cp);
+			width = n > 1 ? codepointWidth(cp) : 1;
+		}
+		int color = (sv->match >= 0 && off + j >= sv->match && off + j < sv->match + sv->matchlen) ? editorSyntaxToColor(HL_MATCH) : -1;
+		if (col + width > limit) {
+			break;
+		}
+		if (col >= sv->coloff) {
+			if (color != current_color) {
+				char buf[16];
+				int clen = color == -1 ? snprintf(buf, sizeof(buf), "\x1b[39m") : snprintf(buf, sizeof(buf), "\x1b[%dm", color);
+				abAppend(ab, buf, clen);
+				current_color = color;
+			}
+			if (c == '\t') {
+				abAppendSpaces(ab, width);
+			}
+			else if (n == 1 && (iscntrl(c) || (c & 0x80))) {
+				char sym = c <= 26 ? '@' + c : '?';
+				abAppend(ab, "\x1b[7m", 4);
+				abAppend(ab, &sym, 1);
+				abAppend(ab, "\x1b[m", 3);
 			}
 			else {
-				abAppend(ab, "~", 1);
+				abAppend(ab, &s[j], n);
 			}
 		}
-		else {
-			toString(s, E.row[filerow].idx + 1);
-			abAppend(ab, s, LEFT_MARGIN - 2);
-			abAppend(ab, "  ", 2);
-			int len = E.row[filerow].rsize - E.coloff;
-			if (len < 0) len = 0;
-			if (len > E.screencols) len = E.screencols;
-			char *c = &E.row[filerow].render[E.coloff];
-			unsigned char *hl = &E.row[filerow].hl[E.coloff];
-			int current_color = -1;
-			for (int j = 0; j < len; j++) {
-				if (iscntrl(c[j])) {
-					char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-					abAppend(ab, "\x1b[7m", 4);
-					abAppend(ab, &sym, 1);
-					abAppend(ab, "\x1b[m", 3);
-					if (current_color != -1) {
-						char buf[16];
-						int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
-						abAppend(ab, buf, clen);
-					}
-				}
-				else if (hl[j] == HL_NORMAL) {
-					if (current_color != -1) {
-						abAppend(ab, "\x1b[39m", 5);
-						current_color = -1;
-					}
-					abAppend(ab, &c[j], 1);
-				}
-				else {
-					int color = editorSyntaxToColor(hl[j]);
-					if (color != current_color) {
-						current_color = color;
-						char buf[16];
-						int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-						abAppend(ab, buf, clen);
-					}
-					abAppend(ab, &c[j], 1);
-				}
-			}
-			abAppend(ab, "\x1b[39m", 5);
+		else if (col + width > sv->coloff) {
+			/* a wide character cut by the left edge */
+			abAppendSpaces(ab, col + width - sv->coloff);
 		}
-
-		abAppend(ab, "\x1b[K", 3);
-		abAppend(ab, "\r\n", 2);
+		col += width;
+		j += n;
 	}
+	abAppend(ab, "\x1b[39m", 5);
 }
 
-void editorDrawStatusBar(struct abuf *ab) {
-	abAppend(ab, "\x1b[7m", 4);
+void viewerDrawStatusBar(struct abuf *ab) {
+	struct streamView *sv = E.stream;
 	char status[80], rstatus[80];
-	int len = snprintf(status, sizeof(status), "%.20s - %d lines %s", E.filename ? E.filename : "[No Name]", E.numrows, E.dirty ? "(modified)" : "");
-	int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d:%d", E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, E.rx - LEFT_MARGIN + 1);
-	if (len > E.screencols) {
-		len = E.screencols;
+	int len = snprintf(status, sizeof(status), "%.20s - %lld MiB (view)", sv->filename, (long long) sv->size >> 20);
+	int percent = sv->size ? (int) (sv->top * 100 / sv->size) : 100;
+	int rlen;
+	if (sv->topline >= 0) {
+		rlen = snprintf(rstatus, sizeof(rstatus), "%s%d%% | line %lld", sv->indexed_all ? "" : "indexing | ", percent, sv->topline + 1);
+	}
+	else if (sv->goto_line >= 0) {
+		rlen = snprintf(rstatus, sizeof(rstatus), "indexed %d%% | %d%% | near line %lld", (int) (sv->indexed * 100 / (sv->size ? sv->size : 1)), percent, sv->goto_line + 1);
+	}
+	else {
+		rlen = snprintf(rstatus, sizeof(rstatus), "indexed %d%% | %d%%", (int) (sv->indexed * 100 / (sv->size ? sv->size : 1)), percent);
+	}
+
+	abAppend(ab, "\x1b[7m", 4);
+	if (len > E.wincols) {
+		len = E.wincols;
 	}
 	abAppend(ab, status, len);
-	while (len < E.screencols) {
-		if (E.screencols - len == rlen) {
-			abAppend(ab, "      ", LEFT_MARGIN);
-			abAppend(ab, rstatus, rlen);
-			break;
-		}
-		else {
-			abAppend(ab, " ", 1);
-			len++;
-		}
+	if (E.wincols - len >= rlen) {
+		abAppendSpaces(ab, E.wincols - len - rlen);
+		abAppend(ab, rstatus, rlen);
+	}
+	else {
+		abAppendSpaces(ab, E.wincols - len);
 	}
 	abAppend(ab, "\x1b[m", 3);
-	abAppend(ab, "\r\n", 2);
 }
 
-void editorDrawMessageBar(struct abuf *ab) {
-	abAppend(ab, "\x1b[K", 3);
-	int msglen = strlen(E.statusmsg);
-	if (msglen > E.screencols) {
-		msglen = E.screencols;
+void viewerRefreshScreen() {
+	struct streamView *sv = E.stream;
+	if (sv->topline < 0) {
+		sv->topline = viewerLineOf(sv->top);
 	}
-	if (msglen && time(NULL) - E.statusmsg_time < 5) {
-		abAppend(ab, E.statusmsg, msglen);
-	}
-}
 
-void editorRefreshScreen() {
-	editorScroll();
+	/* size the gutter from the last line number on screen */
+	long long last = sv->topline >= 0 ? sv->topline + E.winrows : 0;
+	int digits = 1;
+	for (long long n = last; n >= 10; n /= 10) {
+		digits++;
+	}
+	if (digits < GUTTER_MIN_DIGITS) {
+		digits = GUTTER_MIN_DIGITS;
+	}
+	E.gutter = digits + 2;
+	E.screencols = E.wincols - E.gutter;
+	if (E.screencols < 1) E.screencols = 1;
 
 	struct abuf ab = ABUF_INIT;
-
+	struct abuf line = ABUF_INIT;
 	abAppend(&ab, "\x1b[?25l", 6);
-	abAppend(&ab, "\x1b[H", 3);
-
-	editorDrawRows(&ab);
-	editorDrawStatusBar(&ab);
-	editorDrawMessageBar(&ab);
 
-	char buf[32];
-	snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1, (E.rx - E.coloff) + 1);
-	abAppend(&ab, buf, strlen(buf));
+	off_t off = sv->top;
+	int exists = viewerHasLine(off) && sv->size > 0;
+	for (int y = 0; y < E.winrows; y++) {
+		if (exists) {
+			char num[32];
+			memset(num, ' ', E.gutter);
+			if (sv->topline >= 0) {
+				long long n = sv->topline + y + 1;
+				for (int i = digits - 1; i >= 0; i--, n /= 10) {
+					num[i] = '0' + n % 10;
+				}
+			}
+			abAppend(&line, num, E.gutter);
+			viewerDrawLine(&line, off);
+			off = viewerNextLine(off);
+			exists = off < sv->size;
+		}
+		else {
+			abAppend(&line, "~", 1);
+		}
+		abAppend(&line, "\x1b[K", 3);
+		editorFlushLine(&ab, y, &line);
+	}
 
-	abAppend(&ab, "\x1b[?25h", 6);
+	viewerDrawStatusBar(&line);
+	editorFlushLine(&ab, E.winrows, &line);
+	editorDrawMessageBar(&line);
+	editorFlushLine(&ab, E.winrows + 1, &line);
+	abFree(&line);
 
+	abAppend(&ab, "\x1b[1;1H", 6);
 	write(STDOUT_FILENO, ab.b, ab.len);
 	abFree(&ab);
 }
 
-void editorSetStatusMessage(const char *fmt, ...) {
-	va_list ap;
-	va_start(ap, fmt);
-	vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
-	va_end(ap);
-	E.statusmsg_time = time(NULL);
+void viewerProcessKeypress() {
+	struct streamView *sv = E.stream;
+	int c = editorReadKey();
+
+	switch (c) {
+		case CTRL_KEY('w'):
+			write(STDOUT_FILENO, "\x1b[2J", 4);
+			write(STDOUT_FILENO, "\x1b[H", 3);
+			exit(0);
+			break;
+
+		case CTRL_KEY('f'):
+			viewerFind();
+			break;
+
+		case CTRL_KEY('l'):
+			viewerPromptGoto();
+			break;
+
+		case HOME_KEY:
+			sv->top = 0;
+			sv->topline = 0;
+			sv->goto_line = -1;
+			sv->coloff = 0;
+			break;
+
+		case END_KEY:
+			viewerGoto(sv->size);
+			viewerScroll(1 - E.winrows);
+			break;
+
+		case PAGE_UP:
+			viewerScroll(-E.winrows);
+			break;
+
+		case PAGE_DOWN:
+			viewerScroll(E.winrows);
+			break;
+
+		case ARROW_UP:
+			viewerScroll(-1);
+			break;
+
+		case ARROW_DOWN:
+			viewerScroll(1);
+			break;
+
+		case ARROW_LEFT:
+			if (sv->coloff > 0) sv->coloff--;
+			break;
+
+		case ARROW_RIGHT:
+			sv->coloff++;
+			break;
+	}
+}
+
+int viewerOpen(char *filename) {
+	int fd = open(filename, O_RDONLY);
+	if (fd == -1) {
+		return -1;
+	}
+	struct streamView *sv = calloc(1, sizeof(struct streamView));
+	sv->fd = fd;
+	sv->filename = strdup(filename);
+	sv->size = lseek(fd, 0, SEEK_END);
+
+	size_t cache = (size_t) KB_VIEW_CACHE_MB << 20;
+	char *limit = getenv("KB_VIEW_CACHE");
+	if (limit != NULL && atoi(limit) > 0) {
+		cache = (size_t) atoi(limit) << 20;
+	}
+	sv->npages = cache / KB_VIEW_PAGE;
+	if (sv->npages < 2) sv->npages = 2;
+	sv->pages = calloc(sv->npages, sizeof(struct viewPage));
+	for (int i = 0; i < sv->npages; i++) {
+		sv->pages[i].page = -1;
+	}
+
+	sv->chunk = malloc(KB_VIEW_CHUNK);
+	sv->marks = malloc(sizeof(off_t) * KB_VIEW_MAX_MARKS);
+	sv->stride = 1;
+	sv->goto_line = -1;
+	sv->match = -1;
+
+	E.stream = sv;
+	E.filename = sv->filename;
+	editorSchedule(viewerIndexStep, 0);
+	return 0;
 }
 
 /*** input ***/
@@ -991,9 +6900,13 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
 
 		int c = editorReadKey();
 		if (c == DEL_KEY || c == BACKSPACE) {
+			while (buflen != 0 && utf8IsContinuation(buf[buflen - 1])) {
+				buflen--;
+			}
 			if (buflen != 0) {
-				buf[--buflen] = '\0';
+				buflen--;
 			}
+			buf[buflen] = '\0';
 		}
 		else if (c == '\x1b') {
 			editorSetStatusMessage("");
@@ -1012,7 +6925,7 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
 				return buf;
 			}
 		}
-		else if (!iscntrl(c) && c < 128) {
+		else if ((c < 128 && !iscntrl(c)) || (c >= 128 && c < 256)) {
 			if (buflen == bufsize - 1) {
 				bufsize *= 2;
 				buf = realloc(buf, bufsize);
@@ -1027,43 +6940,78 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
 	}
 }
 
+void editorPaste() {
+	struct abuf text = ABUF_INIT;
+	const char *end = "\x1b[201~";
+	int idle = 0;
+
+	while (idle < 10) {
+		struct inputBuffer *in = &E.input;
+		int pending = editorInputPending();
+		char *p = memmem(&in->buf[in->pos], pending, end, 6);
+		if (p) {
+			abAppend(&text, &in->buf[in->pos], p - &in->buf[in->pos]);
+			in->pos = p - in->buf + 6;
+			break;
+		}
+
+		/* keep a possible partial terminator for the next read */
+		int take = pending > 5 ? pending - 5 : 0;
+		abAppend(&text, &in->buf[in->pos], take);
+		in->pos += take;
+		idle = (editorInputWait(KB_ESC_TIMEOUT_MS) && editorInputFill()) ? 0 : idle + 1;
+	}
+
+	if (text.len) {
+		editorInsertText(text.b, text.len);
+	}
+	abFree(&text);
+}
+
+void editorSnapCursor() {
+	erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+	int rowlen = row ? row->size : 0;
+	if (E.cx > rowlen) {
+		E.cx = rowlen;
+	}
+	if (row) {
+		E.cx = editorRowSnapCx(row, E.cx);
+	}
+}
+
 void editorMoveCursor(int key) {
 	erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
 
 	switch (key) {
 		case ARROW_LEFT:
 			if (E.cx != 0) {
-				E.cx--;
+				E.cx = editorRowPrevCx(row, E.cx);
 			} else if (E.cy > 0) {
-				E.cy--;
+				E.cy = editorFoldPrev(E.cy);
 				E.cx = E.row[E.cy].size;
 			}
 			break;
 		case ARROW_RIGHT:
 			if (row && E.cx < row->size) {
-				E.cx++;
+				E.cx = editorRowNextCx(row, E.cx);
 			} else if (row && E.cx == row->size) {
-				E.cy++;
+				E.cy = editorFoldNext(E.cy);
 				E.cx = 0;
 			}
 			break;
 		case ARROW_UP:
 			if (E.cy != 0) {
-				E.cy--;
+				E.cy = editorFoldPrev(E.cy);
 			}
 			break;
 		case ARROW_DOWN:
 			if (E.cy < E.numrows) {
-				E.cy++;
+				E.cy = editorFoldNext(E.cy);
 			}
 			break;
 	}
 
-	row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
-	int rowlen = row ? row->size : 0;
-	if (E.cx > rowlen) {
-		E.cx = rowlen;
-	}
+	editorSnapCursor();
 }
 
 void editorProcessClosingBrackets(char c) {
@@ -1087,91 +7035,212 @@ void editorProcessKeypress() {
 	static int quit_times = KB_QUIT_TIMES - 1;
 
 	int c = editorReadKey();
+	if (c == PASTE_START || c == PASTE_END) {
+		E.yank_active = 0;
+		if (c == PASTE_START) {
+			editorSelectionDelete();
+			editorPaste();
+		}
+		return;
+	}
 
-	switch (c) {
-		case '\r':
+	int chord = E.keymap.state >= 0;
+	int command = keymapStep(&E.keymap, c);
+	if (command == KEYMAP_PREFIX || (chord && command == KEYMAP_UNBOUND)) {
+		return;
+	}
+	if (command != CMD_PASTE && command != CMD_YANK_POP) {
+		E.yank_active = 0;
+	}
+	if (E.ncursors > 0 && editorCursorsKeypress(command, c)) {
+		quit_times = KB_QUIT_TIMES - 1;
+		return;
+	}
+
+	switch (command) {
+		case CMD_NEWLINE:
+			editorSelectionDelete();
 			editorInsertNewline();
 			break;
 
-		case CTRL_KEY('w'):
-			if (E.dirty && quit_times > 0) {
+		case CMD_QUIT:
+			if (editorBufferDirty() && quit_times > 0) {
 				editorSetStatusMessage("WARNING!!! File has unsaved changes. "
-					"Press Ctrl-W %d more times to quit.", quit_times);
+					"Quit %d more times to throw them away.", quit_times);
 				quit_times--;
 				return;
 			}
+			/* quitting throws the changes away, so their journals go too */
+			for (int i = 0; i < E.nbuffers; i++) {
+				editorJournalReset(&E.buffers[i]);
+			}
 			write(STDOUT_FILENO, "\x1b[2J", 4);
 			write(STDOUT_FILENO, "\x1b[H", 3);
 			exit(0);
 			break;
 
-		case CTRL_KEY('s'):
+		case CMD_SAVE:
 			editorSave();
 			break;
 
-		case HOME_KEY:
+		case CMD_LINE_START:
+			editorSelectionClear();
 			E.cx = 0;
 			break;
 
-		case END_KEY:
+		case CMD_LINE_END:
+			editorSelectionClear();
 			if (E.cy < E.numrows)
 				E.cx = E.row[E.cy].size;
 			break;
 
-		case CTRL_KEY('f'):
+		case CMD_FIND:
 			editorFind();
 			break;
 
-		case BACKSPACE:
-		case DEL_KEY:
-			if (c == DEL_KEY) editorMoveCursor(ARROW_RIGHT);
+		case CMD_BACKSPACE:
+		case CMD_DELETE:
+			if (editorSelectionDelete()) break;
+			if (command == CMD_DELETE) editorMoveCursor(ARROW_RIGHT);
 			editorDelChar();
 			break;
 
-		case PAGE_UP:
-		case PAGE_DOWN:
-			{
-				if (c == PAGE_UP) {
-					E.cy = E.rowoff;
-				}
-				else if (c == PAGE_DOWN) {
-					E.cy = E.rowoff + E.screenrows - 1;
-					if (E.cy > E.numrows) {
-						E.cy = E.numrows;
-					}
-				}
+		case CMD_COPY:
+			editorCopy(0);
+			break;
 
-				int times = E.screenrows;
-				while (times--) {
-					editorMoveCursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
-				}
-			}
+		case CMD_CUT:
+			editorCopy(1);
 			break;
 
-		case ARROW_UP:
-		case ARROW_DOWN:
-		case ARROW_LEFT:
-		case ARROW_RIGHT:
-			editorMoveCursor(c);
+		case CMD_PASTE:
+			editorYank();
+			break;
+
+		case CMD_YANK_POP:
+			editorYankPop();
+			break;
+
+		case CMD_CURSOR_NEXT_MATCH:
+			editorCursorsAddNext();
+			break;
+
+		case CMD_CURSOR_ALL_MATCHES:
+			editorCursorsAddAll();
+			break;
+
+		case CMD_CURSOR_COLUMN:
+			editorCursorsAddColumn();
+			break;
+
+		case CMD_MACRO_RECORD:
+			editorMacroToggle();
+			break;
+
+		case CMD_MACRO_REPLAY:
+			editorMacroReplay();
+			break;
+
+		case CMD_SELECT_LEFT:
+		case CMD_SELECT_RIGHT:
+		case CMD_SELECT_UP:
+		case CMD_SELECT_DOWN:
+		case CMD_SELECT_LINE_START:
+		case CMD_SELECT_LINE_END:
+			editorSelectionExtend(E.command_key[command]);
+			break;
+
+		case CMD_TOGGLE_WRAP:
+			editorToggleWrap();
+			break;
+
+		case CMD_OPEN:
+			editorBufferPromptOpen();
+			break;
+
+		case CMD_NEXT_BUFFER:
+			editorBufferSwitch(E.curbuf + 1);
+			break;
+
+		case CMD_PREV_BUFFER:
+			editorBufferSwitch(E.curbuf - 1);
+			break;
+
+		case CMD_SPLIT_HORIZONTAL:
+			editorSplitView(SPLIT_HORIZONTAL);
+			break;
+
+		case CMD_SPLIT_VERTICAL:
+			editorSplitView(SPLIT_VERTICAL);
+			break;
+
+		case CMD_NEXT_VIEW:
+			editorNextView();
+			break;
+
+		case CMD_CLOSE_VIEW:
+			editorCloseView();
+			break;
+
+		case CMD_FOLLOW:
+			editorFollowToggle();
+			break;
+
+		case CMD_MATCH_BRACKET:
+			editorBracketJump();
+			break;
+
+		case CMD_FOLD:
+			editorFoldToggle();
+			break;
+
+		case CMD_FOLD_ALL:
+			editorFoldAll();
+			break;
+
+		case CMD_COMPLETE:
+			editorComplete();
 			break;
 
-		case '\x1b':
+		case CMD_PAGE_UP:
+		case CMD_PAGE_DOWN:
+			editorSelectionClear();
+			if (E.wrap) {
+				editorWrapPage(E.command_key[command]);
+				break;
+			}
+			if (command == CMD_PAGE_UP) {
+				E.cy = editorFoldRow(editorFoldLine(E.rowoff) - E.screenrows);
+			}
+			else {
+				E.cy = editorFoldRow(editorFoldLine(E.rowoff) + 2 * E.screenrows - 1);
+			}
+			editorSnapCursor();
 			break;
 
-		case '{':
-		case '[':
-		case '(':
-			editorProcessOpeningBrackets(c);
+		case CMD_UP:
+		case CMD_DOWN:
+		case CMD_LEFT:
+		case CMD_RIGHT:
+			editorSelectionClear();
+			editorMoveCursor(E.command_key[command]);
 			break;
 
-		case '}':
-		case ']':
-		case ')':
-			editorProcessClosingBrackets(c);
+		case CMD_CANCEL:
 			break;
 
 		default:
-			editorInsertChar(c);
+			if (c >= ARROW_LEFT) break;
+			editorSelectionDelete();
+			if (validOpeningBracket(c)) {
+				editorProcessOpeningBrackets(c);
+			}
+			else if (validClosingBracket(c)) {
+				editorProcessClosingBrackets(c);
+			}
+			else {
+				editorInsertChar(c);
+			}
 			break;
 	}
 
@@ -1185,6 +7254,7 @@ void initEditor() {
 	E.cy = 0;
 	E.rx = 0;
 	E.rowoff = 0;
+	E.rowseg = 0;
 	E.coloff = 0;
 	E.numrows = 0;
 	E.row = NULL;
@@ -1193,28 +7263,144 @@ void initEditor() {
 	E.statusmsg[0] = '\0';
 	E.statusmsg_time = 0;
 	E.syntax = NULL;
+	E.input.len = 0;
+	E.input.pos = 0;
+	E.ntimers = 0;
+	E.redraw = 0;
+	E.last_frame = 0;
+	E.frame_pending = 0;
+	E.wrap = 0;
+	E.wrapcols = 0;
+	E.wrapindex = NULL;
+	E.wrapindex_valid = 0;
+	E.bracketindex = NULL;
+	E.bracketsize = 0;
+	E.bracketindex_valid = 0;
+	byteSetInit();
+	unsigned char member[256] = {0};
+	for (const char *b = "()[]{}"; *b; b++) member[(unsigned char) *b] = 1;
+	byteSetTableInit(&E.brackets, member);
+	E.bracket_buf = -1;
+	E.folds = NULL;
+	E.nfolds = 0;
+	E.foldindex = NULL;
+	E.foldindex_valid = 0;
+	E.complete_scan = INT_MAX;
+	E.complete_defer = 0;
+	E.complete_scheduled = 0;
+	E.sel_active = 0;
+	E.sel_buf = -1;
+	E.cursors = NULL;
+	E.ncursors = 0;
+	E.cursors_buf = -1;
+	E.cursors_shown = NULL;
+	E.ncursors_shown = 0;
+	E.nkill = 0;
+	E.yank_active = 0;
+	E.hl_defer = 0;
+	E.hl_lo = INT_MAX;
+	E.hl_tail = INT_MAX;
+	E.macro = NULL;
+	E.nmacro = 0;
+	E.record = NULL;
+	E.nrecord = E.recordcap = E.record_start = 0;
+	E.recording = 0;
+	E.macro_pos = -1;
+	E.shadow = NULL;
+	E.shadowrows = 0;
+	E.gutter = 0;
+	E.gutterbuf = NULL;
+	E.gutterrows = 0;
+	E.buffers = calloc(1, sizeof(struct editorBuffer));
+	E.buffers[0].cached = 1;
+	E.nbuffers = 1;
+	E.curbuf = 0;
+	E.editlo = INT_MAX;
+	E.edithi = -1;
+
+	E.views = calloc(1, sizeof(struct editorView));
+	E.nviews = 1;
+	E.curview = 0;
+	E.splits = calloc(1, sizeof(struct editorSplit));
+	E.splits[0].kind = SPLIT_VIEW;
+	E.splits[0].view = 0;
+	E.nsplits = 1;
+	E.root = 0;
+	E.stream = NULL;
+	E.inotifyfd = -1;
+	E.follow_scheduled = 0;
+	E.journal_suspend = 0;
+	E.journal_scheduled = 0;
+	E.syntaxdb = NULL;
+	E.nsyntaxdb = 0;
+	E.syntaxdb_loaded = 0;
+
+	E.memlimit = (size_t) KB_MEMORY_LIMIT_MB << 20;
+	char *limit = getenv("KB_MEMORY_LIMIT");
+	if (limit != NULL && atoi(limit) > 0) {
+		E.memlimit = (size_t) atoi(limit) << 20;
+	}
 
-	if (getWindowSize(&E.screenrows, &E.screencols) == -1) {
+	if (getWindowSize(&E.winrows, &E.wincols) == -1) {
 		die("getWindowSize");
 	}
-	E.screenrows -= 2;
-	E.screencols -= LEFT_MARGIN;
+	E.winrows -= 2;
+	editorLayout();
+	editorInvalidateScreen();
+	E.screenrows = E.winrows;
+	E.viewcols = E.wincols;
+	editorUpdateGutter();
 }
 
 int main(int argc, char *argv[]) {
 	enableRawMode();
 	initEditor();
-	if (argc >= 2) {
-		editorOpen(argv[1]);
+	initEventLoop();
+	void (*processKeypress)(void) = editorProcessKeypress;
+	if (argc > 1 && strcmp(argv[1], "--view") == 0) {
+		if (argc != 3) {
+			disableRawMode();
+			fprintf(stderr, "usage: kb --view FILE\n");
+			exit(1);
+		}
+		if (viewerOpen(argv[2]) == -1) {
+			die("open");
+		}
+		processKeypress = viewerProcessKeypress;
+		editorSetStatusMessage(
+			"HELP: Ctrl-W = quit | Ctrl-F = find | Ctrl-L = go to line or %%"
+		);
 	}
+	else {
+		editorKeymapInit();
+		int follow = argc > 1 && strcmp(argv[1], "--follow") == 0;
+		for (int i = 1 + follow; i < argc; i++) {
+			if (editorBufferOpen(argv[i]) == -1) {
+				die("fopen");
+			}
+			if (follow) {
+				editorFollowToggle();
+			}
+		}
+		if (E.curbuf != 0) {
+			editorBufferStore();
+			editorBufferLoad(0);
+		}
 
-	editorSetStatusMessage(
-		"HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find"
-	);
+		if (E.statusmsg[0] == '\0') {
+			editorSetStatusMessage(
+				"HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find"
+			);
+		}
+	}
 
+	editorRefreshScreen();
 	while (1) {
-		editorRefreshScreen();
-		editorProcessKeypress();
+		processKeypress();
+		while (editorInputPending() || editorInputWait(0)) {
+			processKeypress();
+		}
+		editorRequestFrame();
 	}
 
 	return 0;
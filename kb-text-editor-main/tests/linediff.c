@@ -0,0 +1,70 @@
+/*
+ * Checks lineDiff on a reload where a run of identical lines moved past a
+ * run of unique ones. Every identical block hashes to the same key, which
+ * used to make the block search quadratic, so the test counts the blocks
+ * looked at rather than timing the diff.
+ */
+#define _GNU_SOURCE
+
+#include <time.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+static long probes;
+#define DIFF_COUNT_PROBE() probes++
+
+#include "../utils.c"
+
+static int check(int n) {
+    uint64_t *a = (uint64_t *) malloc(sizeof(uint64_t) * 2 * n);
+    uint64_t *b = (uint64_t *) malloc(sizeof(uint64_t) * 2 * n);
+    int *runs = (int *) malloc(sizeof(int) * 3 * (2 * n + 2));
+    char line[32];
+    uint64_t blank = hashBytes("", 0);
+    for (int i = 0; i < n; i++) {
+        int len = snprintf(line, sizeof(line), "line %d", i);
+        a[i] = blank;
+        a[n + i] = hashBytes(line, len);
+        b[i] = a[n + i];
+        b[n + i] = blank;
+    }
+
+    probes = 0;
+    clock_t start = clock();
+    int nruns = lineDiff(a, 2 * n, b, 2 * n, runs);
+    double secs = (double) (clock() - start) / CLOCKS_PER_SEC;
+    printf("linediff %d: %ld blocks looked at in %.3f s\n", n, probes, secs);
+
+    int matched = 0, lasta = 0, lastb = 0;
+    for (int r = 0; r < nruns; r++) {
+        int ai = runs[3 * r], bi = runs[3 * r + 1], len = runs[3 * r + 2];
+        if (ai < lasta || bi < lastb || len <= 0 || memcmp(&a[ai], &b[bi], sizeof(uint64_t) * len) != 0) {
+            printf("linediff %d: bad run %d (%d, %d, %d)\n", n, r, ai, bi, len);
+            return 1;
+        }
+        lasta = ai + len;
+        lastb = bi + len;
+        matched += len;
+    }
+    free(a);
+    free(b);
+    free(runs);
+    if (matched < n) {
+        printf("linediff %d: only %d lines matched\n", n, matched);
+        return 1;
+    }
+    if (probes > 2 * n) {
+        printf("linediff %d: looked at %ld blocks for %d lines\n", n, probes, 2 * n);
+        return 1;
+    }
+    return 0;
+}
+
+int main(void) {
+    int failed = 0;
+    for (int n = 25000; n <= 200000; n *= 2) failed |= check(n);
+    if (!failed) printf("linediff ok\n");
+    return failed;
+}
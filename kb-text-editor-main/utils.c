@@ -1,7 +1,12 @@
-void toString (char *s, int n) {
-    s[4] = '\0';
-    for (int i = 0; i < 4; i++) {
-        s[3 - i] = n % 10 + '0';
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// writes n as exactly `width` zero-padded digits; callers size width from the largest n
+void toString (char *s, int n, int width) {
+    s[width] = '\0';
+    for (int i = 0; i < width; i++) {
+        s[width - 1 - i] = n % 10 + '0';
         n /= 10;
     }
 }
@@ -20,3 +25,1307 @@ int validClosingBracket(char c) {
     return (c == ']' || c == '}' || c == ')');
 }
 
+
+/*
+ * Display widths of non-ASCII code points. Only the ranges that differ
+ * from the default of one column are listed: zero width combining marks
+ * and format characters, and East Asian Wide/Fullwidth (plus emoji).
+ */
+static const unsigned int zeroWidthTable[][2] = {
+    {0x0300, 0x036F}, {0x0483, 0x0489}, {0x0591, 0x05BD}, {0x05BF, 0x05BF},
+    {0x05C1, 0x05C2}, {0x05C4, 0x05C5}, {0x05C7, 0x05C7}, {0x0610, 0x061A},
+    {0x064B, 0x065F}, {0x0670, 0x0670}, {0x06D6, 0x06DC}, {0x06DF, 0x06E4},
+    {0x06E7, 0x06E8}, {0x06EA, 0x06ED}, {0x0711, 0x0711}, {0x0730, 0x074A},
+    {0x07A6, 0x07B0}, {0x07EB, 0x07F3}, {0x0816, 0x0819}, {0x081B, 0x0823},
+    {0x0825, 0x0827}, {0x0829, 0x082D}, {0x0859, 0x085B}, {0x08D3, 0x08E1},
+    {0x08E3, 0x0902}, {0x093A, 0x093A}, {0x093C, 0x093C}, {0x0941, 0x0948},
+    {0x094D, 0x094D}, {0x0951, 0x0957}, {0x0962, 0x0963}, {0x0981, 0x0981},
+    {0x09BC, 0x09BC}, {0x09C1, 0x09C4}, {0x09CD, 0x09CD}, {0x09E2, 0x09E3},
+    {0x0A01, 0x0A02}, {0x0A3C, 0x0A3C}, {0x0A41, 0x0A51}, {0x0A70, 0x0A71},
+    {0x0A75, 0x0A75}, {0x0A81, 0x0A82}, {0x0ABC, 0x0ABC}, {0x0AC1, 0x0AC8},
+    {0x0ACD, 0x0ACD}, {0x0AE2, 0x0AE3}, {0x0B01, 0x0B01}, {0x0B3C, 0x0B3C},
+    {0x0B3F, 0x0B3F}, {0x0B41, 0x0B44}, {0x0B4D, 0x0B4D}, {0x0B56, 0x0B56},
+    {0x0B62, 0x0B63}, {0x0B82, 0x0B82}, {0x0BC0, 0x0BC0}, {0x0BCD, 0x0BCD},
+    {0x0C00, 0x0C00}, {0x0C3E, 0x0C40}, {0x0C46, 0x0C56}, {0x0C62, 0x0C63},
+    {0x0CBC, 0x0CBC}, {0x0CCC, 0x0CCD}, {0x0CE2, 0x0CE3}, {0x0D00, 0x0D01},
+    {0x0D41, 0x0D44}, {0x0D4D, 0x0D4D}, {0x0D62, 0x0D63}, {0x0DCA, 0x0DCA},
+    {0x0DD2, 0x0DD6}, {0x0E31, 0x0E31}, {0x0E34, 0x0E3A}, {0x0E47, 0x0E4E},
+    {0x0EB1, 0x0EB1}, {0x0EB4, 0x0EBC}, {0x0EC8, 0x0ECD}, {0x0F18, 0x0F19},
+    {0x0F35, 0x0F35}, {0x0F37, 0x0F37}, {0x0F39, 0x0F39}, {0x0F71, 0x0F7E},
+    {0x0F80, 0x0F84}, {0x0F86, 0x0F87}, {0x0F8D, 0x0FBC}, {0x0FC6, 0x0FC6},
+    {0x102D, 0x1030}, {0x1032, 0x1037}, {0x1039, 0x103A}, {0x103D, 0x103E},
+    {0x1058, 0x1059}, {0x105E, 0x1060}, {0x1071, 0x1074}, {0x1082, 0x1082},
+    {0x1085, 0x1086}, {0x108D, 0x108D}, {0x109D, 0x109D}, {0x1160, 0x11FF},
+    {0x135D, 0x135F}, {0x1712, 0x1714}, {0x1732, 0x1734}, {0x1752, 0x1753},
+    {0x1772, 0x1773}, {0x17B4, 0x17B5}, {0x17B7, 0x17BD}, {0x17C6, 0x17C6},
+    {0x17C9, 0x17D3}, {0x17DD, 0x17DD}, {0x180B, 0x180E}, {0x18A9, 0x18A9},
+    {0x1920, 0x1922}, {0x1927, 0x1928}, {0x1932, 0x1932}, {0x1939, 0x193B},
+    {0x1A17, 0x1A18}, {0x1A1B, 0x1A1B}, {0x1A56, 0x1A56}, {0x1A58, 0x1A60},
+    {0x1A62, 0x1A62}, {0x1A65, 0x1A6C}, {0x1A73, 0x1A7F}, {0x1AB0, 0x1AFF},
+    {0x1B00, 0x1B03}, {0x1B34, 0x1B34}, {0x1B36, 0x1B3A}, {0x1B3C, 0x1B3C},
+    {0x1B42, 0x1B42}, {0x1B6B, 0x1B73}, {0x1DC0, 0x1DFF}, {0x200B, 0x200F},
+    {0x202A, 0x202E}, {0x2060, 0x2064}, {0x20D0, 0x20F0}, {0x2CEF, 0x2CF1},
+    {0x2DE0, 0x2DFF}, {0x302A, 0x302D}, {0x3099, 0x309A}, {0xA66F, 0xA672},
+    {0xA674, 0xA67D}, {0xA69E, 0xA69F}, {0xA6F0, 0xA6F1}, {0xA802, 0xA802},
+    {0xA806, 0xA806}, {0xA80B, 0xA80B}, {0xA825, 0xA826}, {0xA8C4, 0xA8C5},
+    {0xA8E0, 0xA8F1}, {0xFB1E, 0xFB1E}, {0xFE00, 0xFE0F}, {0xFE20, 0xFE2F},
+    {0xFEFF, 0xFEFF}, {0x1D167, 0x1D169}, {0x1D17B, 0x1D182}, {0x1D185, 0x1D18B},
+    {0x1D1AA, 0x1D1AD}, {0xE0001, 0xE0001}, {0xE0020, 0xE007F}, {0xE0100, 0xE01EF}
+};
+
+static const unsigned int wideTable[][2] = {
+    {0x1100, 0x115F}, {0x231A, 0x231B}, {0x2329, 0x232A}, {0x23E9, 0x23EC},
+    {0x23F0, 0x23F0}, {0x23F3, 0x23F3}, {0x25FD, 0x25FE}, {0x2614, 0x2615},
+    {0x2648, 0x2653}, {0x267F, 0x267F}, {0x2693, 0x2693}, {0x26A1, 0x26A1},
+    {0x26AA, 0x26AB}, {0x26BD, 0x26BE}, {0x26C4, 0x26C5}, {0x26CE, 0x26CE},
+    {0x26D4, 0x26D4}, {0x26EA, 0x26EA}, {0x26F2, 0x26F3}, {0x26F5, 0x26F5},
+    {0x26FA, 0x26FA}, {0x26FD, 0x26FD}, {0x2705, 0x2705}, {0x270A, 0x270B},
+    {0x2728, 0x2728}, {0x274C, 0x274C}, {0x274E, 0x274E}, {0x2753, 0x2755},
+    {0x2757, 0x2757}, {0x2795, 0x2797}, {0x27B0, 0x27B0}, {0x27BF, 0x27BF},
+    {0x2B1B, 0x2B1C}, {0x2B50, 0x2B50}, {0x2B55, 0x2B55}, {0x2E80, 0x303E},
+    {0x3041, 0x33FF}, {0x3400, 0x4DBF}, {0x4E00, 0x9FFF}, {0xA000, 0xA4CF},
+    {0xA960, 0xA97F}, {0xAC00, 0xD7A3}, {0xF900, 0xFAFF}, {0xFE10, 0xFE19},
+    {0xFE30, 0xFE6F}, {0xFF00, 0xFF60}, {0xFFE0, 0xFFE6}, {0x16FE0, 0x16FE4},
+    {0x17000, 0x18AFF}, {0x1B000, 0x1B2FF}, {0x1F004, 0x1F004}, {0x1F0CF, 0x1F0CF},
+    {0x1F18E, 0x1F18E}, {0x1F191, 0x1F19A}, {0x1F200, 0x1F251}, {0x1F300, 0x1F64F},
+    {0x1F680, 0x1F6FF}, {0x1F900, 0x1F9FF}, {0x1FA70, 0x1FAFF}, {0x20000, 0x2FFFD},
+    {0x30000, 0x3FFFD}
+};
+
+static int inRangeTable(const unsigned int table[][2], int n, unsigned int cp) {
+    if (cp < table[0][0] || cp > table[n - 1][1]) return 0;
+    int lo = 0, hi = n - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (cp > table[mid][1]) lo = mid + 1;
+        else if (cp < table[mid][0]) hi = mid - 1;
+        else return 1;
+    }
+    return 0;
+}
+
+int codepointWidth(int cp) {
+    if (cp < 0x300) return 1;
+    if (inRangeTable(zeroWidthTable, sizeof(zeroWidthTable) / sizeof(zeroWidthTable[0]), cp)) return 0;
+    if (inRangeTable(wideTable, sizeof(wideTable) / sizeof(wideTable[0]), cp)) return 2;
+    return 1;
+}
+
+/*
+ * Decodes one UTF-8 sequence at s. Returns the number of bytes consumed;
+ * malformed, overlong or truncated sequences consume one byte and set
+ * *cp to -1.
+ */
+int utf8Decode(const char *s, int len, int *cp) {
+    const unsigned char *u = (const unsigned char *)s;
+    int n, c;
+    if (u[0] < 0x80) {
+        *cp = u[0];
+        return 1;
+    }
+    else if ((u[0] & 0xE0) == 0xC0) { n = 2; c = u[0] & 0x1F; }
+    else if ((u[0] & 0xF0) == 0xE0) { n = 3; c = u[0] & 0x0F; }
+    else if ((u[0] & 0xF8) == 0xF0) { n = 4; c = u[0] & 0x07; }
+    else { *cp = -1; return 1; }
+
+    if (n > len) { *cp = -1; return 1; }
+    for (int i = 1; i < n; i++) {
+        if ((u[i] & 0xC0) != 0x80) { *cp = -1; return 1; }
+        c = (c << 6) | (u[i] & 0x3F);
+    }
+    if ((n == 2 && c < 0x80) || (n == 3 && c < 0x800) || (n == 4 && c < 0x10000) ||
+        c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF)) {
+        *cp = -1;
+        return 1;
+    }
+    *cp = c;
+    return n;
+}
+
+int utf8IsContinuation(char c) {
+    return ((unsigned char)c & 0xC0) == 0x80;
+}
+
+/* Length of the leading run of ASCII bytes, checked 16 bytes at a time. */
+int asciiSpan(const char *s, int len) {
+    int i = 0;
+#ifdef __SSE2__
+    for (; i + 16 <= len; i += 16) {
+        int mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(s + i)));
+        if (mask) return i + __builtin_ctz(mask);
+    }
+#endif
+    while (i < len && !((unsigned char)s[i] & 0x80)) i++;
+    return i;
+}
+
+/*
+ * Byte sets that are tested 16 or 32 bytes at a time. For bytes below 0x80
+ * lo[b & 15] has bit (b >> 4) set when b is in the set, hi[] does the same
+ * for the bytes from 0x80 up; a pshufb on the low nibbles fetches both
+ * entries for a whole vector, a third one turns the high nibbles into the
+ * bit to test. has[] answers the same question one byte at a time.
+ */
+struct byteSetTable {
+    unsigned char lo[16];
+    unsigned char hi[16];
+    unsigned char has[256];
+};
+
+void byteSetTableInit(struct byteSetTable *t, const unsigned char *member) {
+    memset(t, 0, sizeof(*t));
+    for (int b = 0; b < 256; b++) {
+        if (!member[b]) continue;
+        t->has[b] = 1;
+        if (b < 0x80) t->lo[b & 15] |= 1 << (b >> 4);
+        else t->hi[b & 15] |= 1 << ((b >> 4) & 7);
+    }
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BYTESET_SIMD
+#include <immintrin.h>
+
+/*
+ * 0 scalar, 1 SSSE3, 2 AVX2; set by byteSetInit from what the CPU supports.
+ * It is only read afterwards, so the highlight threads can share it.
+ */
+static int byteSetLevel = 0;
+
+static int byteSetSimd() {
+    return byteSetLevel;
+}
+
+__attribute__((target("ssse3")))
+static inline unsigned byteSetMask16(const struct byteSetTable *t, const unsigned char *s) {
+    const __m128i bits = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+    __m128i v = _mm_loadu_si128((const __m128i *) s);
+    __m128i lo = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) t->lo), v);
+    __m128i hi = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) t->hi), _mm_xor_si128(v, _mm_set1_epi8(-128)));
+    __m128i bit = _mm_shuffle_epi8(bits, _mm_and_si128(_mm_srli_epi16(v, 4), _mm_set1_epi8(0x0f)));
+    __m128i miss = _mm_cmpeq_epi8(_mm_and_si128(_mm_or_si128(lo, hi), bit), _mm_setzero_si128());
+    return ~_mm_movemask_epi8(miss) & 0xffff;
+}
+
+__attribute__((target("avx2")))
+static inline unsigned byteSetMask32(const struct byteSetTable *t, const unsigned char *s) {
+    const __m256i bits = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128,
+                                          1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+    __m256i v = _mm256_loadu_si256((const __m256i *) s);
+    __m256i lo = _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) t->lo)), v);
+    __m256i hi = _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) t->hi)),
+                                     _mm256_xor_si256(v, _mm256_set1_epi8(-128)));
+    __m256i bit = _mm256_shuffle_epi8(bits, _mm256_and_si256(_mm256_srli_epi16(v, 4), _mm256_set1_epi8(0x0f)));
+    __m256i miss = _mm256_cmpeq_epi8(_mm256_and_si256(_mm256_or_si256(lo, hi), bit), _mm256_setzero_si256());
+    return ~(unsigned) _mm256_movemask_epi8(miss);
+}
+
+/*
+ * The scans below take whole vectors while they fit and then one more that
+ * ends at s[n - 1], dropping the bytes it shares with the last one, so a
+ * row of 16 bytes or more never falls back to a byte at a time.
+ */
+__attribute__((target("ssse3")))
+static inline int byteSetFind16(const struct byteSetTable *t, const unsigned char *s, int i, int n) {
+    for (; i + 16 <= n; i += 16) {
+        unsigned m = byteSetMask16(t, s + i);
+        if (m) return i + __builtin_ctz(m);
+    }
+    if (i < n) {
+        unsigned m = byteSetMask16(t, s + n - 16) >> (i - (n - 16));
+        if (m) return i + __builtin_ctz(m);
+    }
+    return n;
+}
+
+__attribute__((target("avx2")))
+static int byteSetFindAvx2(const struct byteSetTable *t, const unsigned char *s, int n) {
+    int i = 0;
+    for (; i + 32 <= n; i += 32) {
+        unsigned m = byteSetMask32(t, s + i);
+        if (m) return i + __builtin_ctz(m);
+    }
+    return byteSetFind16(t, s, i, n);
+}
+
+__attribute__((target("ssse3")))
+static inline int byteTokenFind16(const struct byteSetTable *first, const struct byteSetTable *word,
+                           const unsigned char *s, int i, int n, unsigned carry) {
+    for (; i + 16 <= n; i += 16) {
+        unsigned w = byteSetMask16(word, s + i);
+        unsigned hit = byteSetMask16(first, s + i) & ~(w & ((w << 1) | carry)) & 0xffff;
+        if (hit) return i + __builtin_ctz(hit);
+        carry = (w >> 15) & 1;
+    }
+    if (i < n) {
+        int b = n - 16;
+        unsigned w = byteSetMask16(word, s + b);
+        carry = b > 0 ? word->has[s[b - 1]] : 0;
+        unsigned hit = (byteSetMask16(first, s + b) & ~(w & ((w << 1) | carry)) & 0xffff) >> (i - b);
+        if (hit) return i + __builtin_ctz(hit);
+    }
+    return n;
+}
+
+__attribute__((target("avx2")))
+static int byteTokenFindAvx2(const struct byteSetTable *first, const struct byteSetTable *word,
+                             const unsigned char *s, int n) {
+    int i = 0;
+    unsigned carry = 0;
+    for (; i + 32 <= n; i += 32) {
+        unsigned w = byteSetMask32(word, s + i);
+        unsigned hit = byteSetMask32(first, s + i) & ~(w & ((w << 1) | carry));
+        if (hit) return i + __builtin_ctz(hit);
+        carry = w >> 31;
+    }
+    return byteTokenFind16(first, word, s, i, n, carry);
+}
+#endif
+
+/* picks the vector width for the searches below; call once before any thread uses them */
+void byteSetInit() {
+#ifdef BYTESET_SIMD
+    __builtin_cpu_init();
+    byteSetLevel = __builtin_cpu_supports("avx2") ? 2 : __builtin_cpu_supports("ssse3") ? 1 : 0;
+#endif
+}
+
+/* index of the first of the n bytes at s that is in the set, or n */
+int byteSetFind(const struct byteSetTable *t, const unsigned char *s, int n) {
+    int i = 0;
+#ifdef BYTESET_SIMD
+    if (n >= 16 && byteSetSimd() == 2) return byteSetFindAvx2(t, s, n);
+    if (n >= 16 && byteSetSimd() == 1) return byteSetFind16(t, s, 0, n);
+#endif
+    while (i < n && !t->has[s[i]]) i++;
+    return i;
+}
+
+/*
+ * Index of the first byte in `first` that does not continue a run of
+ * bytes in `word`, or n; the byte at s[0] starts a run. Used to find where
+ * the next token that is more than plain words and punctuation can begin.
+ */
+int byteTokenFind(const struct byteSetTable *first, const struct byteSetTable *word, const unsigned char *s, int n) {
+    int i = 0;
+    unsigned carry = 0;
+#ifdef BYTESET_SIMD
+    if (n >= 16 && byteSetSimd() == 2) return byteTokenFindAvx2(first, word, s, n);
+    if (n >= 16 && byteSetSimd() == 1) return byteTokenFind16(first, word, s, 0, n, 0);
+#endif
+    for (; i < n; i++) {
+        if (first->has[s[i]] && !(word->has[s[i]] && carry)) return i;
+        carry = word->has[s[i]];
+    }
+    return i;
+}
+
+/*
+ * Fenwick (binary indexed) tree over n counts stored in tree[1..n].
+ * fenwickInit turns raw counts placed in tree[1..n] into the tree in O(n);
+ * the other operations take 0-based positions and run in O(log n).
+ */
+void fenwickInit(int *tree, int n) {
+    for (int i = 1; i <= n; i++) {
+        int j = i + (i & -i);
+        if (j <= n) tree[j] += tree[i];
+    }
+}
+
+/*
+ * Like fenwickInit once only the counts at positions from .. n - 1 have
+ * changed and been placed raw in tree[from + 1..n], as after inserting or
+ * deleting at from. The nodes before them are kept, so this is
+ * O(n - from + log^2 n).
+ */
+void fenwickInitFrom(int *tree, int n, int from) {
+    for (int i = from + 1; i <= n; i++) {
+        int j = i + (i & -i);
+        if (j <= n) tree[j] += tree[i];
+    }
+    /* nodes past from whose span starts before it still lack the counts there */
+    int below = 0;
+    for (int i = from; i > 0; i -= i & -i) {
+        below += tree[i];
+    }
+    for (int i = from + (from & -from); from > 0 && i <= n; i += i & -i) {
+        int start = 0;
+        for (int k = i - (i & -i); k > 0; k -= k & -k) {
+            start += tree[k];
+        }
+        tree[i] += below - start;
+    }
+}
+
+void fenwickAdd(int *tree, int n, int pos, int delta) {
+    for (int i = pos + 1; i <= n; i += i & -i) {
+        tree[i] += delta;
+    }
+}
+
+/* sum of the counts at positions [0, pos) */
+int fenwickPrefix(const int *tree, int pos) {
+    int sum = 0;
+    for (int i = pos; i > 0; i -= i & -i) {
+        sum += tree[i];
+    }
+    return sum;
+}
+
+/*
+ * Largest position p with fenwickPrefix(p) <= target, i.e. the position
+ * whose span contains unit number target. *rem receives target minus that
+ * prefix. Returns n when target lies past the total.
+ */
+int fenwickSearch(const int *tree, int n, int target, int *rem) {
+    int pos = 0, step = 1;
+    while (step * 2 <= n) step *= 2;
+    for (; step > 0; step /= 2) {
+        if (pos + step <= n && tree[pos + step] <= target) {
+            pos += step;
+            target -= tree[pos];
+        }
+    }
+    if (rem) *rem = target;
+    return pos;
+}
+
+/*
+ * Segment tree over a sequence of bracket depth changes. A node holds the
+ * net change `sum` of its span and `lo`, the lowest the running depth gets
+ * relative to the start of the span (so lo <= 0); the highest any suffix
+ * reaches is then sum - lo. tree[1] is the root and position p is the leaf
+ * tree[size + p], size being a power of two; unused leaves stay zero.
+ */
+struct depthNode {
+    int sum;
+    int lo;
+};
+
+int depthTreeSize(int n) {
+    int size = 1;
+    while (size < n) size *= 2;
+    return size;
+}
+
+static void depthTreeMerge(struct depthNode *tree, int i) {
+    struct depthNode *a = &tree[2 * i], *b = &tree[2 * i + 1];
+    tree[i].sum = a->sum + b->sum;
+    tree[i].lo = a->lo < a->sum + b->lo ? a->lo : a->sum + b->lo;
+}
+
+/* builds the inner nodes once the leaves are filled in, in O(size) */
+void depthTreeInit(struct depthNode *tree, int size) {
+    for (int i = size - 1; i > 0; i--) depthTreeMerge(tree, i);
+}
+
+/* rebuilds the inner nodes over leaves from .. size - 1 after they changed, in O(size - from + log size) */
+void depthTreeInitFrom(struct depthNode *tree, int size, int from) {
+    for (int lo = (size + from) / 2, hi = size - 1; lo > 0; lo /= 2, hi /= 2) {
+        for (int i = lo; i <= hi; i++) depthTreeMerge(tree, i);
+    }
+}
+
+void depthTreeSet(struct depthNode *tree, int size, int pos, int sum, int lo) {
+    int i = size + pos;
+    tree[i].sum = sum;
+    tree[i].lo = lo;
+    for (i /= 2; i > 0; i /= 2) depthTreeMerge(tree, i);
+}
+
+static int depthTreeForwardAt(const struct depthNode *tree, int i, int l, int r, int pos, int *depth) {
+    if (r <= pos) return -1;
+    if (l >= pos && *depth + tree[i].lo > 0) {
+        *depth += tree[i].sum;
+        return -1;
+    }
+    if (r - l == 1) return l;
+    int m = (l + r) / 2;
+    int p = depthTreeForwardAt(tree, 2 * i, l, m, pos, depth);
+    return p >= 0 ? p : depthTreeForwardAt(tree, 2 * i + 1, m, r, pos, depth);
+}
+
+static int depthTreeBackwardAt(const struct depthNode *tree, int i, int l, int r, int pos, int *need) {
+    if (l > pos) return -1;
+    if (r - 1 <= pos && tree[i].sum - tree[i].lo < *need) {
+        *need -= tree[i].sum;
+        return -1;
+    }
+    if (r - l == 1) return l;
+    int m = (l + r) / 2;
+    int p = depthTreeBackwardAt(tree, 2 * i + 1, m, r, pos, need);
+    return p >= 0 ? p : depthTreeBackwardAt(tree, 2 * i, l, m, pos, need);
+}
+
+/*
+ * First position p >= pos inside which a depth of *depth at the start of
+ * pos drops to zero, or -1. *depth is left at the depth p starts with.
+ * O(log size).
+ */
+int depthTreeForward(const struct depthNode *tree, int size, int pos, int *depth) {
+    return depthTreeForwardAt(tree, 1, 0, size, pos, depth);
+}
+
+/*
+ * Last position p <= pos inside which *need unmatched closing brackets,
+ * counted from the end of pos backwards, are all opened; or -1. *need is
+ * left at the count still open at the end of p.
+ */
+int depthTreeBackward(const struct depthNode *tree, int size, int pos, int *need) {
+    return depthTreeBackwardAt(tree, 1, 0, size, pos, need);
+}
+
+/*
+ * Ternary search tree of words with a count each. Nodes live in one array
+ * and refer to each other by index; node 0 stands for "none" and its eq
+ * link is the root. best is the largest count anywhere below a node, its
+ * lo and hi siblings included, so tstTop can skip every subtree that
+ * cannot reach the top k; tstAdd repairs it along the parent links.
+ */
+#define TST_MAX_WORD 64
+
+struct tstNode {
+    unsigned char c;
+    int lo, eq, hi, parent;
+    int count;
+    int best;
+};
+
+struct tst {
+    struct tstNode *nodes;
+    int n, cap;
+};
+
+static int tstNew(struct tst *t, unsigned char c, int parent) {
+    if (t->n == t->cap) {
+        t->cap = t->cap ? t->cap * 2 : 1024;
+        t->nodes = (struct tstNode *) realloc(t->nodes, sizeof(struct tstNode) * t->cap);
+    }
+    struct tstNode *x = &t->nodes[t->n];
+    memset(x, 0, sizeof(*x));
+    x->c = c;
+    x->parent = parent;
+    return t->n++;
+}
+
+static int *tstLink(struct tst *t, int p, int dir) {
+    struct tstNode *node = &t->nodes[p];
+    return dir < 0 ? &node->lo : dir > 0 ? &node->hi : &node->eq;
+}
+
+/* the node that ends the word s[0 .. len - 1], created if need be; len > 0 */
+int tstInsert(struct tst *t, const char *s, int len) {
+    if (t->n == 0) tstNew(t, 0, 0);
+    int p = 0, dir = 0, i = 0;
+    while (1) {
+        unsigned char c = s[i];
+        int x = *tstLink(t, p, dir);
+        if (x == 0) {
+            x = tstNew(t, c, p);
+            *tstLink(t, p, dir) = x;
+        }
+        struct tstNode *node = &t->nodes[x];
+        p = x;
+        if (c < node->c) dir = -1;
+        else if (c > node->c) dir = 1;
+        else if (++i < len) dir = 0;
+        else return x;
+    }
+}
+
+/* the node that ends the word s, or 0 */
+int tstFind(const struct tst *t, const char *s, int len) {
+    int x = t->n ? t->nodes[0].eq : 0, i = 0;
+    while (x != 0 && len > 0) {
+        const struct tstNode *node = &t->nodes[x];
+        unsigned char c = s[i];
+        if (c < node->c) x = node->lo;
+        else if (c > node->c) x = node->hi;
+        else if (++i < len) x = node->eq;
+        else return x;
+    }
+    return 0;
+}
+
+void tstAdd(struct tst *t, int x, int delta) {
+    t->nodes[x].count += delta;
+    for (; x != 0; x = t->nodes[x].parent) {
+        struct tstNode *node = &t->nodes[x];
+        int best = node->count;
+        if (t->nodes[node->lo].best > best) best = t->nodes[node->lo].best;
+        if (t->nodes[node->eq].best > best) best = t->nodes[node->eq].best;
+        if (t->nodes[node->hi].best > best) best = t->nodes[node->hi].best;
+        if (best == node->best) break;
+        node->best = best;
+    }
+}
+
+static void tstCollect(const struct tst *t, int x, char *buf, int len,
+                       char (*words)[TST_MAX_WORD + 1], int *counts, int k, int *found) {
+    if (x == 0 || len >= TST_MAX_WORD) return;
+    const struct tstNode *node = &t->nodes[x];
+    if (node->best <= 0 || (*found == k && node->best <= counts[k - 1])) return;
+
+    /* the most promising of lo, the node itself and hi goes first */
+    int self = t->nodes[node->eq].best > node->count ? t->nodes[node->eq].best : node->count;
+    int bests[3] = { t->nodes[node->lo].best, self, t->nodes[node->hi].best };
+    int order[3] = { 0, 1, 2 };
+    for (int i = 1; i < 3; i++) {
+        for (int j = i; j > 0 && bests[order[j]] > bests[order[j - 1]]; j--) {
+            int tmp = order[j]; order[j] = order[j - 1]; order[j - 1] = tmp;
+        }
+    }
+    for (int i = 0; i < 3; i++) {
+        if (order[i] == 0) {
+            tstCollect(t, node->lo, buf, len, words, counts, k, found);
+        } else if (order[i] == 2) {
+            tstCollect(t, node->hi, buf, len, words, counts, k, found);
+        } else {
+            buf[len] = node->c;
+            if (node->count > 0 && (*found < k || node->count > counts[k - 1])) {
+                int j = (*found < k) ? (*found)++ : k - 1;
+                for (; j > 0 && counts[j - 1] < node->count; j--) {
+                    memcpy(words[j], words[j - 1], TST_MAX_WORD + 1);
+                    counts[j] = counts[j - 1];
+                }
+                memcpy(words[j], buf, len + 1);
+                words[j][len + 1] = '\0';
+                counts[j] = node->count;
+            }
+            tstCollect(t, node->eq, buf, len + 1, words, counts, k, found);
+        }
+    }
+}
+
+/*
+ * The k most frequent words that start with prefix and are longer than
+ * it, most frequent first, into words[] and counts[]. Returns how many.
+ */
+int tstTop(const struct tst *t, const char *prefix, int len, char (*words)[TST_MAX_WORD + 1], int *counts, int k) {
+    int x = tstFind(t, prefix, len), found = 0;
+    if (x == 0 || len >= TST_MAX_WORD) return 0;
+    char buf[TST_MAX_WORD + 1];
+    memcpy(buf, prefix, len);
+    tstCollect(t, t->nodes[x].eq, buf, len, words, counts, k, &found);
+    return found;
+}
+
+/*
+ * Small blocks are served from per-size-class free lists shared by every
+ * open buffer, so memory released by one file is reused by the next one
+ * instead of going back to malloc. poolUsed() reports the bytes handed out.
+ *
+ * poolShare gives a block one more owner, each of whom frees it once. A
+ * shared block is immutable: poolRealloc and poolUnshare hand back a
+ * private copy rather than the block itself.
+ */
+#define POOL_MIN_SHIFT 4
+#define POOL_CLASSES 12
+#define POOL_MAX_CACHED (8 << 20)
+
+struct poolHeader {
+    size_t size;
+    size_t refs;    // owners besides the first; also keeps the payload 16-byte aligned
+};
+
+static struct poolHeader *poolFreeList[POOL_CLASSES];
+static size_t poolInUse, poolCached;
+
+int poolClass(size_t n) {
+    int cls = 0;
+    while (cls < POOL_CLASSES && ((size_t) 1 << (cls + POOL_MIN_SHIFT)) < n) {
+        cls++;
+    }
+    return cls;
+}
+
+void *poolAlloc(size_t n) {
+    int cls = poolClass(n);
+    struct poolHeader *h;
+    if (cls < POOL_CLASSES && poolFreeList[cls] != NULL) {
+        h = poolFreeList[cls];
+        poolFreeList[cls] = *(struct poolHeader **) (h + 1);
+        poolCached -= h->size;
+    }
+    else {
+        // blocks above the largest class grow by half so appends stay amortized
+        size_t size = cls < POOL_CLASSES ? (size_t) 1 << (cls + POOL_MIN_SHIFT) : n + n / 2;
+        h = (struct poolHeader *) malloc(sizeof(*h) + size);
+        if (h == NULL) return NULL;
+        h->size = size;
+    }
+    h->refs = 0;
+    poolInUse += h->size;
+    return h + 1;
+}
+
+void poolFree(void *p) {
+    if (p == NULL) return;
+    struct poolHeader *h = (struct poolHeader *) p - 1;
+    if (h->refs > 0) {
+        h->refs--;
+        return;
+    }
+    int cls = poolClass(h->size);
+    poolInUse -= h->size;
+    if (cls < POOL_CLASSES && poolCached + h->size <= POOL_MAX_CACHED) {
+        *(struct poolHeader **) p = poolFreeList[cls];
+        poolFreeList[cls] = h;
+        poolCached += h->size;
+    }
+    else {
+        free(h);
+    }
+}
+
+void *poolRealloc(void *p, size_t n) {
+    struct poolHeader *h = p != NULL ? (struct poolHeader *) p - 1 : NULL;
+    if (h != NULL && h->size >= n && h->refs == 0) {
+        return p;
+    }
+    void *q = poolAlloc(n);
+    if (q != NULL && h != NULL) {
+        memcpy(q, p, h->size < n ? h->size : n);
+        poolFree(p);
+    }
+    return q;
+}
+
+void *poolShare(void *p) {
+    if (p != NULL) {
+        ((struct poolHeader *) p - 1)->refs++;
+    }
+    return p;
+}
+
+void *poolUnshare(void *p) {
+    if (p == NULL || ((struct poolHeader *) p - 1)->refs == 0) {
+        return p;
+    }
+    return poolRealloc(p, ((struct poolHeader *) p - 1)->size);
+}
+
+size_t poolUsed() {
+    return poolInUse;
+}
+
+/* FNV-1a hash of len bytes */
+uint64_t hashBytes(const char *s, int len) {
+    uint64_t h = 14695981039346656037ULL;
+    for (int j = 0; j < len; j++) {
+        h = (h ^ (unsigned char) s[j]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+/* CRC-32 (IEEE, reflected) of len bytes, continuing from crc; start with 0 */
+uint32_t crc32Bytes(uint32_t crc, const char *s, size_t len) {
+    static uint32_t table[256];
+    if (table[1] == 0) {
+        for (uint32_t n = 0; n < 256; n++) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            table[n] = c;
+        }
+    }
+    crc = ~crc;
+    for (size_t j = 0; j < len; j++) {
+        crc = table[(crc ^ (unsigned char) s[j]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+/*
+ * Matches the line hashes a[0..m) of an old version of a file against the
+ * hashes b[0..n) of a new one. The common prefix and suffix are matched
+ * directly; in between, every DIFF_BLOCK-line block of the old version is
+ * put in a hash table and a rolling hash over the new version finds blocks
+ * that survived, which are then grown line by line in both directions.
+ * Gaps of at most DIFF_SMALL_GAP lines on both sides are finally matched
+ * exactly with a longest common subsequence table. Repeated blocks, such
+ * as runs of blank lines, share one table entry that lists their positions
+ * in order, and positions before the last match are dropped from the front
+ * of that list for good, so the search stays O(m + n) expected however
+ * often a block repeats. The matched runs are written to runs[] as (old
+ * start, new start, length) triples in increasing order, and their count
+ * is returned. runs[] needs room for 3 * (min(m, n) + 2) ints.
+ */
+#define DIFF_BLOCK 8
+#define DIFF_SMALL_GAP 64
+#define DIFF_PRIME 1099511628211ULL
+
+/* called for every candidate block looked at; tests define it to count them */
+#ifndef DIFF_COUNT_PROBE
+#define DIFF_COUNT_PROBE()
+#endif
+
+static uint64_t diffBlockHash(const uint64_t *h) {
+    uint64_t w = 0;
+    for (int k = 0; k < DIFF_BLOCK; k++) {
+        w = w * DIFF_PRIME + h[k];
+    }
+    return w;
+}
+
+static int diffAddRun(int *runs, int nruns, int ai, int bi, int len) {
+    runs[3 * nruns] = ai;
+    runs[3 * nruns + 1] = bi;
+    runs[3 * nruns + 2] = len;
+    return nruns + 1;
+}
+
+/* appends the longest common subsequence of a[0..m) and b[0..n) as runs offset by ai, bi */
+static int diffSmallGap(const uint64_t *a, int m, const uint64_t *b, int n, int ai, int bi, int *runs, int nruns) {
+    int *lcs = (int *) calloc((m + 1) * (n + 1), sizeof(int));
+    for (int i = m - 1; i >= 0; i--) {
+        for (int j = n - 1; j >= 0; j--) {
+            int *cell = &lcs[i * (n + 1) + j];
+            if (a[i] == b[j]) *cell = cell[n + 2] + 1;
+            else *cell = cell[n + 1] > cell[1] ? cell[n + 1] : cell[1];
+        }
+    }
+    int i = 0, j = 0;
+    while (i < m && j < n) {
+        if (a[i] == b[j]) {
+            if (nruns > 0 && runs[3 * nruns - 3] + runs[3 * nruns - 1] == ai + i && runs[3 * nruns - 2] + runs[3 * nruns - 1] == bi + j) {
+                runs[3 * nruns - 1]++;
+            }
+            else {
+                nruns = diffAddRun(runs, nruns, ai + i, bi + j, 1);
+            }
+            i++;
+            j++;
+        }
+        else if (lcs[(i + 1) * (n + 1) + j] >= lcs[i * (n + 1) + j + 1]) i++;
+        else j++;
+    }
+    free(lcs);
+    return nruns;
+}
+
+static int lineDiffCoarse(const uint64_t *a, int m, const uint64_t *b, int n, int *runs) {
+    int nruns = 0;
+    int prefix = 0;
+    while (prefix < m && prefix < n && a[prefix] == b[prefix]) prefix++;
+    int suffix = 0;
+    while (suffix < m - prefix && suffix < n - prefix && a[m - 1 - suffix] == b[n - 1 - suffix]) suffix++;
+    if (prefix > 0) nruns = diffAddRun(runs, nruns, 0, 0, prefix);
+
+    int aend = m - suffix, bend = n - suffix;
+    int blocks = (aend - prefix) / DIFF_BLOCK;
+    if (blocks > 0 && bend - prefix >= DIFF_BLOCK) {
+        int size = 1;
+        while (size < 2 * blocks) size *= 2;
+        uint64_t *keys = (uint64_t *) malloc(sizeof(uint64_t) * size);
+        /* heads[s] is the first unused block with key keys[s], -1 an empty slot, -2 a used up key */
+        int *heads = (int *) malloc(sizeof(int) * size);
+        int *next = (int *) malloc(sizeof(int) * blocks);
+        for (int s = 0; s < size; s++) heads[s] = -1;
+        for (int k = blocks - 1; k >= 0; k--) {
+            uint64_t key = diffBlockHash(&a[prefix + k * DIFF_BLOCK]);
+            int s = (int) (key & (size - 1));
+            while (heads[s] != -1 && keys[s] != key) s = (s + 1) & (size - 1);
+            keys[s] = key;
+            next[k] = heads[s] == -1 ? -2 : heads[s];
+            heads[s] = k;
+        }
+
+        uint64_t top = 1;
+        for (int k = 1; k < DIFF_BLOCK; k++) top *= DIFF_PRIME;
+
+        int lasta = prefix, lastb = prefix;
+        int j = prefix;
+        uint64_t w = diffBlockHash(&b[j]);
+        while (j + DIFF_BLOCK <= bend) {
+            int found = -1;
+            int s = (int) (w & (size - 1));
+            while (heads[s] != -1 && keys[s] != w) s = (s + 1) & (size - 1);
+            if (heads[s] != -1) {
+                while (heads[s] >= 0 && prefix + heads[s] * DIFF_BLOCK < lasta) {
+                    DIFF_COUNT_PROBE();
+                    heads[s] = next[heads[s]];
+                }
+                for (int k = heads[s]; k >= 0; k = next[k]) {
+                    int i = prefix + k * DIFF_BLOCK;
+                    DIFF_COUNT_PROBE();
+                    if (memcmp(&a[i], &b[j], sizeof(uint64_t) * DIFF_BLOCK) == 0) {
+                        found = i;
+                        break;
+                    }
+                }
+            }
+            if (found == -1) {
+                if (j + DIFF_BLOCK < bend) {
+                    w = (w - b[j] * top) * DIFF_PRIME + b[j + DIFF_BLOCK];
+                }
+                j++;
+                continue;
+            }
+
+            int i = found, back = 0, len = DIFF_BLOCK;
+            while (i - back > lasta && j - back > lastb && a[i - back - 1] == b[j - back - 1]) back++;
+            while (i + len < aend && j + len < bend && a[i + len] == b[j + len]) len++;
+            nruns = diffAddRun(runs, nruns, i - back, j - back, len + back);
+            lasta = i + len;
+            lastb = j + len;
+            j += len;
+            if (j + DIFF_BLOCK <= bend) w = diffBlockHash(&b[j]);
+        }
+        free(keys);
+        free(heads);
+        free(next);
+    }
+
+    if (suffix > 0) nruns = diffAddRun(runs, nruns, aend, bend, suffix);
+    return nruns;
+}
+
+int lineDiff(const uint64_t *a, int m, const uint64_t *b, int n, int *runs) {
+    int cap = 3 * ((m < n ? m : n) + 2);
+    int *coarse = (int *) malloc(sizeof(int) * cap);
+    int ncoarse = lineDiffCoarse(a, m, b, n, coarse);
+
+    int nruns = 0;
+    int alo = 0, blo = 0;
+    for (int r = 0; r <= ncoarse; r++) {
+        int ahi = r < ncoarse ? coarse[3 * r] : m;
+        int bhi = r < ncoarse ? coarse[3 * r + 1] : n;
+        if (ahi > alo && bhi > blo && ahi - alo <= DIFF_SMALL_GAP && bhi - blo <= DIFF_SMALL_GAP) {
+            nruns = diffSmallGap(&a[alo], ahi - alo, &b[blo], bhi - blo, alo, blo, runs, nruns);
+        }
+        if (r < ncoarse) {
+            nruns = diffAddRun(runs, nruns, coarse[3 * r], coarse[3 * r + 1], coarse[3 * r + 2]);
+            alo = coarse[3 * r] + coarse[3 * r + 2];
+            blo = coarse[3 * r + 1] + coarse[3 * r + 2];
+        }
+    }
+    free(coarse);
+    return nruns;
+}
+
+
+/*
+ * Key codes shared by both front ends. A byte is its own code, Ctrl and a
+ * letter is the byte the terminal sends for it, keys that send escape
+ * sequences start at 1000 and Alt and a letter is META_KEY of the letter.
+ * Every code is below KEY_CODES, so tables can be indexed by it.
+ */
+#define CTRL_KEY(k) ((k) & 0x1f)
+#define META_KEY(k) (2000 + (k))
+#define KEY_CODES META_KEY(128)
+#define KEY_INCOMPLETE -1
+
+enum editorKey {
+    BACKSPACE = 127,
+    ARROW_LEFT = 1000,
+    ARROW_RIGHT,
+    ARROW_UP,
+    ARROW_DOWN,
+    DEL_KEY,
+    HOME_KEY,
+    END_KEY,
+    PAGE_UP,
+    PAGE_DOWN,
+    PASTE_START,
+    PASTE_END,
+    SHIFT_ARROW_LEFT,
+    SHIFT_ARROW_RIGHT,
+    SHIFT_ARROW_UP,
+    SHIFT_ARROW_DOWN,
+    SHIFT_HOME_KEY,
+    SHIFT_END_KEY
+};
+
+/*
+ * Decodes the key at the start of the len bytes at s and stores how many
+ * bytes it took in *used. Returns KEY_INCOMPLETE when s may be the start of
+ * a longer sequence; if no more bytes come, the caller takes the ESC alone.
+ * Sequences that are not understood are swallowed and read as ESC.
+ */
+int keyDecode(const char *s, int len, int *used) {
+    *used = 1;
+    if (s[0] != '\x1b') {
+        return (unsigned char) s[0];
+    }
+    if (len < 2) {
+        return KEY_INCOMPLETE;
+    }
+
+    if (s[1] == '[') {
+        int i = 2;
+        while (1) {
+            if (i > 17) {
+                return '\x1b';
+            }
+            if (i >= len) {
+                return KEY_INCOMPLETE;
+            }
+            if (s[i] >= 0x40 && s[i] <= 0x7e) {
+                break;
+            }
+            i++;
+        }
+        int param = atoi(&s[2]);
+        const char *semi = (const char *) memchr(&s[1], ';', i - 1);
+        int shift = semi && atoi(semi + 1) == 2;
+        *used = i + 1;
+
+        if (s[i] == '~') {
+            switch (param) {
+                case 1: return HOME_KEY;
+                case 3: return DEL_KEY;
+                case 4: return END_KEY;
+                case 5: return PAGE_UP;
+                case 6: return PAGE_DOWN;
+                case 7: return HOME_KEY;
+                case 8: return END_KEY;
+                case 200: return PASTE_START;
+                case 201: return PASTE_END;
+            }
+        }
+        else if (shift) {
+            switch (s[i]) {
+                case 'A': return SHIFT_ARROW_UP;
+                case 'B': return SHIFT_ARROW_DOWN;
+                case 'C': return SHIFT_ARROW_RIGHT;
+                case 'D': return SHIFT_ARROW_LEFT;
+                case 'H': return SHIFT_HOME_KEY;
+                case 'F': return SHIFT_END_KEY;
+            }
+        }
+        else {
+            switch (s[i]) {
+                case 'A': return ARROW_UP;
+                case 'B': return ARROW_DOWN;
+                case 'C': return ARROW_RIGHT;
+                case 'D': return ARROW_LEFT;
+                case 'H': return HOME_KEY;
+                case 'F': return END_KEY;
+            }
+        }
+        return '\x1b';
+    }
+    if (s[1] >= 'a' && s[1] <= 'z') {
+        *used = 2;
+        return META_KEY(s[1]);
+    }
+    if (s[1] == 'O') {
+        if (len < 3) {
+            return KEY_INCOMPLETE;
+        }
+        *used = 3;
+        switch (s[2]) {
+            case 'H': return HOME_KEY;
+            case 'F': return END_KEY;
+        }
+    }
+    return '\x1b';
+}
+
+
+/*
+ * Key bindings. A key alone is looked up in direct, which holds the
+ * command bound to it, KEYMAP_UNBOUND, or KEYMAP_CHORD(node) when the key
+ * starts chords. The keys that may follow in a chord hang off that node in
+ * a small trie, as first child and next sibling; a node with children is a
+ * prefix, one without holds the command at the end of its chord.
+ */
+#define KEYMAP_UNBOUND -1
+#define KEYMAP_PREFIX -2
+#define KEYMAP_CHORD(node) (-2 - (node))
+#define KEYMAP_MAX_CHORD 4
+
+struct keymapNode {
+    int key;
+    int command;
+    int child, sibling;
+};
+
+struct keymap {
+    int direct[KEY_CODES];
+    struct keymapNode *nodes;
+    int nnodes;
+    int state;      // node of the chord typed so far, or -1
+};
+
+void keymapInit(struct keymap *m) {
+    for (int k = 0; k < KEY_CODES; k++) {
+        m->direct[k] = KEYMAP_UNBOUND;
+    }
+    m->nodes = NULL;
+    m->nnodes = 0;
+    m->state = -1;
+}
+
+static int keymapNew(struct keymap *m, int key) {
+    m->nodes = (struct keymapNode *) realloc(m->nodes, sizeof(struct keymapNode) * (m->nnodes + 1));
+    struct keymapNode *node = &m->nodes[m->nnodes];
+    node->key = key;
+    node->command = KEYMAP_UNBOUND;
+    node->child = node->sibling = -1;
+    return m->nnodes++;
+}
+
+/*
+ * Binds the n keys to command, or unbinds them with KEYMAP_UNBOUND, which
+ * also unbinds every longer chord they start. Returns -1 for a key out of
+ * range, and leaves the keymap alone for a binding that would cut another
+ * one off: a key or chord that starts longer chords, or a chord through a
+ * key or chord bound to a command. Those have to be unbound first.
+ */
+int keymapBind(struct keymap *m, const int *keys, int n, int command) {
+    if (n < 1 || n > KEYMAP_MAX_CHORD) {
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        if (keys[i] < 0 || keys[i] >= KEY_CODES) {
+            return -1;
+        }
+    }
+    if (n == 1) {
+        if (command != KEYMAP_UNBOUND && m->direct[keys[0]] <= KEYMAP_CHORD(0)) {
+            return -1;
+        }
+        m->direct[keys[0]] = command;
+        return 0;
+    }
+
+    int node;
+    if (m->direct[keys[0]] <= KEYMAP_CHORD(0)) {
+        node = KEYMAP_CHORD(m->direct[keys[0]]);
+    }
+    else if (command == KEYMAP_UNBOUND) {
+        return 0;
+    }
+    else if (m->direct[keys[0]] != KEYMAP_UNBOUND) {
+        return -1;
+    }
+    else {
+        node = keymapNew(m, keys[0]);
+        m->direct[keys[0]] = KEYMAP_CHORD(node);
+    }
+    for (int i = 1; i < n; i++) {
+        int c = m->nodes[node].child;
+        while (c >= 0 && m->nodes[c].key != keys[i]) {
+            c = m->nodes[c].sibling;
+        }
+        if (c < 0) {
+            if (command == KEYMAP_UNBOUND) {
+                return 0;
+            }
+            if (m->nodes[node].child < 0 && m->nodes[node].command != KEYMAP_UNBOUND) {
+                return -1;
+            }
+            c = keymapNew(m, keys[i]);
+            m->nodes[c].sibling = m->nodes[node].child;
+            m->nodes[node].child = c;
+        }
+        node = c;
+    }
+    if (command != KEYMAP_UNBOUND && m->nodes[node].child >= 0) {
+        return -1;
+    }
+    m->nodes[node].command = command;
+    m->nodes[node].child = -1;
+    return 0;
+}
+
+/*
+ * Feeds one key to the keymap. Returns the command it completes,
+ * KEYMAP_PREFIX while a chord is still being typed, or KEYMAP_UNBOUND.
+ */
+int keymapStep(struct keymap *m, int key) {
+    int v = KEYMAP_UNBOUND;
+    if (key >= 0 && key < KEY_CODES) {
+        if (m->state < 0) {
+            v = m->direct[key];
+        }
+        else {
+            int c = m->nodes[m->state].child;
+            while (c >= 0 && m->nodes[c].key != key) {
+                c = m->nodes[c].sibling;
+            }
+            if (c >= 0) {
+                v = m->nodes[c].child >= 0 ? KEYMAP_CHORD(c) : m->nodes[c].command;
+            }
+        }
+    }
+    if (v <= KEYMAP_CHORD(0)) {
+        m->state = KEYMAP_CHORD(v);
+        return KEYMAP_PREFIX;
+    }
+    m->state = -1;
+    return v;
+}
+
+static const struct {
+    const char *name;
+    int key;
+} keyNames[] = {
+    {"Up", ARROW_UP}, {"Down", ARROW_DOWN}, {"Left", ARROW_LEFT}, {"Right", ARROW_RIGHT},
+    {"Home", HOME_KEY}, {"End", END_KEY}, {"PageUp", PAGE_UP}, {"PageDown", PAGE_DOWN},
+    {"Delete", DEL_KEY}, {"Backspace", BACKSPACE}, {"Enter", '\r'}, {"Tab", '\t'},
+    {"Esc", '\x1b'}, {"Space", ' '},
+    {"S-Up", SHIFT_ARROW_UP}, {"S-Down", SHIFT_ARROW_DOWN}, {"S-Left", SHIFT_ARROW_LEFT},
+    {"S-Right", SHIFT_ARROW_RIGHT}, {"S-Home", SHIFT_HOME_KEY}, {"S-End", SHIFT_END_KEY},
+    {"C-Space", 0},
+};
+
+// the code of a key written as C-x, M-x, a key name or a single character; -1 if there is none
+int keymapParseKey(const char *s) {
+    for (unsigned int i = 0; i < sizeof(keyNames) / sizeof(keyNames[0]); i++) {
+        if (strcmp(s, keyNames[i].name) == 0) {
+            return keyNames[i].key;
+        }
+    }
+    if (s[0] == 'C' && s[1] == '-' && s[2] != '\0' && s[3] == '\0') {
+        char c = s[2];
+        if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+        if ((c >= 'a' && c <= 'z') || c == '@' || (c >= '[' && c <= '_')) {
+            return CTRL_KEY(c);
+        }
+        return -1;
+    }
+    if (s[0] == 'M' && s[1] == '-' && s[2] >= 'a' && s[2] <= 'z' && s[3] == '\0') {
+        return META_KEY(s[2]);
+    }
+    if (s[0] > ' ' && s[0] < 0x7f && s[1] == '\0') {
+        return s[0];
+    }
+    return -1;
+}
+
+// writes the name keymapParseKey reads back for key to buf, which needs room for 12 bytes
+void keymapKeyName(int key, char *buf) {
+    for (unsigned int i = 0; i < sizeof(keyNames) / sizeof(keyNames[0]); i++) {
+        if (keyNames[i].key == key) {
+            strcpy(buf, keyNames[i].name);
+            return;
+        }
+    }
+    if (key >= META_KEY('a') && key <= META_KEY('z')) {
+        sprintf(buf, "M-%c", key - META_KEY(0));
+    }
+    else if (key > 0 && key < ' ') {
+        sprintf(buf, "C-%c", key < 27 ? key + 'a' - 1 : key + '@');
+    }
+    else if (key > ' ' && key < 0x7f) {
+        sprintf(buf, "%c", key);
+    }
+    else {
+        sprintf(buf, "#%d", key);
+    }
+}
+
+static int keymapFind(const struct keymap *m, int node, int command, int *keys, int depth) {
+    keys[depth] = m->nodes[node].key;
+    if (m->nodes[node].child < 0) {
+        return m->nodes[node].command == command ? depth + 1 : 0;
+    }
+    for (int c = m->nodes[node].child; c >= 0; c = m->nodes[c].sibling) {
+        int n = keymapFind(m, c, command, keys, depth + 1);
+        if (n > 0) {
+            return n;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Writes the keys command is bound to, as in "C-k C-r", to buf, preferring
+ * a single key to a chord. Returns 0 and leaves buf alone if it is unbound.
+ */
+int keymapDescribe(const struct keymap *m, int command, char *buf, int size) {
+    int keys[KEYMAP_MAX_CHORD], n = 0;
+    for (int k = 0; k < KEY_CODES && n == 0; k++) {
+        if (m->direct[k] == command) {
+            keys[0] = k;
+            n = 1;
+        }
+    }
+    for (int k = 0; k < KEY_CODES && n == 0; k++) {
+        if (m->direct[k] <= KEYMAP_CHORD(0)) {
+            n = keymapFind(m, KEYMAP_CHORD(m->direct[k]), command, keys, 0);
+        }
+    }
+    if (n == 0) {
+        return 0;
+    }
+    int len = 0;
+    buf[0] = '\0';
+    for (int i = 0; i < n && len < size; i++) {
+        char name[12];
+        keymapKeyName(keys[i], name);
+        len += snprintf(buf + len, size - len, "%s%s", i ? " " : "", name);
+    }
+    return 1;
+}
+
+/*
+ * Reads bindings from the file at path. Each line is one of
+ *
+ *     bind KEY... COMMAND    several keys make a chord
+ *     unbind KEY...
+ *
+ * where COMMAND is one of the ncommands names in commands. Lines starting
+ * with # are skipped, and so are bindings to commands not in commands: one
+ * file serves both front ends. A binding keymapBind refuses because it
+ * clashes with an earlier one counts as a line that could not be read.
+ * Returns the number of the first line that could not be read, 0 if every
+ * line could, or -1 if there is no file.
+ */
+int keymapLoad(struct keymap *m, const char *path, const char *const *commands, int ncommands) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        return -1;
+    }
+
+    char *line = NULL;
+    size_t linecap = 0;
+    int lineno = 0, bad = 0;
+    while (getline(&line, &linecap, fp) != -1) {
+        lineno++;
+        char *words[KEYMAP_MAX_CHORD + 2], *save;
+        int n = 0;
+        for (char *w = strtok_r(line, " \t\r\n", &save); w; w = strtok_r(NULL, " \t\r\n", &save)) {
+            if (n == KEYMAP_MAX_CHORD + 2) {
+                n++;
+                break;
+            }
+            words[n++] = w;
+        }
+        if (n == 0 || words[0][0] == '#') {
+            continue;
+        }
+
+        int bind = strcmp(words[0], "bind") == 0;
+        int nkeys = n - 1 - bind;
+        int keys[KEYMAP_MAX_CHORD], ok = (bind || strcmp(words[0], "unbind") == 0) && nkeys >= 1 && nkeys <= KEYMAP_MAX_CHORD;
+        for (int i = 0; ok && i < nkeys; i++) {
+            keys[i] = keymapParseKey(words[1 + i]);
+            ok = keys[i] >= 0;
+        }
+        if (!ok) {
+            if (!bad) bad = lineno;
+            continue;
+        }
+
+        int command = KEYMAP_UNBOUND;
+        for (int i = 0; bind && i < ncommands; i++) {
+            if (strcmp(commands[i], words[n - 1]) == 0) {
+                command = i;
+            }
+        }
+        if (bind && command == KEYMAP_UNBOUND) {
+            continue;
+        }
+        if (keymapBind(m, keys, nkeys, command) == -1 && !bad) {
+            bad = lineno;
+        }
+    }
+    free(line);
+    fclose(fp);
+    return bad;
+}